@@ -1,18 +1,135 @@
+#define _GNU_SOURCE // splice, copy_file_range
+
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
 #define BUFF_SIZE    16384
+#define BUFF_MAX     (1 << 20) // the copy buffer doubles up to this for large transfers
 #define COMMAND_SIZE 4
+#define LINE_SIZE    (PATH_MAX + 32) // a batch command line: "set", the filename, and a length
+#define CHUNK_MAX    (1 << 30) // most bytes asked of one zero-copy call
+
+// Ways of moving bytes from one descriptor to another
+typedef enum { MOVE_SPLICE, MOVE_COPY_RANGE, MOVE_SENDFILE, MOVE_BUFFER } move_t;
+
+char *copy_buf = NULL; // buffer for copies the kernel cannot do itself
+size_t copy_size = 0; // its size, grown by copy_buffered
+char in_buf[LINE_SIZE]; // batch input read ahead of the command being parsed
+size_t in_start = 0, in_end = 0; // the unconsumed bytes of in_buf
 
 void print_error(const char *msg) {
     fprintf(stderr, "%s\n", msg);
     exit(1);
 }
 
+// Writes all len bytes of buf to fd
+int write_all(int fd, const char *buf, size_t len) {
+    size_t written = 0;
+    while (written < len) { // Loop until we've written all the bytes
+        ssize_t wb = write(fd, buf + written, len - written);
+        if (wb == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        written += wb; // Increment the number of bytes written
+    }
+    return 0;
+}
+
+// Picks how to move bytes from in to out without copying them through
+// user space: splice when either end is a pipe, copy_file_range between
+// regular files, and sendfile from a file to anything else, e.g. a socket
+move_t pick_move(int in, int out) {
+    struct stat in_st, out_st;
+    if (fstat(in, &in_st) == -1 || fstat(out, &out_st) == -1) {
+        return MOVE_BUFFER;
+    }
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+        return MOVE_SPLICE;
+    }
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+        return MOVE_COPY_RANGE;
+    }
+    return S_ISREG(in_st.st_mode) ? MOVE_SENDFILE : MOVE_BUFFER;
+}
+
+// Copies up to len bytes from in to out through copy_buf, which starts at
+// BUFF_SIZE and doubles whenever a read fills it, so long copies take
+// fewer system calls while short ones stay small
+ssize_t copy_buffered(int in, int out, size_t len) {
+    if (copy_buf == NULL) {
+        copy_buf = malloc(BUFF_SIZE);
+        if (copy_buf == NULL) {
+            return -1;
+        }
+        copy_size = BUFF_SIZE;
+    }
+    ssize_t rb;
+    do {
+        rb = read(in, copy_buf, len < copy_size ? len : copy_size);
+    } while (rb == -1 && errno == EINTR);
+    if (rb <= 0) {
+        return rb;
+    }
+    if (write_all(out, copy_buf, rb) == -1) {
+        return -1;
+    }
+    if ((size_t) rb == copy_size && copy_size < BUFF_MAX) {
+        char *bigger = realloc(copy_buf, copy_size * 2);
+        if (bigger != NULL) {
+            copy_buf = bigger;
+            copy_size *= 2;
+        }
+    }
+    return rb;
+}
+
+// Copies len bytes from in to out at their current offsets, or until
+// EOF if len is -1. Returns the bytes copied, fewer than len at EOF, or
+// -1 on error
+off_t copy_fd(int in, int out, off_t len) {
+    move_t move = pick_move(in, out);
+    off_t done = 0;
+    while (len < 0 || done < len) {
+        size_t want = len < 0 || len - done > CHUNK_MAX ? CHUNK_MAX : (size_t) (len - done);
+        ssize_t moved;
+        switch (move) {
+        case MOVE_SPLICE: moved = splice(in, NULL, out, NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE); break;
+        case MOVE_COPY_RANGE: moved = copy_file_range(in, NULL, out, NULL, want, 0); break;
+        case MOVE_SENDFILE: moved = sendfile(out, in, NULL, want); break;
+        default: moved = copy_buffered(in, out, want); break;
+        }
+        if (moved == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (move != MOVE_BUFFER && (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EBADF
+                                           || errno == EOPNOTSUPP)) {
+                move = MOVE_BUFFER; // e.g. an O_APPEND stdout, or a filesystem without support
+                continue;
+            }
+            return -1;
+        }
+        if (moved == 0) { // EOF
+            break;
+        }
+        done += moved;
+    }
+    return done;
+}
+
 void get_helper(char *filename) {
     // Open the file for reading
     int fd = open(filename, O_RDONLY);
@@ -20,32 +137,143 @@ void get_helper(char *filename) {
         print_error("Invalid Command");
         return;
     }
-    ssize_t rb, wb; // hold the number of bytes read and written
-    char buf[BUFF_SIZE];
+    // Copy the whole file to stdout, in the kernel where possible
+    if (copy_fd(fd, STDOUT_FILENO, -1) == -1) {
+        print_error("Invalid Command");
+        close(fd);
+        return;
+    }
+    close(fd);
+}
+
+// Returns the next line of batch input without its newline, or NULL at
+// the end of the input. A line that is too long or cut off by EOF ends
+// the batch, since the commands after it can no longer be found
+char *read_line(void) {
     while (1) {
-        rb = read(fd, buf, sizeof(buf)); // Read from the file into the buffer
+        char *newline = memchr(in_buf + in_start, '\n', in_end - in_start);
+        if (newline != NULL) {
+            *newline = '\0';
+            char *line = in_buf + in_start;
+            in_start = newline + 1 - in_buf;
+            return line;
+        }
+        // Move the partial line to the front and read more after it
+        memmove(in_buf, in_buf + in_start, in_end - in_start);
+        in_end -= in_start;
+        in_start = 0;
+        if (in_end == sizeof(in_buf)) {
+            print_error("Invalid Command"); // no newline within the longest valid command
+        }
+        ssize_t rb = read(STDIN_FILENO, in_buf + in_end, sizeof(in_buf) - in_end);
+        if (rb == -1 && errno == EINTR) {
+            continue;
+        }
         if (rb == -1) {
             print_error("Invalid Command");
-            close(fd);
-            return;
-        } else if (rb == 0) { // EOF
-            break;
         }
-        ssize_t written = 0;
-        while (written < rb) { // Loop until we've written all the bytes read
-            wb = write(STDOUT_FILENO, buf + written, rb - written);
-            if (wb == -1) {
+        if (rb == 0) {
+            if (in_end > 0) {
+                print_error("Invalid Command"); // a command without its newline
+            }
+            return NULL;
+        }
+        in_end += rb;
+    }
+}
+
+// Moves a set body of len bytes from stdin to out, taking what was read
+// ahead with the command line first; out -1 discards it
+void take_body(int out, off_t len) {
+    size_t ahead = in_end - in_start < (size_t) len ? in_end - in_start : (size_t) len;
+    if (out != -1 && write_all(out, in_buf + in_start, ahead) == -1) {
+        print_error("Invalid Command");
+    }
+    in_start += ahead;
+    len -= ahead;
+    if (len > 0 && out == -1) {
+        out = open("/dev/null", O_WRONLY);
+        off_t got = out == -1 ? -1 : copy_fd(STDIN_FILENO, out, len);
+        if (out != -1) {
+            close(out);
+        }
+        if (got != len) {
+            print_error("Invalid Command");
+        }
+    } else if (len > 0 && copy_fd(STDIN_FILENO, out, len) != len) {
+        print_error("Invalid Command"); // the body was cut short, or could not be stored
+    }
+}
+
+// Serves length-framed commands from stdin until EOF:
+//   get <filename>\n                  -> OK <length>\n<length bytes>, or ERR\n
+//   set <filename> <length>\n<bytes>  -> OK\n, or ERR\n
+// A file that cannot be opened gets ERR and the batch goes on. A
+// malformed command, or a transfer that fails partway, ends it, since
+// the framing of what follows is lost
+void batch(void) {
+    char *line;
+    while ((line = read_line()) != NULL) {
+        bool get = strncmp(line, "get ", COMMAND_SIZE) == 0;
+        if (!get && strncmp(line, "set ", COMMAND_SIZE) != 0) {
+            print_error("Invalid Command"); // invalid command (not GET or SET)
+        }
+        // The filename runs to the end of a get, and to the length of a set
+        char *filename = line + COMMAND_SIZE;
+        char *space = strchr(filename, ' ');
+        char *end = NULL;
+        long long length = 0;
+        if (space == filename || *filename == '\0' || (get && space != NULL) || (!get && space == NULL)) {
+            print_error("Invalid Command");
+        }
+        if (!get) {
+            *space = '\0';
+            length = strtoll(space + 1, &end, 10);
+            if (!isdigit((unsigned char) space[1]) || *end != '\0') {
                 print_error("Invalid Command");
+            }
+        }
+        if (get) {
+            int fd = open(filename, O_RDONLY);
+            struct stat st;
+            if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+                if (fd != -1) {
+                    close(fd);
+                }
+                if (write_all(STDOUT_FILENO, "ERR\n", 4) == -1) {
+                    print_error("Invalid Command");
+                }
+                continue;
+            }
+            char head[32];
+            int head_len = snprintf(head, sizeof(head), "OK %lld\n", (long long) st.st_size);
+            if (write_all(STDOUT_FILENO, head, head_len) == -1
+                || copy_fd(fd, STDOUT_FILENO, st.st_size) != st.st_size) {
+                print_error("Invalid Command"); // the length is out, so a short body cannot be answered
+            }
+            close(fd);
+        } else {
+            int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            take_body(fd, length);
+            const char *msg = fd == -1 ? "ERR\n" : "OK\n";
+            if (fd != -1) {
                 close(fd);
-                return;
             }
-            written += wb; // Increment the number of bytes written
+            if (write_all(STDOUT_FILENO, msg, strlen(msg)) == -1) {
+                print_error("Invalid Command");
+            }
         }
     }
-    close(fd);
 }
 
-int main(void) {
+int main(int argc, char **argv) {
+    // Option -b: serve a batch of length-framed commands instead of one
+    if (argc == 2 && strcmp(argv[1], "-b") == 0) {
+        batch();
+        return 0;
+    } else if (argc > 1) {
+        print_error("Usage: memory [-b]");
+    }
     char main_buf[BUFF_SIZE];
     int command = COMMAND_SIZE;
     int filename = PATH_MAX * 2;
@@ -135,7 +363,6 @@ int main(void) {
             print_error("Invalid Command");
         }
         int wb, written = 0;
-        int rb;
         bytes_read = bytes_read - (ptr - main_buf) - 1; // the remaining bytes are the content
         char *content = ptr + 1;
         while (written < bytes_read) {
@@ -146,21 +373,10 @@ int main(void) {
             }
             written += wb;
         }
-        while ((rb = read(STDIN_FILENO, main_buf, PATH_MAX))
-               > 0) { // reading the remaining content from STDIN
-            int wb, written = 0;
-            if (rb == -1) {
-                print_error("Invalid Command");
-                close(fd);
-            }
-            while (written < rb) {
-                wb = write(fd, main_buf + written, rb - written);
-                if (wb == -1) {
-                    print_error("Invalid Command");
-                    close(fd);
-                }
-                written += wb;
-            }
+        // reading the remaining content from STDIN, in the kernel where possible
+        if (copy_fd(STDIN_FILENO, fd, -1) == -1) {
+            print_error("Invalid Command");
+            close(fd);
         }
         const char *msg = "OK\n";
         write(STDOUT_FILENO, msg, strlen(msg));
@@ -0,0 +1,57 @@
+#include "arena.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+// function to create an arena with its backing block
+Arena *arena_new(size_t size) {
+    Arena *arena = malloc(sizeof(Arena));
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->base = malloc(size);
+    if (arena->base == NULL) {
+        free(arena);
+        return NULL;
+    }
+    arena->size = size;
+    arena->used = 0;
+    return arena;
+}
+
+// function to delete the arena
+void arena_delete(Arena **arena) {
+    free((*arena)->base);
+    free(*arena);
+    *arena = NULL;
+}
+
+// function to hand out an aligned block
+void *arena_alloc(Arena *arena, size_t n) {
+    size_t align = alignof(max_align_t);
+    size_t start = (arena->used + align - 1) & ~(align - 1); // round up to the alignment
+    if (start > arena->size || n > arena->size - start) {
+        return NULL; // arena is exhausted
+    }
+    arena->used = start + n;
+    return arena->base + start;
+}
+
+// function to copy a string into the arena
+char *arena_strndup(Arena *arena, const char *s, size_t n) {
+    size_t len = strnlen(s, n);
+    if (len + 1 > arena->size - arena->used) {
+        return NULL; // arena is exhausted
+    }
+    char *copy = arena->base + arena->used;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    arena->used += len + 1;
+    return copy;
+}
+
+// function to release everything in the arena
+void arena_reset(Arena *arena) {
+    arena->used = 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * @File arena.h
+ *
+ * A bump allocator for per-connection request state.  Every string and
+ * scratch buffer needed while parsing and serving one request is carved
+ * out of a fixed block, and the whole block is released at once with
+ * arena_reset when the request is done.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/** @struct Arena
+ *
+ *  @brief A fixed-size block of memory handed out front to back.
+ */
+typedef struct Arena {
+    char *base; // start of the block
+    size_t size; // capacity of the block in bytes
+    size_t used; // bytes handed out since the last reset
+} Arena;
+
+/** @brief Dynamically allocates an arena with size bytes of capacity.
+ *
+ *  @param size the capacity of the arena
+ *
+ *  @return a pointer to a new Arena, or NULL if allocation failed
+ */
+Arena *arena_new(size_t size);
+
+/** @brief Frees the arena and its block, and sets *arena to NULL.
+ *
+ *  @param arena the arena to be deleted
+ */
+void arena_delete(Arena **arena);
+
+/** @brief Hands out n bytes aligned for any object type.
+ *
+ *  @param arena the arena to allocate from
+ *
+ *  @param n the number of bytes needed
+ *
+ *  @return a pointer to the bytes, or NULL if the arena is exhausted
+ */
+void *arena_alloc(Arena *arena, size_t n);
+
+/** @brief Copies at most n bytes of s into the arena and NUL-terminates
+ *         the copy.  Strings are packed without alignment padding.
+ *
+ *  @param arena the arena to allocate from
+ *
+ *  @param s the string to copy
+ *
+ *  @param n the maximum number of bytes to copy
+ *
+ *  @return the copy, or NULL if the arena is exhausted
+ */
+char *arena_strndup(Arena *arena, const char *s, size_t n);
+
+/** @brief Releases everything handed out since the last reset.
+ *
+ *  @param arena the arena to reset
+ */
+void arena_reset(Arena *arena);
@@ -1,63 +1,121 @@
 #include "asgn2_helper_funcs.h"
+#include "arena.h"
+#include "parse.h"
+#include "queue.h"
 
 #include <errno.h>
 #include <fcntl.h>
-#include <regex.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 #include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Connections waiting for a worker in concurrent mode
+queue_t *connQueue;
+
+// Serializes the existence check, create, and lock of a PUT target so
+// concurrent PUTs to a new file agree on which one reports 201
+pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Canned responses: status line, headers, and body are fixed for every
+// status code except a successful GET, so they are built at compile time
+// and go out with a single write.
+typedef struct Response {
+    int code; // Status-Code this response answers
+    const char *text; // Complete response, headers and body
+    size_t len; // Length of text, excluding the terminating NUL
+} Response;
+
+#define RESPONSE(code, text) { code, text, sizeof(text) - 1 }
+
+static const Response responses[] = {
+    RESPONSE(200, "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nOK\n"),
+    RESPONSE(201, "HTTP/1.1 201 Created\r\nContent-Length: 8\r\n\r\nCreated\n"),
+    RESPONSE(400, "HTTP/1.1 400 Bad Request\r\nContent-Length: 12\r\n\r\nBad Request\n"),
+    RESPONSE(403, "HTTP/1.1 403 Forbidden\r\nContent-Length: 10\r\n\r\nForbidden\n"),
+    RESPONSE(404, "HTTP/1.1 404 Not Found\r\nContent-Length: 10\r\n\r\nNot Found\n"),
+    RESPONSE(500,
+        "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 22\r\n\r\nInternal Server Error\n"),
+    RESPONSE(501, "HTTP/1.1 501 Not Implemented\r\nContent-Length: 16\r\n\r\nNot Implemented\n"),
+    RESPONSE(505,
+        "HTTP/1.1 505 Version Not Supported\r\nContent-Length: 22\r\n\r\nVersion Not Supported\n"),
+};
+
+// Prefix of a successful GET; only the Content-Length value varies.
+#define GET_OK_PREFIX "HTTP/1.1 200 OK\r\nContent-Length: "
+#define GET_OK_SUFFIX "\r\n\r\n"
+
+// helper function to write every iovec, resuming after partial writes
+ssize_t writev_all(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    while (iovcnt > 0) {
+        ssize_t wb = writev(fd, iov, iovcnt);
+        if (wb == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += wb;
+        // skip the iovecs that were fully written and trim the partial one
+        while (iovcnt > 0 && (size_t) wb >= iov->iov_len) {
+            wb -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + wb;
+            iov->iov_len -= wb;
+        }
+    }
+    return total;
+}
 
-#define BUFF_SIZE 8192
-
-#define METHOD       "([a-zA-Z]{1,8}) "
-#define URI          "/([a-zA-Z0-9.-]{1,63}) "
-#define VERSION      "(HTTP/[0-9]\\.[0-9])\r\n"
-#define FULL_REQUEST "^" METHOD URI VERSION
-#define HEADER       "([a-zA-Z0-9.-]{1,128}): ([ -~]{1,128})\r\n"
-
-typedef struct Requests {
-    int inputFile; // File descriptor of the client's input file
-    int msgSize; // Size of the message body (if any) in the client's request
-    int bytesLeft; // Number of bytes left to read in the message body
-    char *get_put; // Pointer to the HTTP method (GET or PUT) extracted from the client's request
-    char *path; // Pointer to the target path extracted from the client's request
-    char *httpVersion; // Pointer to the HTTP version extracted from the client's request
-    char *msg; // Pointer to the message body (if any) in the client's request
-} Requests;
+// helper function to send the canned response for a status-code
+void send_response(int status_code, int fd) {
+    for (size_t i = 0; i < sizeof(responses) / sizeof(responses[0]); i++) {
+        if (responses[i].code == status_code) {
+            write_all(fd, (char *) responses[i].text, responses[i].len);
+            return;
+        }
+    }
+}
 
 // helper function to handle different status-codes
 void handle_error(int status_code, int fd) {
-    switch (status_code) {
-    case 400: // Status-Code 400: When a request is ill-formatted.
-        dprintf(fd, "HTTP/1.1 400 Bad Request\r\nContent-Length: %d\r\n\r\nBad Request\n", 12);
-        break;
-    case 403: // Status-Code 403: When the server cannot access the URI's files.
-        dprintf(fd, "HTTP/1.1 403 Forbidden\r\nContent-Length: %d\r\n\r\nForbidden\n", 10);
-        break;
-    case 404: // Status-Code 404: When the URI's file does not exist.
-        dprintf(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: %d\r\n\r\nNot Found\n", 10);
-        break;
-    case 500: // Status-Code 500: When an unexpected issue prevents processing.
-        dprintf(fd,
-            "HTTP/1.1 500 Internal Server Error\r\nContent-Length: %d\r\n\r\nInternal Server "
-            "Error\n",
-            22);
-        break;
-    case 501: // Status-Code 501: When a request includes an uninmplemented Method.
-        dprintf(
-            fd, "HTTP/1.1 501 Not Implemented\r\nContent-Length: %d\r\n\r\nNot Implemented\n", 16);
-        break;
-    case 505: // Status-Code 505: When a request includes an unsupported version.
-        dprintf(fd,
-            "HTTP/1.1 505 Version Not Supported\r\nContent-Length: %d\r\n\r\nVersion Not "
-            "Supported\n",
-            22);
-        break;
-    default: break;
+    send_response(status_code, fd);
+}
+
+// helper function to toggle TCP_CORK; harmless on sockets that are not TCP
+void setCork(int fd, int on) {
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// helper function to build the header of a successful GET into head.
+// Returns the header length.
+size_t formatGetHeader(char *head, off_t fileSize) {
+    char digits[24];
+    int n = 0;
+    do { // Content-Length digits, least significant first
+        digits[n++] = '0' + fileSize % 10;
+        fileSize /= 10;
+    } while (fileSize > 0);
+
+    size_t len = sizeof(GET_OK_PREFIX) - 1;
+    memcpy(head, GET_OK_PREFIX, len);
+    while (n > 0) {
+        head[len++] = digits[--n];
     }
+    memcpy(head + len, GET_OK_SUFFIX, sizeof(GET_OK_SUFFIX) - 1);
+    return len + sizeof(GET_OK_SUFFIX) - 1;
 }
 
 // helper function to check if directory
@@ -69,92 +127,6 @@ int isDirectory(const char *path) {
     return S_ISDIR(statbuf.st_mode);
 }
 
-// helper function to extract request line components
-void extractRequestLine(Requests *requestObj, char *buff, regmatch_t match[]) {
-
-    // Extract the GET/PUT method from the buffer and store it in the requests struct
-    requestObj->get_put = strndup(buff, match[1].rm_eo);
-
-    // Extract the target path from the buffer and store it in the requests struct
-    requestObj->path = strndup(buff + match[2].rm_so, match[2].rm_eo - match[2].rm_so);
-
-    // Extract the HTTP version from the buffer and store it in the requests struct
-    requestObj->httpVersion = strndup(buff + match[3].rm_so, match[3].rm_eo - match[3].rm_so);
-}
-
-// helper function to extract headers
-void extractHeader(Requests *requestObj, char *buff, regmatch_t match[]) {
-
-    // extract header name and value
-    char *headerName = strndup(buff + match[1].rm_so, match[1].rm_eo - match[1].rm_so);
-    char *headerValue = strndup(buff + match[2].rm_so, match[2].rm_eo - match[2].rm_so);
-
-    // check if header is "Content-Length" and update value
-    if (strncmp(headerName, "Content-Length", 14) == 0) {
-        int val = strtol(headerValue, NULL, 10);
-        if (errno == EINVAL) {
-            handle_error(400, requestObj->inputFile);
-        }
-        requestObj->msgSize = val;
-    }
-
-    // free allocated memory
-    free(headerName);
-    free(headerValue);
-}
-
-int parseRequest(Requests *requestObj, char *buff, ssize_t bytes_read) {
-
-    regex_t regex;
-    regmatch_t match[4];
-
-    int rc;
-    // compile and execute the regex to match the request line
-    rc = regcomp(&regex, FULL_REQUEST, REG_EXTENDED);
-    rc = regexec(&regex, buff, 4, match, 0);
-
-    int offset = 0;
-    if (rc == 0) {
-        // extract request line components
-        extractRequestLine(requestObj, buff, match);
-        buff += match[3].rm_eo + 2; // move buffer pointer past CRLF after request line
-        offset += match[3].rm_eo + 2; // update total offset
-    } else {
-        // handle invalid request line
-        handle_error(400, requestObj->inputFile);
-        regfree(&regex);
-        return (1);
-    }
-
-    // reset regex and match headers
-    requestObj->msgSize = -1; // reset content length
-    rc = regcomp(&regex, HEADER, REG_EXTENDED);
-    rc = regexec(&regex, buff, 3, match, 0);
-
-    while (rc == 0) {
-        // extract header fields
-        extractHeader(requestObj, buff, match);
-        buff += match[2].rm_eo + 2; // move buffer pointer past header and CRLF
-        offset += match[2].rm_eo + 2; // update total offset
-        rc = regexec(&regex, buff, 3, match, 0);
-    }
-
-    // check if there's a message
-    if ((rc != 0) && (buff[0] == '\r' && buff[1] == '\n')) {
-        requestObj->msg = buff + 2; // set msg to beginning of message
-        offset += 2; // update total offset
-        requestObj->bytesLeft = bytes_read - offset; // calculate the bytes left
-    } else if (rc != 0) {
-        // handle invalid header fields
-        handle_error(400, requestObj->inputFile);
-        regfree(&regex);
-        return (1);
-    }
-
-    regfree(&regex);
-    return (EXIT_SUCCESS);
-}
-
 void getRequest(Requests *requestObj) {
 
     // Open the file specified by the path in read-only mode
@@ -180,6 +152,9 @@ void getRequest(Requests *requestObj) {
     // If the file was successfully opened
     else {
 
+        // Lock the file in shared mode so concurrent GETs proceed together but wait for a PUT
+        flock(fd, LOCK_SH);
+
         // Use fstat to get all file information.
         struct stat fileStat;
 
@@ -195,33 +170,64 @@ void getRequest(Requests *requestObj) {
         // If the file is not a directory
         else {
 
-            // Get the file size and send an HTTP response with the file size
+            // Get the file size and read the first chunk of the body
             off_t fileSize = fileStat.st_size;
-            dprintf(
-                requestObj->inputFile, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n", fileSize);
-
-            // Call the pass_bytes helper function to read bytes from the file and write them to the response
-            int bytesWritten = pass_bytes(fd, requestObj->inputFile, fileSize);
+            char head[sizeof(GET_OK_PREFIX) + sizeof(GET_OK_SUFFIX) + 24];
+            char *body = arena_alloc(requestObj->arena, BUFF_SIZE);
+            ssize_t bodyLen = -1;
+            if (body != NULL) {
+                bodyLen = read_until(fd, body, fileSize < BUFF_SIZE ? fileSize : BUFF_SIZE, NULL);
+            }
 
-            // If there was an error during the pass_bytes call, handle the error
-            if (bytesWritten == -1) {
+            if (bodyLen == -1) {
                 handle_error(500, requestObj->inputFile);
+            } else {
+                struct iovec iov[2];
+                iov[0].iov_base = head;
+                iov[0].iov_len = formatGetHeader(head, fileSize);
+                iov[1].iov_base = body;
+                iov[1].iov_len = bodyLen;
+
+                // Small files go out as one writev; larger ones are corked so the
+                // header, first chunk, and remaining bytes fill full segments.
+                off_t remaining = fileSize - bodyLen;
+                if (remaining > 0) {
+                    setCork(requestObj->inputFile, 1);
+                }
+                ssize_t bytesWritten = writev_all(requestObj->inputFile, iov, 2);
+
+                // Call the pass_bytes helper function to move the rest of the file to the response
+                if (bytesWritten != -1 && remaining > 0) {
+                    bytesWritten = pass_bytes(fd, requestObj->inputFile, remaining);
+                }
+                if (remaining > 0) {
+                    setCork(requestObj->inputFile, 0);
+                }
+
+                // If there was an error while sending the body, handle the error
+                if (bytesWritten == -1) {
+                    handle_error(500, requestObj->inputFile);
+                }
             }
         }
 
-        // Close the file
+        // Unlock and close the file
+        flock(fd, LOCK_UN);
         close(fd);
     }
 }
 
 void putRequest(Requests *requestObj) {
 
-    int fd = open(requestObj->path, O_WRONLY | O_TRUNC, 0666);
+    int fd;
     int status_code = 0;
 
+    pthread_mutex_lock(&createLock);
+
     // Check if file already exists
     if (access(requestObj->path, F_OK) == 0) {
-        // File already exists, truncate it
+        // File already exists, it is truncated once the lock is held
+        fd = open(requestObj->path, O_WRONLY, 0666);
         if (fd == -1) {
             // Handle error if unable to open file for writing
             if (errno == EACCES) {
@@ -244,6 +250,20 @@ void putRequest(Requests *requestObj) {
         }
         status_code = 201; // File created successfully
     }
+    if (fd == -1) {
+        pthread_mutex_unlock(&createLock);
+        return;
+    }
+
+    // Lock the file exclusively, then truncate so readers never see a partial rewrite
+    flock(fd, LOCK_EX);
+    pthread_mutex_unlock(&createLock);
+    if (ftruncate(fd, 0) == -1) {
+        handle_error(500, requestObj->inputFile); // Internal server error
+        flock(fd, LOCK_UN);
+        close(fd);
+        return;
+    }
 
     // Write request msg to file
     int bytesWritten = write_all(fd, requestObj->msg,
@@ -262,27 +282,118 @@ void putRequest(Requests *requestObj) {
         handle_error(500, requestObj->inputFile); // Internal server error
     }
     // Send response message
-    if (status_code == 201) {
-        dprintf(requestObj->inputFile,
-            "HTTP/1.1 201 Created\r\nContent-Length: %d\r\n\r\nCreated\n", 8);
-    } else if (status_code == 200) {
-        dprintf(requestObj->inputFile, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\nOK\n", 3);
-    }
-    // Close the file
+    send_response(status_code, requestObj->inputFile);
+    // Unlock and close the file
+    flock(fd, LOCK_UN);
     close(fd);
 }
 
+// helper function to serve one connection with the caller's buffer and arena
+void handleConnection(int client_socket, char *buf, Arena *arena) {
+    // Create a new Requests object and store the file descriptor in its inputFile field
+    Requests requestObj;
+    requestObj.inputFile = client_socket;
+    requestObj.arena = arena;
+
+    if (client_socket == -1) {
+        fprintf(stderr, "Error while establishing connection\n");
+        return;
+    }
+
+    // Read data from the client and store it in the buffer
+    ssize_t bytes_read = read_until(client_socket, buf, BUFF_SIZE - 1, "\r\n\r\n");
+
+    // Parse the request from the client and determine which action to take
+    int parsed = parseRequest(&requestObj, buf, bytes_read);
+    if (parsed == 1) {
+        handle_error(400, requestObj.inputFile);
+    }
+
+    if (bytes_read == -1) {
+        handle_error(400, requestObj.inputFile);
+    }
+    if (parsed != 1) {
+        if (strncmp(requestObj.httpVersion, "HTTP/1.1", 8) != 0) {
+            handle_error(505, requestObj.inputFile);
+        } else if (requestObj.get_put[0] == 'G' && requestObj.get_put[1] == 'E'
+                   && requestObj.get_put[2] == 'T') {
+
+            // Verify if the GET request has a message or a content length if so, return a 400 Bad Request error to the client.
+            if (requestObj.bytesLeft > 0) {
+                handle_error(400, requestObj.inputFile);
+            }
+            if (requestObj.msgSize != -1) {
+                handle_error(400, requestObj.inputFile);
+            }
+            getRequest(&requestObj);
+        } else if (requestObj.get_put[0] == 'P' && requestObj.get_put[1] == 'U'
+                   && requestObj.get_put[2] == 'T') {
+
+            if (requestObj.msgSize == -1) {
+                handle_error(400, requestObj.inputFile);
+            }
+            // Check if target path is a directory
+            if (isDirectory(requestObj.path) == 1) {
+                handle_error(403, requestObj.inputFile);
+            }
+            putRequest(&requestObj);
+        } else {
+            handle_error(501, requestObj.inputFile);
+        }
+    }
+    // Close the connection to the client, clear the buffer, and release the request's strings
+    close(client_socket);
+    memset(buf, '\0', BUFF_SIZE);
+    arena_reset(arena);
+}
+
+// worker thread for concurrent mode; each worker owns its buffer and arena
+void *worker(void *arg) {
+    (void) arg;
+    char *buf = calloc(1, BUFF_SIZE);
+    Arena *arena = arena_new(ARENA_SIZE);
+    if (buf == NULL || arena == NULL) {
+        fprintf(stderr, "Failed to allocate worker buffers\n");
+        exit(1);
+    }
+    while (true) {
+        // Get the next connection from the dispatcher
+        uintptr_t client_socket = -1;
+        queue_pop(connQueue, (void **) &client_socket);
+        handleConnection(client_socket, buf, arena);
+    }
+    return NULL;
+}
+
 int main(int argc, char *argv[]) {
+    int option = 0;
+    int num_threads = 0; // Serve connections one at a time unless -t is given
+    while ((option = getopt(argc, argv, "t:")) != -1) {
+        switch (option) {
+        case 't':
+            // Option -t: Serve connections concurrently with this many worker threads
+            num_threads = atoi(optarg);
+            if (num_threads < 1) {
+                fprintf(stderr, "Invalid thread count\n");
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: ./httpserver [-t threads] <port>\n");
+            exit(1);
+        }
+    }
+
     // Check command line for correct number of arguments
-    if (argc != 2) {
-        fprintf(stderr, "usage: ./httpserver <port>\n");
+    if (argc - optind != 1) {
+        fprintf(stderr, "usage: ./httpserver [-t threads] <port>\n");
         exit(1);
     }
 
     // Declare variable to hold the Listener_Socket object
     Listener_Socket sd;
 
-    int port_num = atoi(argv[1]); // Converting to integer
+    int port_num = atoi(argv[optind]); // Converting to integer
 
     if (port_num > 65535 || port_num < 1) {
         fprintf(stderr, "Invalid Port\n");
@@ -298,63 +409,38 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    compileRegexes();
+
+    if (num_threads > 0) {
+        // Concurrent mode: the main thread only accepts and hands connections to the workers
+        connQueue = queue_new(num_threads);
+        pthread_t th[num_threads];
+        for (int i = 0; i < num_threads; i++) {
+            pthread_create(&th[i], NULL, worker, NULL);
+        }
+        while (true) {
+            uintptr_t client_socket = listener_accept(&sd);
+            queue_push(connQueue, (void *) client_socket);
+        }
+    }
+
     char buf[BUFF_SIZE];
     memset(buf, '\0', sizeof(buf));
 
+    // One arena serves each connection in turn and is reset after every request
+    Arena *arena = arena_new(ARENA_SIZE);
+    if (arena == NULL) {
+        fprintf(stderr, "Failed to allocate request arena\n");
+        exit(1);
+    }
+
     bool x = true;
     while (x) {
         // Wait for a client to connect and obtain a file descriptor for the new socket.
         int client_socket = listener_accept(&sd);
-
-        // Create a new Requests object and store the file descriptor in its inputFile field
-        Requests requestObj;
-        requestObj.inputFile = client_socket;
-
-        if (client_socket == -1) {
-            fprintf(stderr, "Error while establishing connection\n");
-        }
-
-        // Read data from the client and store it in the buffer
-        ssize_t bytes_read = read_until(client_socket, buf, BUFF_SIZE, "\r\n\r\n");
-
-        // Parse the request from the client and determine which action to take
-        int parsed = parseRequest(&requestObj, buf, bytes_read);
-
-        if (bytes_read == -1) {
-            handle_error(400, requestObj.inputFile);
-        }
-        if (parsed != 1) {
-            if (strncmp(requestObj.httpVersion, "HTTP/1.1", 8) != 0) {
-                handle_error(505, requestObj.inputFile);
-            } else if (requestObj.get_put[0] == 'G' && requestObj.get_put[1] == 'E'
-                       && requestObj.get_put[2] == 'T') {
-
-                // Verify if the GET request has a message or a content length if so, return a 400 Bad Request error to the client.
-                if (requestObj.bytesLeft > 0) {
-                    handle_error(400, requestObj.inputFile);
-                }
-                if (requestObj.msgSize != -1) {
-                    handle_error(400, requestObj.inputFile);
-                }
-                getRequest(&requestObj);
-            } else if (requestObj.get_put[0] == 'P' && requestObj.get_put[1] == 'U'
-                       && requestObj.get_put[2] == 'T') {
-
-                if (requestObj.msgSize == -1) {
-                    handle_error(400, requestObj.inputFile);
-                }
-                // Check if target path is a directory
-                if (isDirectory(requestObj.path) == 1) {
-                    handle_error(403, requestObj.inputFile);
-                }
-                putRequest(&requestObj);
-            } else {
-                handle_error(501, requestObj.inputFile);
-            }
-        }
-        // Close the connection to the client and clear the buffer
-        close(client_socket);
-        bzero(buf, sizeof(buf));
+        handleConnection(client_socket, buf, arena);
     }
+    arena_delete(&arena);
+    freeRegexes();
     return (EXIT_SUCCESS);
 }
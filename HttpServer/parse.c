@@ -0,0 +1,125 @@
+#include "parse.h"
+
+#include <errno.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define METHOD       "([a-zA-Z]{1,8}) "
+#define URI          "/([a-zA-Z0-9.-]{1,63}) "
+#define VERSION      "(HTTP/[0-9]\\.[0-9])\r\n"
+#define FULL_REQUEST "^" METHOD URI VERSION
+// Anchored, so a header is only ever matched where the previous line ended
+#define HEADER       "^([a-zA-Z0-9.-]{1,128}): ([ -~]{1,128})\r\n"
+
+// Patterns for the request line and headers, compiled once at startup
+static regex_t requestRegex;
+static regex_t headerRegex;
+
+// helper function to compile the request patterns
+void compileRegexes(void) {
+    if (regcomp(&requestRegex, FULL_REQUEST, REG_EXTENDED) != 0
+        || regcomp(&headerRegex, HEADER, REG_EXTENDED) != 0) {
+        fprintf(stderr, "Failed to compile request patterns\n");
+        exit(1);
+    }
+}
+
+// helper function to free the request patterns
+void freeRegexes(void) {
+    regfree(&requestRegex);
+    regfree(&headerRegex);
+}
+
+// helper function to extract request line components
+int extractRequestLine(Requests *requestObj, char *buff, regmatch_t match[]) {
+
+    // Extract the GET/PUT method from the buffer and store it in the requests struct
+    requestObj->get_put = arena_strndup(requestObj->arena, buff, match[1].rm_eo);
+
+    // Extract the target path from the buffer and store it in the requests struct
+    requestObj->path = arena_strndup(
+        requestObj->arena, buff + match[2].rm_so, match[2].rm_eo - match[2].rm_so);
+
+    // Extract the HTTP version from the buffer and store it in the requests struct
+    requestObj->httpVersion = arena_strndup(
+        requestObj->arena, buff + match[3].rm_so, match[3].rm_eo - match[3].rm_so);
+
+    // The arena is sized to hold the whole request head, so this only fails on a corrupt request
+    if (requestObj->get_put == NULL || requestObj->path == NULL
+        || requestObj->httpVersion == NULL) {
+        return (1);
+    }
+    return (EXIT_SUCCESS);
+}
+
+// helper function to extract headers
+int extractHeader(Requests *requestObj, char *buff, regmatch_t match[]) {
+
+    // extract header name and value
+    char *headerName = arena_strndup(
+        requestObj->arena, buff + match[1].rm_so, match[1].rm_eo - match[1].rm_so);
+    char *headerValue = arena_strndup(
+        requestObj->arena, buff + match[2].rm_so, match[2].rm_eo - match[2].rm_so);
+    if (headerName == NULL || headerValue == NULL) {
+        return (1);
+    }
+
+    // check if header is "Content-Length" and update value
+    if (strncmp(headerName, "Content-Length", 14) == 0) {
+        errno = 0; // EINVAL must come from this call, not an earlier one
+        int val = strtol(headerValue, NULL, 10);
+        if (errno == EINVAL) {
+            return (1);
+        }
+        requestObj->msgSize = val;
+    }
+
+    // headerName and headerValue are released with the arena
+    return (EXIT_SUCCESS);
+}
+
+int parseRequest(Requests *requestObj, char *buff, ssize_t bytes_read) {
+
+    regmatch_t match[4];
+
+    int rc;
+    // execute the precompiled regex to match the request line
+    rc = regexec(&requestRegex, buff, 4, match, 0);
+
+    int offset = 0;
+    if (rc == 0 && extractRequestLine(requestObj, buff, match) == EXIT_SUCCESS) {
+        buff += match[3].rm_eo + 2; // move buffer pointer past CRLF after request line
+        offset += match[3].rm_eo + 2; // update total offset
+    } else {
+        // invalid request line
+        return (1);
+    }
+
+    // match headers
+    requestObj->msgSize = -1; // reset content length
+    rc = regexec(&headerRegex, buff, 3, match, 0);
+
+    while (rc == 0) {
+        // extract header fields
+        if (extractHeader(requestObj, buff, match) != EXIT_SUCCESS) {
+            return (1);
+        }
+        buff += match[2].rm_eo + 2; // move buffer pointer past header and CRLF
+        offset += match[2].rm_eo + 2; // update total offset
+        rc = regexec(&headerRegex, buff, 3, match, 0);
+    }
+
+    // check if there's a message
+    if ((rc != 0) && (buff[0] == '\r' && buff[1] == '\n')) {
+        requestObj->msg = buff + 2; // set msg to beginning of message
+        offset += 2; // update total offset
+        requestObj->bytesLeft = bytes_read - offset; // calculate the bytes left
+    } else if (rc != 0) {
+        // invalid header fields
+        return (1);
+    }
+
+    return (EXIT_SUCCESS);
+}
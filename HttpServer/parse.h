@@ -0,0 +1,59 @@
+/**
+ * @File parse.h
+ *
+ * The request parser: the request line and headers of a request head
+ * are matched with precompiled regular expressions and copied into the
+ * request's arena.  It makes no system calls, so the benchmark and the
+ * fuzz harness run it on buffers in memory.
+ */
+
+#pragma once
+
+#include "arena.h"
+
+#include <sys/types.h>
+
+#define BUFF_SIZE 8192
+
+// Parse-time strings never take more room than the request head they are
+// copied from, so two buffers' worth also covers a GET's first body chunk.
+#define ARENA_SIZE (2 * BUFF_SIZE)
+
+/** @struct Requests
+ *
+ *  @brief A parsed request.  Its strings live in its arena.
+ */
+typedef struct Requests {
+    int inputFile; // File descriptor of the client's input file
+    int msgSize; // Size of the message body (if any) in the client's request
+    int bytesLeft; // Number of bytes left to read in the message body
+    char *get_put; // Pointer to the HTTP method (GET or PUT) extracted from the client's request
+    char *path; // Pointer to the target path extracted from the client's request
+    char *httpVersion; // Pointer to the HTTP version extracted from the client's request
+    char *msg; // Pointer to the message body (if any) in the client's request
+    Arena *arena; // Per-connection arena holding the request's strings and scratch buffers
+} Requests;
+
+/** @brief Compiles the request line and header patterns.  Exits if they
+ *         do not compile.  Must be called before parseRequest.
+ */
+void compileRegexes(void);
+
+/** @brief Frees the compiled patterns.
+ */
+void freeRegexes(void);
+
+/** @brief Parses the request line and headers at the start of buff.
+ *
+ *  @param requestObj receives the request; its arena must be set
+ *
+ *  @param buff the request head and any body bytes after it,
+ *         NUL-terminated
+ *
+ *  @param bytes_read the bytes in buff
+ *
+ *  @return EXIT_SUCCESS, with msg pointing just past the head and
+ *          bytesLeft counting the bytes from there to bytes_read, or 1
+ *          if the request is malformed and should get a 400
+ */
+int parseRequest(Requests *requestObj, char *buff, ssize_t bytes_read);
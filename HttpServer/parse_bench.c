@@ -0,0 +1,224 @@
+#include "arena.h"
+#include "parse.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CORPUS_MAX 64 // requests in the corpus
+#define BURST      8 // requests in a pipelined burst
+
+// One corpus entry: a buffer as read_until would leave it, and what it exercises
+typedef struct {
+    const char *kind;
+    char *text;
+    size_t len;
+    int requests; // request heads back to back in text
+} Sample;
+
+static Sample corpus[CORPUS_MAX];
+static int corpusSize = 0;
+static unsigned long long seed = 88172645463325252ULL; // xorshift state, fixed so runs compare
+
+// helper function for a repeatable pseudo-random number
+unsigned long long nextRandom(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+// helper function to append random characters from a set
+size_t appendRandom(char *out, size_t len, const char *set) {
+    size_t n = strlen(set);
+    for (size_t i = 0; i < len; i++) {
+        out[i] = set[nextRandom() % n];
+    }
+    return len;
+}
+
+// helper function to write one request head, and its body for a PUT, at out
+size_t buildRequest(char *out, const char *method, int uriLen, int headers, int valueLen, int bodyLen) {
+    static const char nameChars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-";
+    static const char valueChars[] = "abcdefghijklmnopqrstuvwxyz0123456789 ;=,/:-_.";
+    size_t len = sprintf(out, "%s /", method);
+    len += appendRandom(out + len, uriLen, nameChars);
+    len += sprintf(out + len, " HTTP/1.1\r\nHost: localhost:8080\r\n");
+    for (int h = 0; h < headers; h++) {
+        len += sprintf(out + len, "X-Header-%d: ", h);
+        len += appendRandom(out + len, valueLen, valueChars);
+        len += sprintf(out + len, "\r\n");
+    }
+    if (bodyLen >= 0) {
+        len += sprintf(out + len, "Content-Length: %d\r\n", bodyLen);
+    }
+    len += sprintf(out + len, "\r\n");
+    if (bodyLen > 0) {
+        len += appendRandom(out + len, bodyLen, valueChars);
+    }
+    return len;
+}
+
+// helper function to add a sample to the corpus
+void addSample(const char *kind, const char *text, size_t len, int requests) {
+    Sample *s = &corpus[corpusSize++];
+    s->kind = kind;
+    s->text = malloc(len + 1);
+    memcpy(s->text, text, len);
+    s->text[len] = '\0';
+    s->len = len;
+    s->requests = requests;
+}
+
+/*
+* buildCorpus() makes the requests the benchmark times and the fuzzer
+* starts from: GETs with a growing number of headers, GETs with long
+* names and header values, PUTs with the first bytes of their bodies in
+* the buffer, pipelined bursts of requests, and a few malformed heads.
+*/
+void buildCorpus(void) {
+    char buf[BUFF_SIZE];
+    static const int headerCounts[] = { 0, 1, 4, 8, 16, 32 };
+    for (size_t i = 0; i < sizeof(headerCounts) / sizeof(headerCounts[0]); i++) {
+        addSample("headers", buf, buildRequest(buf, "GET", 12, headerCounts[i], 24, -1), 1);
+    }
+    static const int valueLens[] = { 8, 32, 64, 128 };
+    for (size_t i = 0; i < sizeof(valueLens) / sizeof(valueLens[0]); i++) {
+        addSample("long-lines", buf, buildRequest(buf, "GET", 63, 6, valueLens[i], -1), 1);
+    }
+    static const int bodyLens[] = { 0, 16, 512, 4096 };
+    for (size_t i = 0; i < sizeof(bodyLens) / sizeof(bodyLens[0]); i++) {
+        addSample("put", buf, buildRequest(buf, "PUT", 20, 3, 24, bodyLens[i]), 1);
+    }
+    for (int b = 0; b < 4; b++) {
+        size_t len = 0;
+        for (int r = 0; r < BURST; r++) {
+            bool put = (r + b) % 3 == 0;
+            len += buildRequest(buf + len, put ? "PUT" : "GET", 8 + r, 2 + b, 20, put ? 32 : -1);
+        }
+        addSample("pipelined", buf, len, BURST);
+    }
+    static const char *malformed[] = {
+        "GET /a HTTP/1.1\r\nHost localhost\r\n\r\n",
+        "GET a HTTP/1.1\r\n\r\n",
+        "GET /a/b HTTP/1.1\r\n\r\n",
+        "GETTINGLONG /a HTTP/1.1\r\n\r\n",
+        "PUT /a HTTP/1.1\r\nContent-Length: 5\r\n",
+    };
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+        addSample("malformed", malformed[i], strlen(malformed[i]), 1);
+    }
+}
+
+/*
+* parseAll() parses every request in a sample the way a pipelining
+* client would send them: each starts where the previous one's body
+* ends. Returns the requests parsed.
+*/
+int parseAll(Sample *s, Arena *arena) {
+    char *at = s->text;
+    ssize_t left = s->len;
+    int parsed = 0;
+    while (left > 0) {
+        Requests requestObj = { 0 };
+        requestObj.inputFile = -1;
+        requestObj.arena = arena;
+        int rc = parseRequest(&requestObj, at, left);
+        arena_reset(arena);
+        if (rc != EXIT_SUCCESS) {
+            break;
+        }
+        parsed++;
+        int body = requestObj.msgSize > 0 && requestObj.msgSize <= requestObj.bytesLeft ? requestObj.msgSize : 0;
+        left = requestObj.bytesLeft - body;
+        at = requestObj.msg + body;
+    }
+    return parsed;
+}
+
+// helper function to read a monotonic clock in seconds
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// helper function to write the corpus out as one file per sample, for the fuzzer to start from
+void writeCorpus(const char *dir) {
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror(dir);
+        exit(1);
+    }
+    for (int i = 0; i < corpusSize; i++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%02d-%s", dir, i, corpus[i].kind);
+        FILE *f = fopen(path, "w");
+        if (f == NULL || fwrite(corpus[i].text, 1, corpus[i].len, f) != corpus[i].len) {
+            perror(path);
+            exit(1);
+        }
+        fclose(f);
+    }
+    printf("wrote %d samples to %s\n", corpusSize, dir);
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = 0.5; // time spent on each kind of sample
+    const char *corpusDir = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "t:w:")) != -1) {
+        switch (option) {
+        case 't': seconds = atof(optarg); break;
+        case 'w': corpusDir = optarg; break;
+        default: fprintf(stderr, "usage: ./parse_bench [-t seconds_per_kind] [-w corpus_dir]\n"); exit(1);
+        }
+    }
+    buildCorpus();
+    if (corpusDir != NULL) {
+        writeCorpus(corpusDir);
+        return 0;
+    }
+    compileRegexes();
+    Arena *arena = arena_new(ARENA_SIZE);
+    if (arena == NULL) {
+        fprintf(stderr, "Failed to allocate request arena\n");
+        exit(1);
+    }
+
+    // Check the corpus parses as intended before timing it
+    for (int i = 0; i < corpusSize; i++) {
+        int expected = strcmp(corpus[i].kind, "malformed") == 0 ? 0 : corpus[i].requests;
+        if (parseAll(&corpus[i], arena) != expected) {
+            fprintf(stderr, "sample %d (%s) parsed wrongly\n", i, corpus[i].kind);
+            exit(1);
+        }
+    }
+
+    printf("%-12s %12s %10s %10s\n", "kind", "requests/s", "ns/byte", "MB/s");
+    const char *kinds[] = { "headers", "long-lines", "put", "pipelined", "malformed" };
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        long requests = 0;
+        double bytes = 0;
+        double start = now(), elapsed = 0;
+        while (elapsed < seconds) {
+            for (int i = 0; i < corpusSize; i++) {
+                if (strcmp(corpus[i].kind, kinds[k]) == 0) {
+                    parseAll(&corpus[i], arena);
+                    requests += corpus[i].requests;
+                    bytes += corpus[i].len;
+                }
+            }
+            elapsed = now() - start;
+        }
+        printf("%-12s %12.0f %10.2f %10.1f\n", kinds[k], requests / elapsed, elapsed * 1e9 / bytes,
+            bytes / elapsed / 1e6);
+    }
+    arena_delete(&arena);
+    freeRegexes();
+    return 0;
+}
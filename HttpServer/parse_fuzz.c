@@ -0,0 +1,106 @@
+#include "arena.h"
+#include "parse.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BURST_MAX 64 // pipelined requests parsed from one input
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+// helper function to stop on a parse that broke an invariant
+void fail(const char *what) {
+    fprintf(stderr, "parse_fuzz: %s\n", what);
+    abort();
+}
+
+// helper function to check the fields of a request that parsed
+void checkRequest(const Requests *requestObj, const char *at, ssize_t left) {
+    size_t method = strlen(requestObj->get_put), path = strlen(requestObj->path);
+    if (method < 1 || method > 8 || path < 1 || path > 63) {
+        fail("method or path length out of range");
+    }
+    if (strncmp(requestObj->httpVersion, "HTTP/", 5) != 0 || strlen(requestObj->httpVersion) != 8) {
+        fail("malformed version");
+    }
+    if (requestObj->msg <= at || requestObj->msg > at + strlen(at)) {
+        fail("body starts outside the head");
+    }
+    if (requestObj->bytesLeft != left - (requestObj->msg - at)) {
+        fail("bytesLeft does not match the head length");
+    }
+    if (requestObj->msg[-2] != '\r' || requestObj->msg[-1] != '\n') {
+        fail("head does not end in a blank line");
+    }
+}
+
+/*
+* LLVMFuzzerTestOneInput() parses an input as the server would find it
+* in its buffer, NUL-terminated and cut to BUFF_SIZE - 1 bytes, then
+* keeps parsing what follows each request's body as a pipelined burst.
+*/
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static char *buf = NULL;
+    static Arena *arena = NULL;
+    if (buf == NULL) {
+        compileRegexes();
+        buf = malloc(BUFF_SIZE);
+        arena = arena_new(ARENA_SIZE);
+        if (buf == NULL || arena == NULL) {
+            fail("cannot allocate");
+        }
+    }
+    size = size < BUFF_SIZE - 1 ? size : BUFF_SIZE - 1;
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+
+    char *at = buf;
+    ssize_t left = size;
+    for (int i = 0; i < BURST_MAX && left > 0; i++) {
+        Requests requestObj = { 0 };
+        requestObj.inputFile = -1;
+        requestObj.arena = arena;
+        int rc = parseRequest(&requestObj, at, left);
+        if (rc == EXIT_SUCCESS) {
+            checkRequest(&requestObj, at, left);
+        }
+        arena_reset(arena);
+        if (rc != EXIT_SUCCESS || requestObj.msgSize < 0 || requestObj.msgSize > requestObj.bytesLeft) {
+            break;
+        }
+        left = requestObj.bytesLeft - requestObj.msgSize;
+        at = requestObj.msg + requestObj.msgSize;
+    }
+    return 0;
+}
+
+#ifndef LIBFUZZER
+
+/*
+* Without libFuzzer, each file named on the command line is one input,
+* so `./parse_fuzz corpus/NN-kind ...` checks a corpus. With no arguments the
+* input is read from stdin, as AFL supplies it.
+*/
+int main(int argc, char *argv[]) {
+    static uint8_t input[BUFF_SIZE];
+    for (int i = 1; i < argc || (argc == 1 && i == 1); i++) {
+        FILE *f = argc == 1 ? stdin : fopen(argv[i], "r");
+        if (f == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        size_t len = fread(input, 1, sizeof(input), f);
+        if (f != stdin) {
+            fclose(f);
+        }
+        LLVMFuzzerTestOneInput(input, len);
+    }
+    if (argc > 1) {
+        printf("%d inputs parsed\n", argc - 1);
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,464 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define URI_MAX      64 // longest object name the server accepts, with its NUL
+#define LINE_MAX_LEN 512 // longest log line read
+#define BODY_CHUNK   65536 // bytes of PUT body sent per write, and of response read per recv
+#define SHOW_MAX     10 // mismatches printed one by one
+
+enum { GET, PUT, APPEND, METHODS };
+static const char *method_names[METHODS] = { "GET", "PUT", "APPEND" };
+
+enum { MODE_ORDER, MODE_SCALED, MODE_MAX };
+
+// One request from the log, and how its replay went
+typedef struct {
+    double at; // capture timestamp in seconds, if the log has them
+    int method;
+    char uri[URI_MAX]; // without the leading slash
+    int expected; // status in the log
+    int got; // status replayed, 0 on failure
+    uint64_t size; // body bytes of a PUT or APPEND, from the size model
+    uint64_t received; // response bytes
+    double latency_ms;
+    double late_ms; // how far behind its scaled start time it was sent
+    long line; // in the log
+} entry_t;
+
+// A name and size from the size model
+typedef struct {
+    char uri[URI_MAX];
+    uint64_t size;
+} object_size_t;
+
+static entry_t *entries = NULL;
+static long count = 0;
+static object_size_t *sizes = NULL;
+static long size_count = 0;
+static uint64_t default_size = 1024; // body bytes of an object the size model does not list
+
+static struct sockaddr_in server;
+static int mode = MODE_MAX;
+static double scale = 1.0; // speedup of the capture's timeline in scaled mode
+static atomic_long next_entry; // index of the next request a worker takes
+static struct timespec started;
+static char body[BODY_CHUNK]; // PUT bodies repeat this pattern
+
+void usage(void) {
+    fprintf(stderr, "Usage: replay [-m order|scaled|max] [-s speedup] [-c connections] [-z size_model] "
+                    "[-b default_bytes] [-p] [-a address] <port> <access_log>\n");
+    exit(1);
+}
+
+// function to read a monotonic clock in seconds since the replay started
+double elapsed(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+}
+
+int compare_sizes(const void *a, const void *b) {
+    return strcmp(((const object_size_t *) a)->uri, ((const object_size_t *) b)->uri);
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+// function to load the size model: one "name bytes" pair per line, the name with or without its slash
+void load_sizes(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char line[LINE_MAX_LEN];
+    long cap = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char name[LINE_MAX_LEN];
+        unsigned long long bytes;
+        if (sscanf(line, "%511s %llu", name, &bytes) != 2) {
+            continue;
+        }
+        const char *uri = name[0] == '/' ? name + 1 : name;
+        if (strlen(uri) >= URI_MAX) {
+            continue;
+        }
+        if (size_count == cap) {
+            cap = cap ? cap * 2 : 256;
+            object_size_t *grown = realloc(sizes, cap * sizeof(object_size_t));
+            if (grown == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            sizes = grown;
+        }
+        strcpy(sizes[size_count].uri, uri);
+        sizes[size_count++].size = bytes;
+    }
+    fclose(f);
+    qsort(sizes, size_count, sizeof(object_size_t), compare_sizes);
+}
+
+// function to look up the body size of an object
+uint64_t size_of(const char *uri) {
+    object_size_t key;
+    strcpy(key.uri, uri);
+    object_size_t *found = bsearch(&key, sizes, size_count, sizeof(object_size_t), compare_sizes);
+    return found != NULL ? found->size : default_size;
+}
+
+/*
+* load_log() reads the server's access log lines, "METHOD,/name,code,id",
+* each optionally prefixed with a "seconds," timestamp, e.g. from
+* `httpserver 2> >(ts '%.s,' > access.log)`. Lines it cannot replay,
+* such as STATS lines, are skipped. Returns whether every line had a
+* timestamp.
+*/
+bool load_log(const char *path, long *skipped) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char line[LINE_MAX_LEN];
+    long cap = 0, number = 0;
+    bool timed = true;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        number++;
+        entry_t e = { 0 };
+        e.line = number;
+        char *fields = line;
+        char *end;
+        double at = strtod(line, &end);
+        bool stamped = end != line && *end == ',';
+        if (stamped) {
+            e.at = at;
+            fields = end + 1;
+        }
+        char method[16], uri[LINE_MAX_LEN];
+        int code;
+        if (sscanf(fields, "%15[^,],/%511[^,],%d,", method, uri, &code) != 3 || strlen(uri) >= URI_MAX) {
+            (*skipped)++;
+            continue;
+        }
+        e.method = -1;
+        for (int m = 0; m < METHODS; m++) {
+            if (strcmp(method, method_names[m]) == 0) {
+                e.method = m;
+            }
+        }
+        if (e.method == -1) {
+            (*skipped)++; // e.g. PATCH needs the original range, and MGET the original list
+            continue;
+        }
+        timed = timed && stamped;
+        strcpy(e.uri, uri);
+        e.expected = code;
+        e.size = e.method == GET ? 0 : size_of(uri);
+        if (count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            entry_t *grown = realloc(entries, cap * sizeof(entry_t));
+            if (grown == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            entries = grown;
+        }
+        entries[count++] = e;
+    }
+    fclose(f);
+    return timed && count > 0;
+}
+
+// function to write all of a buffer to a socket
+int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t wb = send(fd, buf, len, MSG_NOSIGNAL);
+        if (wb < 0 && errno == EINTR) {
+            continue;
+        }
+        if (wb <= 0) {
+            return -1;
+        }
+        buf += wb;
+        len -= wb;
+    }
+    return 0;
+}
+
+/*
+* issue() sends one request on a new connection, as the server closes
+* each connection after its response, then reads the response to EOF.
+* Returns the status code, or 0 if the exchange failed.
+*/
+int issue(entry_t *e, const char *request_id, uint64_t *received) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return 0;
+    }
+    int code = 0;
+    if (connect(fd, (struct sockaddr *) &server, sizeof(server)) == 0) {
+        char head[256];
+        int len;
+        if (e->method == GET) {
+            len = snprintf(head, sizeof(head), "GET /%s HTTP/1.1\r\nHost: localhost\r\nRequest-Id: %s\r\n\r\n",
+                e->uri, request_id);
+        } else {
+            len = snprintf(head, sizeof(head),
+                "%s /%s HTTP/1.1\r\nHost: localhost\r\nRequest-Id: %s\r\nContent-Length: %llu\r\n\r\n",
+                method_names[e->method], e->uri, request_id, (unsigned long long) e->size);
+        }
+        bool sent = send_all(fd, head, len) == 0;
+        for (uint64_t left = e->size; sent && left > 0;) {
+            size_t chunk = left < BODY_CHUNK ? left : BODY_CHUNK;
+            sent = send_all(fd, body, chunk) == 0;
+            left -= chunk;
+        }
+        // Read to EOF even if the send failed, since the server may have answered early
+        char buf[BODY_CHUNK];
+        char status[16] = "";
+        size_t have = 0;
+        ssize_t rb;
+        while ((rb = recv(fd, buf, sizeof(buf), 0)) > 0 || (rb < 0 && errno == EINTR)) {
+            if (rb > 0 && have < sizeof(status) - 1) {
+                size_t take = (size_t) rb < sizeof(status) - 1 - have ? (size_t) rb : sizeof(status) - 1 - have;
+                memcpy(status + have, buf, take);
+                have += take;
+            }
+            *received += rb > 0 ? rb : 0;
+        }
+        status[have] = '\0';
+        if (strncmp(status, "HTTP/1.1 ", 9) == 0) {
+            code = atoi(status + 9);
+        }
+    }
+    close(fd);
+    return code;
+}
+
+// function run by each replay connection: takes the next request until none are left
+void *worker(void *arg) {
+    (void) arg;
+    while (true) {
+        long i = atomic_fetch_add(&next_entry, 1);
+        if (i >= count) {
+            return NULL;
+        }
+        entry_t *e = &entries[i];
+        if (mode == MODE_SCALED) {
+            // Wait for the request's place on the sped-up timeline
+            double due = (e->at - entries[0].at) / scale;
+            double now = elapsed();
+            if (due > now) {
+                struct timespec wait = { (time_t) (due - now), (long) (fmod(due - now, 1.0) * 1e9) };
+                nanosleep(&wait, NULL);
+            } else {
+                e->late_ms = (now - due) * 1000;
+            }
+        }
+        char request_id[32];
+        snprintf(request_id, sizeof(request_id), "replay-%ld", e->line);
+        double start = elapsed();
+        e->got = issue(e, request_id, &e->received);
+        e->latency_ms = (elapsed() - start) * 1000;
+    }
+}
+
+// function to hash an object name (FNV-1a)
+uint32_t uri_hash(const char *uri) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *) uri; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+* prewarm() PUTs every object whose first request in the log is a GET
+* that found it, so the replay starts from the same objects the
+* capture did. These requests are not measured.
+*/
+void prewarm(void) {
+    // Names already seen, in an open-addressed table at most half full
+    size_t slots = 16;
+    while (slots < 2 * (size_t) count) {
+        slots *= 2;
+    }
+    const char **seen = calloc(slots, sizeof(char *));
+    if (seen == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    long warmed = 0;
+    for (long i = 0; i < count; i++) {
+        size_t slot = uri_hash(entries[i].uri) & (slots - 1);
+        while (seen[slot] != NULL && strcmp(seen[slot], entries[i].uri) != 0) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        if (seen[slot] != NULL) {
+            continue; // not its first request
+        }
+        seen[slot] = entries[i].uri;
+        if (entries[i].method != GET || entries[i].expected != 200) {
+            continue;
+        }
+        entry_t put = entries[i];
+        put.method = PUT;
+        put.size = size_of(put.uri);
+        uint64_t received = 0;
+        int code = issue(&put, "replay-prewarm", &received);
+        if (code != 200 && code != 201) {
+            fprintf(stderr, "prewarm PUT /%s failed with %d\n", put.uri, code);
+        }
+        warmed++;
+    }
+    free(seen);
+    fprintf(stderr, "prewarmed %ld objects\n", warmed);
+}
+
+// function to print the latency percentiles of one method's requests
+void report_latency(const char *name, int method) {
+    double *lat = malloc((count + 1) * sizeof(double));
+    if (lat == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    long n = 0;
+    for (long i = 0; i < count; i++) {
+        if (method == -1 || entries[i].method == method) {
+            lat[n++] = entries[i].latency_ms;
+        }
+    }
+    if (n > 0) {
+        qsort(lat, n, sizeof(double), compare_doubles);
+        const double points[] = { 0.50, 0.90, 0.99, 0.999 };
+        printf("%-6s n=%-7ld", name, n);
+        const char *labels[] = { "p50", "p90", "p99", "p99.9" };
+        for (int p = 0; p < 4; p++) {
+            long at = (long) ceil(points[p] * n) - 1;
+            printf(" %s=%.3f", labels[p], lat[at < 0 ? 0 : at]);
+        }
+        printf(" max=%.3f ms\n", lat[n - 1]);
+    }
+    free(lat);
+}
+
+int main(int argc, char **argv) {
+    int connections = 8;
+    bool warm = false;
+    const char *address = "127.0.0.1";
+    const char *size_path = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "m:s:c:z:b:pa:")) != -1) {
+        switch (option) {
+        case 'm':
+            // Option -m: Replay serially in log order, on the log's timeline, or as fast as possible
+            if (strcmp(optarg, "order") == 0) {
+                mode = MODE_ORDER;
+            } else if (strcmp(optarg, "scaled") == 0) {
+                mode = MODE_SCALED;
+            } else if (strcmp(optarg, "max") == 0) {
+                mode = MODE_MAX;
+            } else {
+                usage();
+            }
+            break;
+        case 's':
+            // Option -s: Run the scaled timeline this many times faster than it was captured
+            scale = atof(optarg);
+            if (scale <= 0) {
+                usage();
+            }
+            break;
+        case 'c': connections = atoi(optarg); break;
+        case 'z': size_path = optarg; break;
+        case 'b': default_size = strtoull(optarg, NULL, 10); break;
+        case 'p': warm = true; break;
+        case 'a': address = optarg; break;
+        default: usage();
+        }
+    }
+    if (argc - optind != 2 || connections < 1) {
+        usage();
+    }
+    server.sin_family = AF_INET;
+    server.sin_port = htons(atoi(argv[optind]));
+    if (inet_pton(AF_INET, address, &server.sin_addr) != 1) {
+        usage();
+    }
+    if (size_path != NULL) {
+        load_sizes(size_path);
+    }
+    long skipped = 0;
+    bool timed = load_log(argv[optind + 1], &skipped);
+    if (count == 0) {
+        fprintf(stderr, "no replayable requests in %s\n", argv[optind + 1]);
+        return 1;
+    }
+    if (mode == MODE_SCALED && !timed) {
+        fprintf(stderr, "scaled mode needs a timestamp on every line\n");
+        return 1;
+    }
+    if (mode == MODE_ORDER) {
+        connections = 1; // one request at a time, so each sees the effects of the ones before it
+    }
+    memset(body, 'x', sizeof(body));
+    if (warm) {
+        prewarm();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    pthread_t threads[connections];
+    for (int i = 0; i < connections; i++) {
+        pthread_create(&threads[i], NULL, worker, NULL);
+    }
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = elapsed();
+
+    uint64_t bytes = 0;
+    long failed = 0, mismatched = 0;
+    double late_max = 0;
+    for (long i = 0; i < count; i++) {
+        entry_t *e = &entries[i];
+        bytes += e->received + e->size;
+        late_max = e->late_ms > late_max ? e->late_ms : late_max;
+        if (e->got == 0) {
+            failed++;
+        } else if (e->got != e->expected) {
+            if (mismatched++ < SHOW_MAX) {
+                printf("line %ld: %s /%s expected %d, got %d\n", e->line, method_names[e->method], e->uri,
+                    e->expected, e->got);
+            }
+        }
+    }
+    printf("replayed %ld requests (%ld lines skipped) in %.3f s: %.1f req/s, %.2f MB/s\n", count, skipped, seconds,
+        count / seconds, bytes / seconds / 1e6);
+    report_latency("all", -1);
+    for (int m = 0; m < METHODS; m++) {
+        report_latency(method_names[m], m);
+    }
+    if (mode == MODE_SCALED) {
+        printf("fell behind the timeline by at most %.3f ms\n", late_max);
+    }
+    printf("status mismatches: %ld, failed exchanges: %ld\n", mismatched, failed);
+    free(entries);
+    free(sizes);
+    return mismatched == 0 && failed == 0 ? 0 : 1;
+}
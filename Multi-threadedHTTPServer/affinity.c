@@ -0,0 +1,141 @@
+#define _GNU_SOURCE // cpu_set_t, pthread_setaffinity_np
+
+#include "affinity.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NODE_DIR "/sys/devices/system/node" // one nodeN directory per NUMA node
+
+static cpu_set_t places[AFFINITY_MAX_PLACES]; // CPUs of each place
+static int place_count = 0; // places set up by affinity_init
+
+// function to parse a CPU list such as "0-3,8,10-11"
+static bool parse_cpus(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end = NULL;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return false;
+            }
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return false;
+        }
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+// function to make one place per NUMA node that has CPUs
+static int node_places(void) {
+    int count = 0;
+    DIR *dir = opendir(NODE_DIR);
+    if (dir != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL && count < AFFINITY_MAX_PLACES) {
+            int node;
+            char rest;
+            if (sscanf(entry->d_name, "node%d%c", &node, &rest) != 1) {
+                continue;
+            }
+            char path[64 + sizeof(entry->d_name)];
+            snprintf(path, sizeof(path), NODE_DIR "/%s/cpulist", entry->d_name);
+            FILE *f = fopen(path, "r");
+            if (f == NULL) {
+                continue;
+            }
+            char list[4096];
+            if (fgets(list, sizeof(list), f) != NULL && parse_cpus(list, &places[count])) {
+                count++; // memory-only nodes have an empty list and are skipped
+            }
+            fclose(f);
+        }
+        closedir(dir);
+    }
+    if (count == 0) {
+        // No NUMA information: the whole machine is one node
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &places[0]) == -1) {
+            return -1;
+        }
+        count = 1;
+    }
+    return count;
+}
+
+// function to set up the places of a spec
+int affinity_init(const char *spec) {
+    if (strcmp(spec, "numa") == 0) {
+        place_count = node_places();
+        return place_count;
+    }
+    cpu_set_t cpus;
+    if (!parse_cpus(spec, &cpus)) {
+        return -1;
+    }
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < AFFINITY_MAX_PLACES; cpu++) {
+        if (CPU_ISSET(cpu, &cpus)) {
+            CPU_ZERO(&places[count]);
+            CPU_SET(cpu, &places[count]);
+            count++;
+        }
+    }
+    place_count = count;
+    return count;
+}
+
+// function to find the place of a CPU
+int affinity_place_of(int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return -1;
+    }
+    for (int i = 0; i < place_count; i++) {
+        if (CPU_ISSET(cpu, &places[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// function to pin the calling thread to a place
+int affinity_pin_place(int place) {
+    if (place < 0 || place >= place_count) {
+        return EINVAL;
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &places[place]);
+}
+
+// function to pin the calling thread to a CPU
+int affinity_pin_cpu(int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return EINVAL;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+}
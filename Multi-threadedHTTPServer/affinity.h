@@ -0,0 +1,47 @@
+/**
+ * @File affinity.h
+ *
+ * Placing threads on CPUs.  A place is a set of CPUs a thread is pinned
+ * to: a single CPU, or every CPU of a NUMA node.  Threads allocate their
+ * buffers after pinning themselves, so the kernel's first-touch policy
+ * puts the pages on the place's own node.  Nodes are read from sysfs;
+ * a machine without them is one node.
+ */
+
+#pragma once
+
+#define AFFINITY_MAX_PLACES 256 // most places a spec can name
+
+/** @brief Sets up the places a spec names: "numa" for one place per
+ *         NUMA node with CPUs, or a CPU list such as "0-3,8" for one
+ *         place per listed CPU.
+ *
+ *  @param spec the spec
+ *
+ *  @return the number of places, or -1 if the spec is invalid
+ */
+int affinity_init(const char *spec);
+
+/** @brief Finds the place a CPU belongs to.
+ *
+ *  @param cpu the CPU
+ *
+ *  @return the index of the first place holding cpu, or -1
+ */
+int affinity_place_of(int cpu);
+
+/** @brief Pins the calling thread to the CPUs of a place.
+ *
+ *  @param place the index of the place
+ *
+ *  @return 0, or an error number
+ */
+int affinity_pin_place(int place);
+
+/** @brief Pins the calling thread to a single CPU.
+ *
+ *  @param cpu the CPU
+ *
+ *  @return 0, or an error number
+ */
+int affinity_pin_cpu(int cpu);
@@ -0,0 +1,258 @@
+#include "classq.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// One class: a ring of waiting elements and its share of the pops
+typedef struct {
+    void **ring; // capacity slots
+    int capacity; // slots in ring
+    int head; // index of the oldest element
+    int count; // elements waiting
+    int weight; // pops per round
+    int credit; // pops left in the current round
+    int limit; // elements out at once, 0 for no limit
+    int out; // elements popped and not yet done
+    pthread_cond_t not_full; // signaled when an element leaves ring
+    uint64_t pushed; // elements pushed
+    uint64_t popped; // elements popped
+    uint64_t full; // pushes that found the class full
+    int peak; // most elements ever waiting
+} class_t;
+
+typedef struct ClassQueue {
+    pthread_mutex_t lock; // guards everything here
+    pthread_cond_t not_empty; // signaled when an element may be poppable
+    int classes; // classes in use
+    int cursor; // class whose turn it is
+    bool closed; // classq_close was called
+    class_t cls[CLASSQ_MAX];
+} classq_t;
+
+// function to check whether a class can give up an element now; the queue is locked
+static bool ready(class_t *c) {
+    return c->count > 0 && (c->limit == 0 || c->out < c->limit);
+}
+
+// function to check whether any class can give up an element now; the queue is locked
+static bool any_ready(classq_t *q) {
+    for (int c = 0; c < q->classes; c++) {
+        if (ready(&q->cls[c])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// function to pick the class to pop from, or -1; the queue is locked
+static int next_class(classq_t *q) {
+    if (!any_ready(q)) {
+        return -1;
+    }
+    while (true) {
+        for (int i = 0; i < q->classes; i++) {
+            int c = (q->cursor + i) % q->classes;
+            if (ready(&q->cls[c]) && q->cls[c].credit > 0) {
+                q->cursor = c;
+                return c;
+            }
+        }
+        // Every ready class has used its credit: start a new round
+        for (int c = 0; c < q->classes; c++) {
+            q->cls[c].credit = q->cls[c].weight;
+        }
+    }
+}
+
+// function to check whether every class is empty; the queue is locked
+static bool drained(classq_t *q) {
+    for (int c = 0; c < q->classes; c++) {
+        if (q->cls[c].count > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// function to create a queue
+classq_t *classq_new(int classes, const classq_spec_t *specs) {
+    if (classes < 1 || classes > CLASSQ_MAX) {
+        return NULL;
+    }
+    for (int c = 0; c < classes; c++) {
+        if (specs[c].weight < 1 || specs[c].capacity < 1 || specs[c].limit < 0) {
+            return NULL;
+        }
+    }
+    classq_t *q = calloc(1, sizeof(classq_t));
+    if (q == NULL) {
+        return NULL;
+    }
+    q->classes = classes;
+    for (int c = 0; c < classes; c++) {
+        class_t *k = &q->cls[c];
+        k->ring = malloc(specs[c].capacity * sizeof(void *));
+        if (k->ring == NULL) {
+            while (c-- > 0) {
+                free(q->cls[c].ring);
+            }
+            free(q);
+            return NULL;
+        }
+        k->capacity = specs[c].capacity;
+        k->weight = k->credit = specs[c].weight;
+        k->limit = specs[c].limit;
+        pthread_cond_init(&k->not_full, NULL);
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    return q;
+}
+
+// function to free a queue
+void classq_delete(classq_t **q) {
+    if (q == NULL || *q == NULL) {
+        return;
+    }
+    for (int c = 0; c < (*q)->classes; c++) {
+        pthread_cond_destroy(&(*q)->cls[c].not_full);
+        free((*q)->cls[c].ring);
+    }
+    pthread_cond_destroy(&(*q)->not_empty);
+    pthread_mutex_destroy(&(*q)->lock);
+    free(*q);
+    *q = NULL;
+}
+
+// function to append an element to a class with room; the queue is locked
+static void append(classq_t *q, class_t *c, void *elem) {
+    c->ring[(c->head + c->count) % c->capacity] = elem;
+    c->count++;
+    c->pushed++;
+    if (c->count > c->peak) {
+        c->peak = c->count;
+    }
+    pthread_cond_signal(&q->not_empty);
+}
+
+// function to append an element to its class
+bool classq_push(classq_t *q, int cls, void *elem) {
+    class_t *c = &q->cls[cls];
+    pthread_mutex_lock(&q->lock);
+    if (c->count == c->capacity && !q->closed) {
+        c->full++;
+        do {
+            pthread_cond_wait(&c->not_full, &q->lock);
+        } while (c->count == c->capacity && !q->closed);
+    }
+    if (q->closed) {
+        pthread_mutex_unlock(&q->lock);
+        return false;
+    }
+    append(q, c, elem);
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+// function to append an element to its class if there is room
+bool classq_try_push(classq_t *q, int cls, void *elem) {
+    class_t *c = &q->cls[cls];
+    pthread_mutex_lock(&q->lock);
+    bool room = c->count < c->capacity && !q->closed;
+    if (room) {
+        append(q, c, elem);
+    } else {
+        c->full++;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return room;
+}
+
+// function to check whether a pop would not wait
+bool classq_waiting(classq_t *q) {
+    pthread_mutex_lock(&q->lock);
+    bool waiting = any_ready(q);
+    pthread_mutex_unlock(&q->lock);
+    return waiting;
+}
+
+// function to take the head of the class picked for this pop; the queue is locked
+static void take(classq_t *q, int pick, void **elem, int *cls) {
+    class_t *c = &q->cls[pick];
+    *elem = c->ring[c->head];
+    *cls = pick;
+    c->head = (c->head + 1) % c->capacity;
+    c->count--;
+    c->out++;
+    c->popped++;
+    if (--c->credit == 0) {
+        q->cursor = (pick + 1) % q->classes; // its turn is over
+    }
+    pthread_cond_signal(&c->not_full);
+    if (any_ready(q) || (q->closed && drained(q))) {
+        pthread_cond_signal(&q->not_empty); // pass the wakeup on
+    }
+}
+
+// function to take the next element in weighted round-robin order
+bool classq_pop(classq_t *q, void **elem, int *cls) {
+    pthread_mutex_lock(&q->lock);
+    int pick;
+    while ((pick = next_class(q)) == -1) {
+        if (q->closed && drained(q)) {
+            pthread_mutex_unlock(&q->lock);
+            return false;
+        }
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    take(q, pick, elem, cls);
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+// function to take the next element if one is ready now
+bool classq_try_pop(classq_t *q, void **elem, int *cls) {
+    pthread_mutex_lock(&q->lock);
+    int pick = next_class(q);
+    if (pick != -1) {
+        take(q, pick, elem, cls);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return pick != -1;
+}
+
+// function to release an element's place in its class limit
+void classq_done(classq_t *q, int cls) {
+    class_t *c = &q->cls[cls];
+    pthread_mutex_lock(&q->lock);
+    c->out--;
+    if (c->limit > 0 && c->count > 0) {
+        pthread_cond_signal(&q->not_empty); // it may have been held back by its limit
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+// function to close a queue
+void classq_close(classq_t *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    for (int c = 0; c < q->classes; c++) {
+        pthread_cond_broadcast(&q->cls[c].not_full);
+    }
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// function to report the per-class counters
+void classq_dump_stats(classq_t *q, int id, FILE *out) {
+    pthread_mutex_lock(&q->lock);
+    for (int c = 0; c < q->classes; c++) {
+        class_t *k = &q->cls[c];
+        fprintf(out,
+            "STATS,classq,queue=%d,class=%d,weight=%d,queued=%d,out=%d,peak=%d,pushed=%lu,popped=%lu,full=%lu\n",
+            id, c, k->weight, k->count, k->out, k->peak, (unsigned long) k->pushed, (unsigned long) k->popped,
+            (unsigned long) k->full);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
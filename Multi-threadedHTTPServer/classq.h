@@ -0,0 +1,134 @@
+/**
+ * @File classq.h
+ *
+ * A bounded queue with several classes of element, e.g. interactive
+ * requests and bulk uploads.  Each class has its own FIFO, and pops
+ * take turns between the classes by weighted round robin: in every
+ * round a class with waiting elements gets up to its weight of pops,
+ * so no class starves however busy the others are.  A class can also
+ * be limited in how many of its elements are out being worked on at
+ * once, which keeps the rest of the consumers free for other classes.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define CLASSQ_MAX 4 // most classes a queue can have
+
+typedef struct ClassQueue classq_t;
+
+/** @struct classq_spec_t
+ *
+ *  @brief How one class is queued and scheduled.
+ */
+typedef struct {
+    int weight; // pops the class gets per round, at least 1
+    int capacity; // elements it can hold before pushes block, at least 1
+    int limit; // its elements popped but not yet done at once, 0 for no limit
+} classq_spec_t;
+
+/** @brief Dynamically allocates a queue.
+ *
+ *  @param classes the number of classes, 1 to CLASSQ_MAX
+ *
+ *  @param specs one spec per class; class i is specs[i]
+ *
+ *  @return a pointer to a new classq_t, or NULL if a spec is invalid or
+ *          allocation failed
+ */
+classq_t *classq_new(int classes, const classq_spec_t *specs);
+
+/** @brief Frees the queue and sets *q to NULL.  Elements still queued
+ *         are dropped.
+ *
+ *  @param q the queue to be deleted
+ */
+void classq_delete(classq_t **q);
+
+/** @brief Appends an element to its class, blocking while the class is
+ *         full.
+ *
+ *  @param q the queue
+ *
+ *  @param cls the element's class
+ *
+ *  @param elem the element
+ *
+ *  @return true, or false if the queue was closed
+ */
+bool classq_push(classq_t *q, int cls, void *elem);
+
+/** @brief Appends an element to its class unless the class is full.
+ *
+ *  @param q the queue
+ *
+ *  @param cls the element's class
+ *
+ *  @param elem the element
+ *
+ *  @return true, or false if the class was full or the queue closed
+ */
+bool classq_try_push(classq_t *q, int cls, void *elem);
+
+/** @brief Checks whether a pop would find an element without waiting.
+ *
+ *  @param q the queue
+ *
+ *  @return whether some class has an element it may give up now
+ */
+bool classq_waiting(classq_t *q);
+
+/** @brief Takes the next element in weighted round-robin order,
+ *         blocking until there is one.  An element popped from a class
+ *         with a limit counts against it until classq_done.
+ *
+ *  @param q the queue
+ *
+ *  @param elem receives the element
+ *
+ *  @param cls receives its class
+ *
+ *  @return true, or false once the queue is closed and every class is
+ *          empty
+ */
+bool classq_pop(classq_t *q, void **elem, int *cls);
+
+/** @brief Takes the next element in weighted round-robin order if one
+ *         can be taken without waiting.
+ *
+ *  @param q the queue
+ *
+ *  @param elem receives the element
+ *
+ *  @param cls receives its class
+ *
+ *  @return whether an element was taken
+ */
+bool classq_try_pop(classq_t *q, void **elem, int *cls);
+
+/** @brief Reports that work on an element popped from a class is done.
+ *
+ *  @param q the queue
+ *
+ *  @param cls the element's class
+ */
+void classq_done(classq_t *q, int cls);
+
+/** @brief Closes the queue: pushes fail from now on, and pops return
+ *         false once what is queued has been taken.
+ *
+ *  @param q the queue
+ */
+void classq_close(classq_t *q);
+
+/** @brief Writes a STATS line per class with its counters.
+ *
+ *  @param q the queue
+ *
+ *  @param id the queue's number in the lines
+ *
+ *  @param out the stream to write to
+ */
+void classq_dump_stats(classq_t *q, int id, FILE *out);
@@ -0,0 +1,210 @@
+#define _GNU_SOURCE // syncfs
+
+#include "commit.h"
+
+#include "green.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SYNCFS_BATCH 32 // batches this large sync the whole filesystem once
+#define HIST_BUCKETS 8 // batch size histogram buckets: 1, 2-3, 4-7, ..., 128+
+
+// A worker waiting for its file to become durable; lives on its stack.
+typedef struct Waiter {
+    int fd; // file to sync
+    const char *dir; // directory of a newly created file, or NULL
+    bool done; // set by the commit thread
+    int rc; // result of the sync
+    struct Waiter *next; // next waiter in the batch
+} waiter_t;
+
+typedef struct Committer {
+    long window_us; // gathering window
+    int dir_fd; // working directory, the usual parent of newly created files
+    pthread_t thread; // the commit thread
+    pthread_mutex_t lock; // guards everything below
+    pthread_cond_t pending_cv; // signaled when a waiter arrives or on stop
+    pthread_cond_t done_cv; // broadcast when a batch is durable
+    waiter_t *pending; // waiters for the next batch
+    bool stopping; // committer_delete was called
+    uint64_t batches; // batches synced
+    uint64_t files; // files synced
+    uint64_t max_batch; // largest batch
+    uint64_t hist[HIST_BUCKETS]; // batches by size, in powers of two
+} committer_t;
+
+// function to sync one batch of waiters; returns the batch size
+static uint64_t commit_batch(committer_t *c, waiter_t *batch) {
+    uint64_t n = 0;
+    for (waiter_t *w = batch; w != NULL; w = w->next) {
+        n++;
+    }
+
+    if (n >= SYNCFS_BATCH) {
+        // One syncfs is cheaper than this many fdatasyncs
+        int rc = syncfs(batch->fd);
+        for (waiter_t *w = batch; w != NULL; w = w->next) {
+            w->rc = rc;
+        }
+    } else {
+        for (waiter_t *w = batch; w != NULL; w = w->next) {
+            w->rc = fdatasync(w->fd);
+        }
+    }
+
+    // Sync each distinct directory that gained an entry once
+    for (waiter_t *w = batch; w != NULL; w = w->next) {
+        if (w->dir == NULL) {
+            continue;
+        }
+        bool seen = false;
+        for (waiter_t *v = batch; v != w && !seen; v = v->next) {
+            seen = v->dir != NULL && strcmp(v->dir, w->dir) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+        int rc;
+        if (strcmp(w->dir, ".") == 0) {
+            rc = fsync(c->dir_fd);
+        } else {
+            int dir_fd = open(w->dir, O_RDONLY | O_DIRECTORY);
+            rc = dir_fd == -1 ? -1 : fsync(dir_fd);
+            if (dir_fd != -1) {
+                close(dir_fd);
+            }
+        }
+        if (rc == -1) {
+            for (waiter_t *v = w; v != NULL; v = v->next) {
+                if (v->dir != NULL && strcmp(v->dir, w->dir) == 0) {
+                    v->rc = -1;
+                }
+            }
+        }
+    }
+    return n;
+}
+
+// function run by the commit thread
+static void *commit_thread(void *arg) {
+    committer_t *c = arg;
+    pthread_mutex_lock(&c->lock);
+    while (true) {
+        while (c->pending == NULL && !c->stopping) {
+            pthread_cond_wait(&c->pending_cv, &c->lock);
+        }
+        if (c->pending == NULL) {
+            break; // stopping and nothing left to sync
+        }
+
+        // Let more PUTs join the batch
+        if (c->window_us > 0) {
+            pthread_mutex_unlock(&c->lock);
+            struct timespec window = { c->window_us / 1000000, (c->window_us % 1000000) * 1000 };
+            nanosleep(&window, NULL);
+            pthread_mutex_lock(&c->lock);
+        }
+        waiter_t *batch = c->pending;
+        c->pending = NULL;
+        pthread_mutex_unlock(&c->lock);
+
+        uint64_t n = commit_batch(c, batch);
+
+        pthread_mutex_lock(&c->lock);
+        for (waiter_t *w = batch; w != NULL; w = w->next) {
+            w->done = true;
+        }
+        c->batches++;
+        c->files += n;
+        if (n > c->max_batch) {
+            c->max_batch = n;
+        }
+        int bucket = 0;
+        while (bucket < HIST_BUCKETS - 1 && n >> (bucket + 1) != 0) {
+            bucket++;
+        }
+        c->hist[bucket]++;
+        pthread_cond_broadcast(&c->done_cv);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+// function to start the commit thread
+committer_t *committer_new(long window_us) {
+    committer_t *c = calloc(1, sizeof(committer_t));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->dir_fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (c->dir_fd == -1) {
+        free(c);
+        return NULL;
+    }
+    c->window_us = window_us;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->pending_cv, NULL);
+    pthread_cond_init(&c->done_cv, NULL);
+    if (pthread_create(&c->thread, NULL, commit_thread, c) != 0) {
+        close(c->dir_fd);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+// function to stop the commit thread
+void committer_delete(committer_t **c) {
+    committer_t *cm = *c;
+    pthread_mutex_lock(&cm->lock);
+    cm->stopping = true;
+    pthread_cond_signal(&cm->pending_cv);
+    pthread_mutex_unlock(&cm->lock);
+    pthread_join(cm->thread, NULL);
+    pthread_mutex_destroy(&cm->lock);
+    pthread_cond_destroy(&cm->pending_cv);
+    pthread_cond_destroy(&cm->done_cv);
+    close(cm->dir_fd);
+    free(cm);
+    *c = NULL;
+}
+
+// function to wait until a file is durable
+int committer_sync(committer_t *c, int fd, const char *dir) {
+    waiter_t w = { fd, dir, false, 0, NULL };
+    pthread_mutex_lock(&c->lock);
+    w.next = c->pending;
+    c->pending = &w;
+    pthread_cond_signal(&c->pending_cv);
+    while (!w.done) {
+        if (green_running()) {
+            // Other PUTs on this carrier must still run, to join the batch
+            pthread_mutex_unlock(&c->lock);
+            green_sleep(1);
+            pthread_mutex_lock(&c->lock);
+        } else {
+            pthread_cond_wait(&c->done_cv, &c->lock);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return w.rc == 0 ? 0 : -1;
+}
+
+// function to report the batch counters
+void committer_dump_stats(committer_t *c, FILE *out) {
+    pthread_mutex_lock(&c->lock);
+    fprintf(out, "STATS,commit,batches=%lu,files=%lu,max_batch=%lu,hist=", (unsigned long) c->batches,
+        (unsigned long) c->files, (unsigned long) c->max_batch);
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        fprintf(out, "%s%d:%lu", i == 0 ? "" : ";", 1 << i, (unsigned long) c->hist[i]);
+    }
+    fprintf(out, "\n");
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,53 @@
+/**
+ * @File commit.h
+ *
+ * Group commit for durable PUTs.  Workers hand a finished file to the
+ * commit thread and block; the thread waits a short window for more
+ * files to arrive, makes the whole batch durable with one round of
+ * fdatasync (or a single syncfs for large batches), and wakes every
+ * waiter at once.  A longer window means fewer, larger batches.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef struct Committer committer_t;
+
+/** @brief Starts a commit thread that gathers each batch for window_us
+ *         microseconds.
+ *
+ *  @param window_us how long to wait for more PUTs before syncing
+ *
+ *  @return a pointer to a new committer_t, or NULL on error
+ */
+committer_t *committer_new(long window_us);
+
+/** @brief Stops the commit thread and frees the committer.  No thread
+ *         may be waiting in committer_sync.  Sets *c to NULL.
+ *
+ *  @param c the committer to delete
+ */
+void committer_delete(committer_t **c);
+
+/** @brief Blocks until the data written to fd is durable.
+ *
+ *  @param c the committer
+ *
+ *  @param fd the file to make durable
+ *
+ *  @param dir the directory of the file if it was newly created, so its
+ *         entry must be made durable too, or NULL
+ *
+ *  @return 0 on success, or -1 if the sync failed
+ */
+int committer_sync(committer_t *c, int fd, const char *dir);
+
+/** @brief Writes the batch counters as a STATS line.
+ *
+ *  @param c the committer
+ *
+ *  @param out the stream to write to
+ */
+void committer_dump_stats(committer_t *c, FILE *out);
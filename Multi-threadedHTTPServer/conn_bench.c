@@ -0,0 +1,197 @@
+#include "connection.h"
+#include "request.h"
+#include "response.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SAMPLE_MAX 32 // requests in the corpus
+#define HEAD_MAX   4096 // largest request written at once
+
+// One corpus entry: a request as a client would send it, and what it exercises
+typedef struct {
+    const char *kind;
+    char text[HEAD_MAX];
+    size_t len;
+    bool valid; // whether conn_parse should accept it
+} Sample;
+
+static Sample corpus[SAMPLE_MAX];
+static int corpusSize = 0;
+static unsigned long long seed = 88172645463325252ULL; // xorshift state, fixed so runs compare
+
+// helper function for a repeatable pseudo-random number
+unsigned long long next_random(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+// helper function to append random characters from a set
+size_t append_random(char *out, size_t len, const char *set) {
+    size_t n = strlen(set);
+    for (size_t i = 0; i < len; i++) {
+        out[i] = set[next_random() % n];
+    }
+    return len;
+}
+
+// helper function to add a request, and a PUT's first body bytes, to the corpus
+void add_request(const char *kind, const char *method, int uriLen, int headers, int valueLen, int bodyLen) {
+    static const char nameChars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-";
+    static const char valueChars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    Sample *s = &corpus[corpusSize++];
+    char *out = s->text;
+    size_t len = sprintf(out, "%s /", method);
+    len += append_random(out + len, uriLen, nameChars);
+    len += sprintf(out + len, " HTTP/1.1\r\nRequest-Id: %d\r\n", corpusSize);
+    for (int h = 0; h < headers; h++) {
+        len += sprintf(out + len, "X-Header-%d: ", h);
+        len += append_random(out + len, valueLen, valueChars);
+        len += sprintf(out + len, "\r\n");
+    }
+    if (bodyLen >= 0) {
+        len += sprintf(out + len, "Content-Length: %d\r\n", bodyLen);
+    }
+    len += sprintf(out + len, "\r\n");
+    if (bodyLen > 0) {
+        len += append_random(out + len, bodyLen, valueChars);
+    }
+    s->kind = kind;
+    s->len = len;
+    s->valid = true;
+}
+
+// helper function to add a request conn_parse should reject
+void add_malformed(const char *text) {
+    Sample *s = &corpus[corpusSize++];
+    s->kind = "malformed";
+    s->len = strlen(text);
+    memcpy(s->text, text, s->len);
+    s->valid = false;
+}
+
+/*
+* build_corpus() makes the requests the benchmark times: GETs with a
+* growing number of headers, GETs with long names and header values, PUTs
+* with the first bytes of their bodies behind the head, and a few
+* malformed heads.
+*/
+void build_corpus(void) {
+    static const int headerCounts[] = { 0, 1, 4, 8, 16 };
+    for (size_t i = 0; i < sizeof(headerCounts) / sizeof(headerCounts[0]); i++) {
+        add_request("headers", "GET", 12, headerCounts[i], 24, -1);
+    }
+    static const int valueLens[] = { 8, 32, 64, 128 };
+    for (size_t i = 0; i < sizeof(valueLens) / sizeof(valueLens[0]); i++) {
+        add_request("long-lines", "GET", 60, 4, valueLens[i], -1);
+    }
+    static const int bodyLens[] = { 0, 16, 512 };
+    for (size_t i = 0; i < sizeof(bodyLens) / sizeof(bodyLens[0]); i++) {
+        add_request("put", "PUT", 20, 2, 24, bodyLens[i]);
+    }
+    add_malformed("GET /a HTTP/1.1\r\nHost localhost\r\n\r\n");
+    add_malformed("GET a HTTP/1.1\r\n\r\n");
+    add_malformed("GETTINGLONG /a HTTP/1.1\r\n\r\n");
+    add_malformed("PUT /a HTTP/1.1\r\n\r\n");
+}
+
+// helper function to discard whatever conn_parse left in the socket, e.g. a PUT's body
+void drain(int fd) {
+    char buf[HEAD_MAX];
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+}
+
+/*
+* parse_one() sends a sample down one end of the socket pair and parses
+* it off the other, as a worker would on a fresh connection. With parse
+* false it only moves the bytes, which measures the socket's share of
+* the cost. Returns whether conn_parse accepted the request.
+*/
+bool parse_one(int sv[2], const Sample *s, bool parse) {
+    if (write(sv[0], s->text, s->len) != (ssize_t) s->len) {
+        perror("write");
+        exit(1);
+    }
+    bool ok = true;
+    if (parse) {
+        conn_t *conn = conn_new(sv[1]);
+        ok = conn_parse(conn) == NULL;
+        conn_delete(&conn);
+    }
+    drain(sv[1]);
+    return ok;
+}
+
+// helper function to read a monotonic clock in seconds
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// helper function to time one kind of sample; returns nanoseconds per request
+double time_kind(int sv[2], const char *kind, double seconds, bool parse, double *bytes) {
+    long requests = 0;
+    *bytes = 0;
+    double start = now(), elapsed = 0;
+    while (elapsed < seconds) {
+        for (int i = 0; i < corpusSize; i++) {
+            if (strcmp(corpus[i].kind, kind) == 0) {
+                parse_one(sv, &corpus[i], parse);
+                requests++;
+                *bytes += corpus[i].len;
+            }
+        }
+        elapsed = now() - start;
+    }
+    *bytes /= requests;
+    return elapsed * 1e9 / requests;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = 0.5; // time spent on each kind of sample, with and without parsing
+    int option;
+    while ((option = getopt(argc, argv, "t:")) != -1) {
+        switch (option) {
+        case 't': seconds = atof(optarg); break;
+        default: fprintf(stderr, "usage: ./conn_bench [-t seconds_per_kind]\n"); exit(1);
+        }
+    }
+    build_corpus();
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+
+    // Check the corpus parses as intended before timing it
+    for (int i = 0; i < corpusSize; i++) {
+        if (parse_one(sv, &corpus[i], true) != corpus[i].valid) {
+            fprintf(stderr, "sample %d (%s) parsed wrongly\n", i, corpus[i].kind);
+            exit(1);
+        }
+    }
+
+    // conn_parse reads the head off the socket itself, so the bytes' round
+    // trip through the kernel is timed alone and subtracted
+    printf("%-12s %12s %10s %10s\n", "kind", "requests/s", "ns/byte", "socket ns");
+    const char *kinds[] = { "headers", "long-lines", "put", "malformed" };
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        double bytes;
+        double total = time_kind(sv, kinds[k], seconds, true, &bytes);
+        double socket = time_kind(sv, kinds[k], seconds, false, &bytes);
+        double parse = total > socket ? total - socket : 0;
+        printf("%-12s %12.0f %10.2f %10.0f\n", kinds[k], parse > 0 ? 1e9 / parse : 0, parse / bytes, socket);
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return 0;
+}
@@ -0,0 +1,241 @@
+#include "flight.h"
+
+#include "green.h"
+#include "layout.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FLIGHT_BUCKETS 256 // hash buckets for flights and negative entries
+#define NEGATIVE_MAX   4096 // negative entries kept at most
+
+// An open in progress, shared by everyone who asked for the path meanwhile
+typedef struct Flight {
+    char path[LAYOUT_PATH_MAX]; // file being opened
+    pthread_cond_t done_cv; // broadcast when the leader finishes
+    bool done; // the result below is set
+    int fd; // the leader's descriptor, or -1
+    off_t size; // file size
+    int err; // errno when fd is -1
+    int refs; // callers still to take the result
+    struct Flight *next; // next flight in the bucket
+} flight_t;
+
+// A path recently found missing
+typedef struct Negative {
+    char path[LAYOUT_PATH_MAX]; // the missing file
+    uint64_t expires_ms; // when the entry stops counting
+    struct Negative *next; // next entry in the bucket
+} negative_t;
+
+typedef struct Flights {
+    pthread_mutex_t lock; // guards everything below
+    long negative_ms; // negative entry lifetime
+    uint64_t generation; // bumped by every flights_forget
+    flight_t *flights[FLIGHT_BUCKETS]; // opens in progress
+    negative_t *negatives[FLIGHT_BUCKETS]; // missing paths
+    uint64_t negative_count; // entries in negatives
+    uint64_t opens; // opens performed
+    uint64_t joined; // callers that shared another open
+    uint64_t negative_hits; // callers answered from the negative cache
+} flights_t;
+
+// function to check the negative cache, dropping expired entries on the way
+static bool negative_find(flights_t *g, uint32_t bucket, const char *path) {
+    uint64_t now = monotonic_ms();
+    negative_t **link = &g->negatives[bucket];
+    while (*link != NULL) {
+        negative_t *n = *link;
+        if (n->expires_ms <= now) {
+            *link = n->next;
+            free(n);
+            g->negative_count--;
+        } else if (strcmp(n->path, path) == 0) {
+            return true;
+        } else {
+            link = &n->next;
+        }
+    }
+    return false;
+}
+
+// function to open, lock, and stat a file for the leader of a flight
+static int flight_load(const char *path, off_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (flock(fd, LOCK_SH) == -1 || fstat(fd, &st) == -1) {
+        close(fd);
+        errno = EIO;
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        close(fd);
+        errno = EISDIR;
+        return -1;
+    }
+    *size = st.st_size;
+    return fd;
+}
+
+// function to create a flight group
+flights_t *flights_new(long negative_ms) {
+    flights_t *g = calloc(1, sizeof(flights_t));
+    if (g == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&g->lock, NULL);
+    g->negative_ms = negative_ms;
+    return g;
+}
+
+// function to free a flight group
+void flights_delete(flights_t **g) {
+    flights_t *fg = *g;
+    for (int i = 0; i < FLIGHT_BUCKETS; i++) {
+        while (fg->negatives[i] != NULL) {
+            negative_t *n = fg->negatives[i];
+            fg->negatives[i] = n->next;
+            free(n);
+        }
+    }
+    pthread_mutex_destroy(&fg->lock);
+    free(fg);
+    *g = NULL;
+}
+
+// function to open a file once for every concurrent caller
+int flights_open(flights_t *g, const char *path, off_t *size) {
+    if (strlen(path) >= LAYOUT_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    uint32_t bucket = fnv1a(path) % FLIGHT_BUCKETS;
+    pthread_mutex_lock(&g->lock);
+    if (g->negative_ms > 0 && negative_find(g, bucket, path)) {
+        g->negative_hits++;
+        pthread_mutex_unlock(&g->lock);
+        errno = ENOENT;
+        return -1;
+    }
+
+    flight_t *f = g->flights[bucket];
+    while (f != NULL && strcmp(f->path, path) != 0) {
+        f = f->next;
+    }
+    if (f != NULL) {
+        // Someone is already opening it; wait for their result
+        f->refs++;
+        g->joined++;
+        while (!f->done) {
+            if (green_running()) {
+                // The leader may be parked on this carrier, so let it run
+                pthread_mutex_unlock(&g->lock);
+                green_sleep(1);
+                pthread_mutex_lock(&g->lock);
+            } else {
+                pthread_cond_wait(&f->done_cv, &g->lock);
+            }
+        }
+    } else {
+        f = calloc(1, sizeof(flight_t));
+        if (f == NULL) {
+            pthread_mutex_unlock(&g->lock);
+            return flight_load(path, size);
+        }
+        strcpy(f->path, path);
+        pthread_cond_init(&f->done_cv, NULL);
+        f->refs = 1;
+        f->next = g->flights[bucket];
+        g->flights[bucket] = f;
+        g->opens++;
+        uint64_t generation = g->generation;
+        pthread_mutex_unlock(&g->lock);
+
+        f->fd = flight_load(path, &f->size);
+        f->err = errno;
+
+        pthread_mutex_lock(&g->lock);
+        f->done = true;
+        flight_t **link = &g->flights[bucket];
+        while (*link != f) {
+            link = &(*link)->next;
+        }
+        *link = f->next; // later callers start a fresh open
+        pthread_cond_broadcast(&f->done_cv);
+
+        // Remember the miss unless a PUT created the file while we looked
+        if (f->fd == -1 && f->err == ENOENT && g->negative_ms > 0 && g->generation == generation
+            && g->negative_count < NEGATIVE_MAX) {
+            negative_t *n = malloc(sizeof(negative_t));
+            if (n != NULL) {
+                strcpy(n->path, path);
+                n->expires_ms = monotonic_ms() + g->negative_ms;
+                n->next = g->negatives[bucket];
+                g->negatives[bucket] = n;
+                g->negative_count++;
+            }
+        }
+    }
+
+    // Every caller gets its own descriptor for the shared, locked file
+    int fd = -1;
+    int err = f->err;
+    if (f->fd != -1) {
+        fd = dup(f->fd);
+        err = errno;
+        *size = f->size;
+    }
+    if (--f->refs == 0) {
+        if (f->fd != -1) {
+            close(f->fd);
+        }
+        pthread_cond_destroy(&f->done_cv);
+        free(f);
+    }
+    pthread_mutex_unlock(&g->lock);
+    errno = err;
+    return fd;
+}
+
+// function to drop a path from the negative cache
+void flights_forget(flights_t *g, const char *path) {
+    if (g->negative_ms == 0 || strlen(path) >= LAYOUT_PATH_MAX) {
+        return;
+    }
+    uint32_t bucket = fnv1a(path) % FLIGHT_BUCKETS;
+    pthread_mutex_lock(&g->lock);
+    g->generation++;
+    negative_t **link = &g->negatives[bucket];
+    while (*link != NULL) {
+        negative_t *n = *link;
+        if (strcmp(n->path, path) == 0) {
+            *link = n->next;
+            free(n);
+            g->negative_count--;
+        } else {
+            link = &n->next;
+        }
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+// function to report the coalescing counters
+void flights_dump_stats(flights_t *g, FILE *out) {
+    pthread_mutex_lock(&g->lock);
+    fprintf(out, "STATS,flight,opens=%lu,joined=%lu,negative_hits=%lu,negative_entries=%lu\n",
+        (unsigned long) g->opens, (unsigned long) g->joined, (unsigned long) g->negative_hits,
+        (unsigned long) g->negative_count);
+    pthread_mutex_unlock(&g->lock);
+}
@@ -0,0 +1,65 @@
+/**
+ * @File flight.h
+ *
+ * Single-flight opens for GET.  When several workers GET the same file
+ * at once, the first one opens, locks, and stats it while the rest wait
+ * and then share its descriptor, so a thundering herd costs one lookup.
+ * Files found missing can be remembered briefly in a negative cache,
+ * which a PUT of the same path clears.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <sys/types.h>
+
+typedef struct Flights flights_t;
+
+/** @brief Creates a flight group.
+ *
+ *  @param negative_ms how long a missing file is remembered, in
+ *         milliseconds; 0 disables the negative cache
+ *
+ *  @return the group, or NULL on failure
+ */
+flights_t *flights_new(long negative_ms);
+
+/** @brief Frees a flight group.  No opens may be in progress.
+ *
+ *  @param g the group to delete
+ */
+void flights_delete(flights_t **g);
+
+/** @brief Opens a regular file for reading under a shared flock,
+ *         joining an open of the same path already in progress.
+ *
+ *  The lock belongs to the open file description that all joined
+ *  callers share, so callers must release it by closing their
+ *  descriptor, never with LOCK_UN.
+ *
+ *  @param g the group
+ *
+ *  @param path the file to open
+ *
+ *  @param size receives the file size
+ *
+ *  @return a descriptor the caller owns, or -1 with errno set
+ *          (EISDIR for a directory)
+ */
+int flights_open(flights_t *g, const char *path, off_t *size);
+
+/** @brief Drops any negative cache entry for a path that now exists.
+ *
+ *  @param g the group
+ *
+ *  @param path the file that was created
+ */
+void flights_forget(flights_t *g, const char *path);
+
+/** @brief Writes the coalescing counters as a STATS line.
+ *
+ *  @param g the group
+ *
+ *  @param out the stream to write to
+ */
+void flights_dump_stats(flights_t *g, FILE *out);
@@ -0,0 +1,589 @@
+#define _GNU_SOURCE // MAP_STACK
+
+#include "green.h"
+#include "lockprof.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#define GUARD_SIZE     4096 // inaccessible page below each stack, so an overflow faults
+#define IDLE_MAX       1024 // finished green threads a carrier keeps, stacks and all, for reuse
+#define EVENT_BATCH    64 // epoll events taken at once
+#define POLL_MAX       8 // descriptors a green poll can wait on
+#define LOCK_SLEEP_MS  16 // longest wait between attempts at a contended flock or mutex
+
+typedef struct Carrier carrier_t;
+
+typedef struct Green {
+    ucontext_t ctx; // saved registers while parked
+    int fd; // the connection it serves
+    char *stack; // stack mapping, guard page first
+    bool registered; // fd has been added to the carrier's epoll
+    bool waiting; // parked until an event or timeout
+    bool queued; // on the ready list
+    bool sleeping; // on the sleep list
+    bool done; // serve has returned
+    green_activity_t *activity; // watched I/O, if any
+    uint64_t wake_ms; // when a sleeping wait times out
+    struct Green *next; // next on the ready or idle list
+    struct Green *sleep_next; // next on the sleep list, by wake_ms
+} green_t;
+
+struct Carrier {
+    pthread_t thread; // the carrier thread
+    int epfd; // epoll instance of the carrier
+    int wake_fd; // signaled when a connection arrives or on stop
+    pthread_mutex_t lock; // guards the inbox
+    int *inbox; // connections spawned on this carrier
+    size_t inbox_len; // connections in inbox
+    size_t inbox_cap; // capacity of inbox
+    ucontext_t sched; // the scheduler loop's context
+    green_t *current; // green thread running, or NULL
+    green_t *ready_head; // oldest runnable green thread
+    green_t *ready_tail; // newest runnable green thread
+    green_t *sleepers; // parked with a timeout, soonest first
+    green_t *idle; // finished green threads kept for reuse
+    int idle_count; // entries on idle
+    void *local; // returned by ops->start
+    atomic_ulong spawned; // green threads started
+    atomic_long live; // green threads not yet finished
+    atomic_long peak; // most live at once
+    atomic_ulong switches; // times a green thread was resumed
+    atomic_ulong waits; // times a green thread parked
+};
+
+// The carrier threads
+static struct {
+    carrier_t *carriers; // one per carrier thread
+    int count; // number of carriers
+    atomic_uint next; // round-robin cursor for green_spawn
+    atomic_bool stopping; // green_stop was called
+    const green_ops_t *ops; // the server's handlers
+} greens;
+
+static __thread carrier_t *self; // carrier run by this thread, NULL elsewhere
+static __thread green_activity_t *thread_activity; // watched I/O of a thread that is not a carrier
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_recv(int fd, void *buf, size_t len, int flags);
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t __real_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int __real_flock(int fd, int operation);
+
+// function to find the green thread serving fd on this thread, if any
+static green_t *owner(int fd) {
+    return self != NULL && self->current != NULL && self->current->fd == fd ? self->current : NULL;
+}
+
+// function to put a parked green thread back on the ready list
+static void make_ready(carrier_t *c, green_t *g) {
+    if (!g->waiting || g->queued) {
+        return; // a stale event, or already woken
+    }
+    g->queued = true;
+    g->next = NULL;
+    if (c->ready_tail == NULL) {
+        c->ready_head = g;
+    } else {
+        c->ready_tail->next = g;
+    }
+    c->ready_tail = g;
+}
+
+// function to take a green thread off the sleep list
+static void unsleep(carrier_t *c, green_t *g) {
+    green_t **link = &c->sleepers;
+    while (*link != g) {
+        link = &(*link)->sleep_next;
+    }
+    *link = g->sleep_next;
+    g->sleeping = false;
+}
+
+// function to return to the scheduler until woken, or until timeout_ms pass if not negative
+static void park(green_t *g, long timeout_ms) {
+    carrier_t *c = self;
+    if (timeout_ms >= 0) {
+        g->wake_ms = monotonic_ms() + timeout_ms;
+        green_t **link = &c->sleepers;
+        while (*link != NULL && (*link)->wake_ms <= g->wake_ms) {
+            link = &(*link)->sleep_next;
+        }
+        g->sleep_next = *link;
+        *link = g;
+        g->sleeping = true;
+    }
+    g->waiting = true;
+    atomic_fetch_add_explicit(&c->waits, 1, memory_order_relaxed);
+    swapcontext(&g->ctx, &c->sched);
+    g->waiting = false;
+    if (g->sleeping) {
+        unsleep(c, g);
+    }
+}
+
+// function to park until the green thread's own connection is ready
+static void wait_own(green_t *g, uint32_t events) {
+    struct epoll_event ev = { events | EPOLLONESHOT, { .ptr = g } };
+    int rc = epoll_ctl(self->epfd, g->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, g->fd, &ev);
+    g->registered = g->registered || rc == 0;
+    park(g, rc == 0 ? -1 : 1); // without a registration, poll again shortly
+}
+
+// function run at the start of every green thread
+static void green_main(void) {
+    carrier_t *c = self;
+    green_t *g = c->current;
+    greens.ops->serve(c->local, g->fd);
+    g->done = true;
+    // returning resumes the scheduler through uc_link
+}
+
+// function to start a green thread for a connection
+static green_t *green_new(carrier_t *c, int fd) {
+    green_t *g = c->idle;
+    if (g != NULL) {
+        c->idle = g->next;
+        c->idle_count--;
+    } else {
+        g = calloc(1, sizeof(green_t));
+        if (g == NULL) {
+            return NULL;
+        }
+        g->stack = mmap(NULL, GUARD_SIZE + GREEN_STACK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (g->stack == MAP_FAILED) {
+            free(g);
+            return NULL;
+        }
+        mprotect(g->stack, GUARD_SIZE, PROT_NONE);
+    }
+    char *stack = g->stack;
+    memset(g, 0, sizeof(green_t));
+    g->stack = stack;
+    g->fd = fd;
+    getcontext(&g->ctx);
+    g->ctx.uc_stack.ss_sp = g->stack + GUARD_SIZE;
+    g->ctx.uc_stack.ss_size = GREEN_STACK_SIZE;
+    g->ctx.uc_link = &c->sched;
+    makecontext(&g->ctx, green_main, 0);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    atomic_fetch_add_explicit(&c->spawned, 1, memory_order_relaxed);
+    long live = atomic_fetch_add_explicit(&c->live, 1, memory_order_relaxed) + 1;
+    if (live > atomic_load_explicit(&c->peak, memory_order_relaxed)) {
+        atomic_store_explicit(&c->peak, live, memory_order_relaxed);
+    }
+    g->waiting = true;
+    make_ready(c, g);
+    return g;
+}
+
+// function to recycle a finished green thread
+static void green_done(carrier_t *c, green_t *g) {
+    atomic_fetch_sub_explicit(&c->live, 1, memory_order_relaxed);
+    if (c->idle_count < IDLE_MAX) {
+        g->next = c->idle;
+        c->idle = g;
+        c->idle_count++;
+    } else {
+        munmap(g->stack, GUARD_SIZE + GREEN_STACK_SIZE);
+        free(g);
+    }
+}
+
+// function run by each carrier thread: the scheduler loop
+static void *carrier_thread(void *arg) {
+    carrier_t *c = arg;
+    self = c;
+    c->local = greens.ops->start != NULL ? greens.ops->start() : NULL;
+    struct epoll_event events[EVENT_BATCH];
+    while (true) {
+        // Start green threads for new connections
+        pthread_mutex_lock(&c->lock);
+        int *inbox = c->inbox;
+        size_t inbox_len = c->inbox_len;
+        c->inbox = NULL;
+        c->inbox_len = c->inbox_cap = 0;
+        bool stopping = atomic_load(&greens.stopping);
+        pthread_mutex_unlock(&c->lock);
+        for (size_t i = 0; i < inbox_len; i++) {
+            if (green_new(c, inbox[i]) == NULL) {
+                close(inbox[i]);
+            }
+        }
+        free(inbox);
+
+        // Run everything runnable until it parks or finishes
+        while (c->ready_head != NULL) {
+            green_t *g = c->ready_head;
+            c->ready_head = g->next;
+            if (c->ready_head == NULL) {
+                c->ready_tail = NULL;
+            }
+            g->queued = false;
+            g->waiting = false;
+            c->current = g;
+            atomic_fetch_add_explicit(&c->switches, 1, memory_order_relaxed);
+            swapcontext(&c->sched, &g->ctx);
+            c->current = NULL;
+            if (g->done) {
+                green_done(c, g);
+            }
+        }
+        if (stopping && inbox_len == 0 && atomic_load_explicit(&c->live, memory_order_relaxed) == 0) {
+            break; // nothing can be spawned after green_stop
+        }
+
+        int timeout = -1;
+        if (c->sleepers != NULL) {
+            uint64_t now = monotonic_ms();
+            timeout = c->sleepers->wake_ms > now ? (int) (c->sleepers->wake_ms - now) : 0;
+        }
+        int n = epoll_wait(c->epfd, events, EVENT_BATCH, timeout);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                uint64_t count;
+                if (__real_read(c->wake_fd, &count, sizeof(count)) == -1) {
+                    // already drained
+                }
+            } else {
+                make_ready(c, events[i].data.ptr);
+            }
+        }
+        uint64_t now = monotonic_ms();
+        while (c->sleepers != NULL && c->sleepers->wake_ms <= now) {
+            green_t *g = c->sleepers;
+            unsleep(c, g);
+            make_ready(c, g);
+        }
+    }
+    if (greens.ops->stop != NULL) {
+        greens.ops->stop(c->local);
+    }
+    while (c->idle != NULL) {
+        green_t *g = c->idle;
+        c->idle = g->next;
+        munmap(g->stack, GUARD_SIZE + GREEN_STACK_SIZE);
+        free(g);
+    }
+    return NULL;
+}
+
+// function to start the carrier threads
+int green_start(int carriers, const green_ops_t *ops) {
+    // Each green thread holds a socket, so the default descriptor limit would be the ceiling
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    greens.ops = ops;
+    greens.carriers = calloc(carriers, sizeof(carrier_t));
+    if (greens.carriers == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < carriers; i++) {
+        carrier_t *c = &greens.carriers[i];
+        c->epfd = epoll_create1(EPOLL_CLOEXEC);
+        c->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        struct epoll_event ev = { EPOLLIN, { .ptr = NULL } };
+        if (c->epfd == -1 || c->wake_fd == -1 || epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->wake_fd, &ev) == -1) {
+            return -1;
+        }
+        pthread_mutex_init(&c->lock, NULL);
+        if (pthread_create(&c->thread, NULL, carrier_thread, c) != 0) {
+            return -1;
+        }
+        greens.count++;
+    }
+    return 0;
+}
+
+// function to hand a connection to a carrier
+int green_spawn(int fd) {
+    carrier_t *c = &greens.carriers[atomic_fetch_add(&greens.next, 1) % greens.count];
+    pthread_mutex_lock(&c->lock);
+    if (c->inbox_len == c->inbox_cap) {
+        size_t cap = c->inbox_cap == 0 ? 16 : 2 * c->inbox_cap;
+        int *grown = realloc(c->inbox, cap * sizeof(int));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&c->lock);
+            return -1;
+        }
+        c->inbox = grown;
+        c->inbox_cap = cap;
+    }
+    c->inbox[c->inbox_len++] = fd;
+    pthread_mutex_unlock(&c->lock);
+    uint64_t one = 1;
+    return __real_write(c->wake_fd, &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+}
+
+// function to drain and stop the carriers
+void green_stop(void) {
+    atomic_store(&greens.stopping, true);
+    for (int i = 0; i < greens.count; i++) {
+        uint64_t one = 1;
+        if (__real_write(greens.carriers[i].wake_fd, &one, sizeof(one)) == -1) {
+            // the counter is already nonzero
+        }
+    }
+    for (int i = 0; i < greens.count; i++) {
+        carrier_t *c = &greens.carriers[i];
+        pthread_join(c->thread, NULL);
+        pthread_mutex_destroy(&c->lock);
+        free(c->inbox);
+        close(c->epfd);
+        close(c->wake_fd);
+    }
+    free(greens.carriers);
+    greens.carriers = NULL;
+    greens.count = 0;
+}
+
+// function to check whether the caller is a green thread
+bool green_running(void) {
+    return self != NULL && self->current != NULL;
+}
+
+// function to let the other green threads run for a while
+void green_sleep(long ms) {
+    park(self->current, ms);
+}
+
+// function to lock a mutex without stalling the carrier
+void green_mutex_lock(pthread_mutex_t *mutex) {
+    const void *site = __builtin_return_address(0); // profiled as our caller's lock
+    if (!green_running()) {
+        lockprof_mutex_lock(mutex, site);
+        return;
+    }
+    uint64_t since = lockprof_now();
+    bool contended = false;
+    long sleep_ms = 1;
+    while (pthread_mutex_trylock(mutex) != 0) {
+        contended = true;
+        park(self->current, sleep_ms);
+        sleep_ms = sleep_ms * 2 < LOCK_SLEEP_MS ? sleep_ms * 2 : LOCK_SLEEP_MS;
+    }
+    lockprof_acquired(mutex, site, since, contended);
+}
+
+// function to unlock a mutex locked with green_mutex_lock
+void green_mutex_unlock(pthread_mutex_t *mutex) {
+    pthread_mutex_unlock(mutex); // profiled, if at all, by the unlock wrapper
+}
+
+// function to report the green thread counters
+void green_dump_stats(FILE *out) {
+    unsigned long spawned = 0, switches = 0, waits = 0;
+    long live = 0, peak = 0;
+    for (int i = 0; i < greens.count; i++) {
+        carrier_t *c = &greens.carriers[i];
+        spawned += atomic_load_explicit(&c->spawned, memory_order_relaxed);
+        switches += atomic_load_explicit(&c->switches, memory_order_relaxed);
+        waits += atomic_load_explicit(&c->waits, memory_order_relaxed);
+        live += atomic_load_explicit(&c->live, memory_order_relaxed);
+        peak += atomic_load_explicit(&c->peak, memory_order_relaxed);
+    }
+    fprintf(out, "STATS,green,carriers=%d,spawned=%lu,live=%ld,peak=%ld,switches=%lu,waits=%lu\n", greens.count,
+        spawned, live, peak, switches, waits);
+}
+
+// function to watch the caller's I/O on a connection
+void green_watch(green_activity_t *activity) {
+    if (green_running()) {
+        self->current->activity = activity;
+    } else {
+        thread_activity = activity;
+    }
+}
+
+// function to note the start of a call on fd, returning its watch if it has one
+static green_activity_t *activity_begin(int fd) {
+    green_activity_t *a = green_running() ? self->current->activity : thread_activity;
+    if (a == NULL || a->fd != fd) {
+        return NULL;
+    }
+    atomic_store_explicit(&a->blocked, true, memory_order_relaxed);
+    return a;
+}
+
+// function to note the end of a call and the bytes it moved
+static void activity_end(green_activity_t *a, ssize_t moved) {
+    if (a != NULL) {
+        if (moved > 0) {
+            atomic_fetch_add_explicit(&a->moved, moved, memory_order_relaxed);
+        }
+        atomic_store_explicit(&a->blocked, false, memory_order_relaxed);
+    }
+}
+
+// The wrappers below replace the calls named after them at link time.
+// Only a green thread's own connection is non-blocking, so EAGAIN on any
+// other descriptor is passed through as the caller expects.  Calls on a
+// watched connection also report their progress.
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+    green_activity_t *a = activity_begin(fd);
+    while (true) {
+        ssize_t rc = __real_read(fd, buf, count);
+        green_t *g = NULL;
+        if (rc != -1 || errno != EAGAIN || (g = owner(fd)) == NULL) {
+            activity_end(a, rc);
+            return rc;
+        }
+        wait_own(g, EPOLLIN);
+    }
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+    green_activity_t *a = activity_begin(fd);
+    while (true) {
+        ssize_t rc = __real_write(fd, buf, count);
+        green_t *g = NULL;
+        if (rc != -1 || errno != EAGAIN || (g = owner(fd)) == NULL) {
+            activity_end(a, rc);
+            return rc;
+        }
+        wait_own(g, EPOLLOUT);
+    }
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt) {
+    green_activity_t *a = activity_begin(fd);
+    while (true) {
+        ssize_t rc = __real_writev(fd, iov, iovcnt);
+        green_t *g = NULL;
+        if (rc != -1 || errno != EAGAIN || (g = owner(fd)) == NULL) {
+            activity_end(a, rc);
+            return rc;
+        }
+        wait_own(g, EPOLLOUT);
+    }
+}
+
+ssize_t __wrap_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    green_activity_t *a = activity_begin(out_fd);
+    while (true) {
+        ssize_t rc = __real_sendfile(out_fd, in_fd, offset, count);
+        green_t *g = NULL;
+        if (rc != -1 || errno != EAGAIN || (g = owner(out_fd)) == NULL) {
+            activity_end(a, rc);
+            return rc;
+        }
+        wait_own(g, EPOLLOUT);
+    }
+}
+
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags) {
+    // A non-blocking socket ignores MSG_WAITALL, so keep reading here
+    bool all = (flags & MSG_WAITALL) && !(flags & MSG_PEEK);
+    green_activity_t *a = activity_begin(fd);
+    size_t got = 0;
+    while (true) {
+        ssize_t rc = __real_recv(fd, (char *) buf + got, len - got, flags);
+        green_t *g = NULL;
+        if (rc > 0) {
+            got += rc;
+            if (!all || got == len || (g = owner(fd)) == NULL) {
+                activity_end(a, flags & MSG_PEEK ? 0 : (ssize_t) got);
+                return got;
+            }
+        } else if (rc == 0 || errno != EAGAIN || (g = owner(fd)) == NULL) {
+            activity_end(a, flags & MSG_PEEK ? 0 : (ssize_t) got);
+            return got > 0 ? (ssize_t) got : rc;
+        }
+        wait_own(g, EPOLLIN);
+    }
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    green_t *g = self != NULL ? self->current : NULL;
+    if (g == NULL || timeout == 0 || nfds > POLL_MAX) {
+        return __real_poll(fds, nfds, timeout);
+    }
+    uint64_t deadline = monotonic_ms() + (timeout > 0 ? timeout : 0);
+    while (true) {
+        int rc = __real_poll(fds, nfds, 0);
+        if (rc != 0) {
+            return rc;
+        }
+        long left = -1;
+        if (timeout > 0) {
+            uint64_t now = monotonic_ms();
+            if (now >= deadline) {
+                return 0;
+            }
+            left = deadline - now;
+        }
+        // Other descriptors, such as an eventfd shared by several green
+        // threads, are registered through a duplicate of their own
+        int dups[POLL_MAX];
+        for (nfds_t i = 0; i < nfds; i++) {
+            // poll and epoll share the values of the IN, OUT, PRI, and RDHUP bits
+            struct epoll_event ev = { (uint32_t) fds[i].events | EPOLLONESHOT, { .ptr = g } };
+            dups[i] = -1;
+            if (fds[i].fd == g->fd) {
+                int rc = epoll_ctl(self->epfd, g->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, g->fd, &ev);
+                g->registered = g->registered || rc == 0;
+            } else if (fds[i].fd >= 0) {
+                dups[i] = fcntl(fds[i].fd, F_DUPFD_CLOEXEC, 0);
+                if (dups[i] != -1 && epoll_ctl(self->epfd, EPOLL_CTL_ADD, dups[i], &ev) == -1) {
+                    close(dups[i]);
+                    dups[i] = -1;
+                }
+            }
+        }
+        park(g, left);
+        for (nfds_t i = 0; i < nfds; i++) {
+            if (dups[i] != -1) {
+                epoll_ctl(self->epfd, EPOLL_CTL_DEL, dups[i], NULL);
+                close(dups[i]);
+            }
+        }
+    }
+}
+
+// function to flock, parking a green thread instead of blocking its carrier
+static int green_flock(int fd, int operation) {
+    green_t *g = self != NULL ? self->current : NULL;
+    if (g == NULL || (operation & (LOCK_NB | LOCK_UN))) {
+        return __real_flock(fd, operation);
+    }
+    // The kernel cannot wake a green thread, so retry with backoff
+    long sleep_ms = 1;
+    while (true) {
+        int rc = __real_flock(fd, operation | LOCK_NB);
+        if (rc == 0 || errno != EWOULDBLOCK) {
+            return rc;
+        }
+        park(g, sleep_ms);
+        sleep_ms = sleep_ms * 2 < LOCK_SLEEP_MS ? sleep_ms * 2 : LOCK_SLEEP_MS;
+    }
+}
+
+int __wrap_flock(int fd, int operation) {
+    return lockprof_flock(fd, operation, __builtin_return_address(0), green_flock);
+}
@@ -0,0 +1,117 @@
+/**
+ * @File green.h
+ *
+ * Green threads: each connection runs as a stackful coroutine
+ * (ucontext) on one of a few carrier threads, so the blocking handlers
+ * and the helper library can serve far more connections than there are
+ * OS threads.  A connection's socket is made non-blocking; the Makefile
+ * links with --wrap so read, write, recv, writev, sendfile, poll, and
+ * flock -- including the calls the helper library makes inside
+ * read_until, write_all, and pass_bytes -- park the coroutine and
+ * return to the carrier's epoll loop instead of blocking.  Outside a
+ * green thread the wrappers are plain calls.  Mutexes and condition
+ * variables still block the whole carrier: they must only be held
+ * briefly, and waits that depend on other work -- another green thread,
+ * or a thread such as the commit or drain threads -- must use
+ * green_sleep or green_mutex_lock instead.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define GREEN_STACK_SIZE (128 * 1024) // stack of each green thread, committed only as it is touched
+
+/** @struct green_ops_t
+ *
+ *  @brief The server's handlers for green threads.
+ */
+typedef struct {
+    // Called once on each carrier thread before it serves anything;
+    // returns the carrier's local state, such as a context pool.
+    void *(*start)(void);
+    // Serves a connection and closes it, on a green thread.
+    void (*serve)(void *local, int fd);
+    // Called once on each carrier thread as it exits.
+    void (*stop)(void *local);
+} green_ops_t;
+
+/** @struct green_activity_t
+ *
+ *  @brief Progress of the blocking I/O on one connection, kept up by the
+ *         wrappers on every thread, green or not, for whoever watches it.
+ */
+typedef struct {
+    int fd; // the connection watched
+    atomic_bool blocked; // a call on fd is waiting for the peer
+    atomic_ulong moved; // bytes read from or written to fd
+} green_activity_t;
+
+/** @brief Starts the carrier threads, and raises the open file limit as
+ *         far as it will go.
+ *
+ *  @param carriers the number of carrier threads
+ *
+ *  @param ops the handlers
+ *
+ *  @return 0 on success, or -1 on failure
+ */
+int green_start(int carriers, const green_ops_t *ops);
+
+/** @brief Hands an accepted connection to a carrier, round-robin, to be
+ *         served on a new green thread.
+ *
+ *  @param fd the client socket
+ *
+ *  @return 0 on success, or -1 if it could not be queued
+ */
+int green_spawn(int fd);
+
+/** @brief Waits for every green thread to finish, then stops the
+ *         carriers.  No connection may be spawned afterwards.
+ */
+void green_stop(void);
+
+/** @brief Checks whether the caller is running on a green thread.
+ *
+ *  @return true on a green thread, false on any other thread
+ */
+bool green_running(void);
+
+/** @brief Parks the calling green thread, letting the others on its
+ *         carrier run.
+ *
+ *  @param ms how long to sleep, in milliseconds
+ */
+void green_sleep(long ms);
+
+/** @brief Locks a mutex.  On a green thread, retries with short sleeps
+ *         rather than blocking, since its holder may be parked on the
+ *         same carrier.
+ *
+ *  @param mutex the mutex to lock
+ */
+void green_mutex_lock(pthread_mutex_t *mutex);
+
+/** @brief Unlocks a mutex locked with green_mutex_lock.
+ *
+ *  @param mutex the mutex to unlock
+ */
+void green_mutex_unlock(pthread_mutex_t *mutex);
+
+/** @brief Starts or stops reporting the caller's I/O on a connection.
+ *         On a green thread the watch belongs to the green thread,
+ *         otherwise to the OS thread.
+ *
+ *  @param activity where to report I/O on activity->fd, or NULL to stop
+ */
+void green_watch(green_activity_t *activity);
+
+/** @brief Writes a STATS line with the green thread counters.
+ *
+ *  @param out the stream to write to
+ */
+void green_dump_stats(FILE *out);
@@ -0,0 +1,400 @@
+#define _GNU_SOURCE // memfd_create, F_ADD_SEALS
+
+#include "gzcache.h"
+
+#include "green.h"
+#include "layout.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define GZ_BUCKETS 1024 // hash buckets for entries
+#define GZ_CHUNK   65536 // bytes read and compressed at a time
+
+// A file's gzip variant, or the note that it does not compress, or a miss being compressed
+typedef struct Entry {
+    char path[LAYOUT_PATH_MAX]; // the file, the key
+    dev_t dev; // device, inode, size, and times of the bytes compressed
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    int fd; // sealed memfd holding the gzip stream, -1 if the file does not shrink
+    off_t len; // bytes in fd
+    bool ready; // compressed; until then the entry is the miss in flight, and not in the LRU list
+    bool dropped; // forgotten while in flight, so the result is not kept
+    struct Entry *next; // next in its bucket
+    struct Entry *newer; // LRU neighbours, most recently used at the head
+    struct Entry *older;
+} entry_t;
+
+typedef struct GzCache {
+    pthread_mutex_t lock; // guards everything here and every entry
+    pthread_cond_t ready_cv; // broadcast when a miss in flight is done
+    int level; // compression level
+    size_t capacity; // byte budget
+    size_t bytes; // bytes held by ready entries
+    uint64_t entries; // ready entries
+    entry_t *buckets[GZ_BUCKETS]; // entries by path
+    entry_t lru; // sentinel: lru.older is the most recent entry, lru.newer the least
+    uint64_t hits; // lookups answered with a variant
+    uint64_t misses; // lookups that compressed the file
+    uint64_t joined; // lookups that waited for another's compression
+    uint64_t incompressible; // lookups answered that the file does not shrink
+    uint64_t skipped; // lookups of files too large to compress
+    uint64_t discarded; // compressions thrown away: the file changed, was forgotten meanwhile, or failed
+    uint64_t bytes_in; // bytes compressed
+    uint64_t bytes_out; // bytes of gzip made from them
+    uint64_t evicted; // entries dropped to stay in budget
+} gzcache_t;
+
+// function to count what an entry costs against the budget
+static size_t cost(const entry_t *e) {
+    return sizeof(entry_t) + e->len;
+}
+
+// function to check whether a stat describes the same bytes as another
+static bool same_file(dev_t dev, ino_t ino, off_t size, const struct timespec *mtime, const struct timespec *ctime,
+    const struct stat *st) {
+    return dev == st->st_dev && ino == st->st_ino && size == st->st_size && mtime->tv_sec == st->st_mtim.tv_sec
+        && mtime->tv_nsec == st->st_mtim.tv_nsec && ctime->tv_sec == st->st_ctim.tv_sec
+        && ctime->tv_nsec == st->st_ctim.tv_nsec;
+}
+
+// function to check whether an entry was made from the file as it is now
+static bool fresh(const entry_t *e, const struct stat *st) {
+    return same_file(e->dev, e->ino, e->size, &e->mtime, &e->ctime, st);
+}
+
+// function to free an entry
+static void entry_free(entry_t *e) {
+    if (e->fd >= 0) {
+        close(e->fd); // senders keep their own descriptors
+    }
+    free(e);
+}
+
+// function to take an entry out of the LRU list; the cache is locked
+static void lru_unlink(entry_t *e) {
+    e->newer->older = e->older;
+    e->older->newer = e->newer;
+}
+
+// function to make an entry the most recently used; the cache is locked
+static void lru_push(gzcache_t *c, entry_t *e) {
+    e->older = c->lru.older;
+    e->newer = &c->lru;
+    c->lru.older->newer = e;
+    c->lru.older = e;
+}
+
+// function to find an entry by path; the cache is locked
+static entry_t *lookup(gzcache_t *c, const char *path) {
+    entry_t *e = c->buckets[fnv1a(path) % GZ_BUCKETS];
+    while (e != NULL && strcmp(e->path, path) != 0) {
+        e = e->next;
+    }
+    return e;
+}
+
+// function to take an entry out of the cache and free it; the cache is locked
+static void drop(gzcache_t *c, entry_t *e) {
+    entry_t **link = &c->buckets[fnv1a(e->path) % GZ_BUCKETS];
+    while (*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+    if (e->ready) {
+        lru_unlink(e);
+        c->bytes -= cost(e);
+        c->entries--;
+    }
+    entry_free(e);
+}
+
+// function to write a whole buffer at an offset
+static int pwrite_all(int fd, const unsigned char *buf, size_t len, off_t at) {
+    while (len > 0) {
+        ssize_t wb = pwrite(fd, buf, len, at);
+        if (wb == -1 && errno == EINTR) {
+            continue;
+        }
+        if (wb <= 0) {
+            return -1;
+        }
+        buf += wb;
+        len -= wb;
+        at += wb;
+    }
+    return 0;
+}
+
+// function to compress a file a chunk at a time into a sealed memfd; returns 0, 1 if it does not shrink, or -1
+static int compress_file(int level, int src, const struct stat *st, int *out, off_t *len) {
+    unsigned char *in = malloc(GZ_CHUNK), *buf = malloc(GZ_CHUNK);
+    int fd = memfd_create("gzip", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (in == NULL || buf == NULL || fd == -1
+        || deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) { // +16 for a gzip wrapper
+        free(in);
+        free(buf);
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    int rc = 0;
+    int z = Z_OK;
+    off_t at = 0;
+    while (rc == 0 && z != Z_STREAM_END) {
+        ssize_t rb = 0;
+        if (at < st->st_size) {
+            rb = pread(src, in, st->st_size - at < GZ_CHUNK ? st->st_size - at : GZ_CHUNK, at);
+            if (rb == -1 && errno == EINTR) {
+                continue;
+            }
+            if (rb <= 0) {
+                rc = -1; // short read: the file changed under us or failed
+                break;
+            }
+            at += rb;
+        }
+        zs.next_in = in;
+        zs.avail_in = rb;
+        do {
+            zs.next_out = buf;
+            zs.avail_out = GZ_CHUNK;
+            z = deflate(&zs, at < st->st_size ? Z_NO_FLUSH : Z_FINISH);
+            size_t made = GZ_CHUNK - zs.avail_out;
+            if (z == Z_STREAM_ERROR || pwrite_all(fd, buf, made, zs.total_out - made) == -1) {
+                rc = -1;
+            } else if (zs.total_out >= (uLong) st->st_size) {
+                rc = 1; // it does not shrink: remember that instead
+            }
+        } while (rc == 0 && zs.avail_out == 0);
+    }
+    *len = zs.total_out;
+    deflateEnd(&zs);
+    free(in);
+    free(buf);
+    // Read without a lock, so the bytes only count if the file is still the one stat'ed
+    struct stat now;
+    if (rc != -1 && (fstat(src, &now) == -1 || !same_file(st->st_dev, st->st_ino, st->st_size, &st->st_mtim,
+                                                   &st->st_ctim, &now))) {
+        rc = -1;
+    }
+    if (rc == 0 && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        close(fd);
+        fd = -1;
+    }
+    *out = fd;
+    return rc;
+}
+
+// function to check an Accept-Encoding value for gzip
+bool gzip_accepted(const char *value) {
+    double gzip_q = -1, any_q = -1; // -1 when not listed
+    const char *p = value;
+    while (*p != '\0') {
+        p += strspn(p, " \t,");
+        size_t len = strcspn(p, " \t;,");
+        if (len == 0) {
+            break;
+        }
+        const char *name = p;
+        p += len;
+        double q = 1;
+        // Parameters, of which only q matters
+        while (*(p += strspn(p, " \t")) == ';') {
+            p += 1 + strspn(p + 1, " \t");
+            if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+                q = strtod(p + 2, NULL);
+            }
+            p += strcspn(p, ";,");
+        }
+        if ((len == 4 && strncasecmp(name, "gzip", 4) == 0) || (len == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+            gzip_q = q;
+        } else if (len == 1 && name[0] == '*') {
+            any_q = q;
+        }
+        p += strcspn(p, ",");
+    }
+    return gzip_q >= 0 ? gzip_q > 0 : any_q > 0;
+}
+
+// function to create a cache
+gzcache_t *gzcache_new(size_t capacity, int level) {
+    if (level < 1 || level > 9) {
+        return NULL;
+    }
+    gzcache_t *c = calloc(1, sizeof(gzcache_t));
+    if (c == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->ready_cv, NULL);
+    c->level = level;
+    c->capacity = capacity;
+    c->lru.newer = c->lru.older = &c->lru;
+    return c;
+}
+
+// function to free a cache
+void gzcache_delete(gzcache_t **c) {
+    gzcache_t *gc = *c;
+    for (int b = 0; b < GZ_BUCKETS; b++) {
+        while (gc->buckets[b] != NULL) {
+            drop(gc, gc->buckets[b]);
+        }
+    }
+    pthread_cond_destroy(&gc->ready_cv);
+    pthread_mutex_destroy(&gc->lock);
+    free(gc);
+    *c = NULL;
+}
+
+// function to find the gzip variant of a file, or to take on its compression
+int gzcache_get(gzcache_t *c, const char *path, const struct stat *st, int *fd, off_t *len) {
+    if (strlen(path) >= LAYOUT_PATH_MAX) {
+        return GZCACHE_SKIP;
+    }
+    pthread_mutex_lock(&c->lock);
+    entry_t *e = lookup(c, path);
+    if (e != NULL && !e->ready) {
+        // Someone is already compressing it; wait for their result
+        c->joined++;
+        while ((e = lookup(c, path)) != NULL && !e->ready) {
+            if (green_running()) {
+                // The compressing caller may be parked on this carrier, so let it run
+                pthread_mutex_unlock(&c->lock);
+                green_sleep(1);
+                pthread_mutex_lock(&c->lock);
+            } else {
+                pthread_cond_wait(&c->ready_cv, &c->lock);
+            }
+        }
+    }
+    if (e != NULL && !fresh(e, st)) {
+        drop(c, e); // made from another version of the file
+        e = NULL;
+    }
+    if (e == NULL) {
+        if (st->st_size > GZIP_MAX_SOURCE || (size_t) st->st_size > c->capacity
+            || (e = calloc(1, sizeof(entry_t))) == NULL) {
+            c->skipped++;
+            pthread_mutex_unlock(&c->lock);
+            return GZCACHE_SKIP;
+        }
+        // Mark the miss in flight, so concurrent callers wait for it instead of compressing too
+        strcpy(e->path, path);
+        e->fd = -1;
+        e->next = c->buckets[fnv1a(path) % GZ_BUCKETS];
+        c->buckets[fnv1a(path) % GZ_BUCKETS] = e;
+        c->misses++;
+        pthread_mutex_unlock(&c->lock);
+        return GZCACHE_MISS;
+    }
+    lru_unlink(e);
+    lru_push(c, e);
+    int rc = GZCACHE_SKIP;
+    if (e->fd == -1) {
+        c->incompressible++;
+    } else if ((*fd = dup(e->fd)) != -1) {
+        *len = e->len;
+        c->hits++;
+        rc = GZCACHE_HIT;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+// function to compress a file after a miss and cache the result
+int gzcache_fill(gzcache_t *c, const char *path, int src, const struct stat *st, int *fd, off_t *len) {
+    int out = -1;
+    off_t out_len = 0;
+    int rc = src >= 0 ? compress_file(c->level, src, st, &out, &out_len) : -1;
+    pthread_mutex_lock(&c->lock);
+    entry_t *e = lookup(c, path); // the miss in flight, which only its caller finishes
+    pthread_cond_broadcast(&c->ready_cv);
+    if (rc == -1 || e->dropped) {
+        c->discarded++;
+        drop(c, e);
+        pthread_mutex_unlock(&c->lock);
+        if (out != -1) {
+            close(out);
+        }
+        return -1;
+    }
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->ctime = st->st_ctim;
+    e->fd = out;
+    e->len = rc == 0 ? out_len : 0;
+    e->ready = true;
+    lru_push(c, e);
+    c->bytes += cost(e);
+    c->entries++;
+    if (rc == 0) {
+        c->bytes_in += e->size;
+        c->bytes_out += e->len;
+    } else {
+        c->incompressible++;
+    }
+    // Evict from the least recently used end until back in budget
+    entry_t *victim = c->lru.newer;
+    while (c->bytes > c->capacity && victim != &c->lru) {
+        entry_t *newer = victim->newer;
+        if (victim != e) {
+            drop(c, victim);
+            c->evicted++;
+        }
+        victim = newer;
+    }
+    rc = rc == 0 && (*fd = dup(out)) != -1 ? 0 : -1;
+    *len = e->len;
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+// function to drop the variant of a path
+void gzcache_forget(gzcache_t *c, const char *path) {
+    if (strlen(path) >= LAYOUT_PATH_MAX) {
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    entry_t *e = lookup(c, path);
+    if (e != NULL && e->ready) {
+        drop(c, e);
+    } else if (e != NULL) {
+        e->dropped = true; // its caller throws the result away
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// function to report the cache counters
+void gzcache_dump_stats(gzcache_t *c, FILE *out) {
+    pthread_mutex_lock(&c->lock);
+    fprintf(out,
+        "STATS,gzcache,entries=%lu,bytes=%lu,hits=%lu,misses=%lu,joined=%lu,incompressible=%lu,skipped=%lu,"
+        "discarded=%lu,bytes_in=%lu,bytes_out=%lu,evicted=%lu\n",
+        (unsigned long) c->entries, (unsigned long) c->bytes, (unsigned long) c->hits, (unsigned long) c->misses,
+        (unsigned long) c->joined, (unsigned long) c->incompressible, (unsigned long) c->skipped,
+        (unsigned long) c->discarded, (unsigned long) c->bytes_in, (unsigned long) c->bytes_out,
+        (unsigned long) c->evicted);
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,116 @@
+/**
+ * @File gzcache.h
+ *
+ * Gzip variants of files, compressed on first request and kept in a
+ * bounded cache.  Each variant lives in a sealed memfd, so it is sent
+ * with sendfile like any file, and a caller keeps its own descriptor
+ * for as long as the send takes, even if the entry is evicted
+ * meanwhile.  An entry is checked against the file's inode, size, and
+ * modification and change times on every lookup, so a variant never
+ * outlives the bytes it was made from, and a PUT drops its path
+ * outright.  Concurrent misses on one file are single-flight: the
+ * first caller compresses while the others wait for its result.  The
+ * least recently used entries are evicted once the cache is over its
+ * byte budget.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define GZIP_MAX_SOURCE (1 << 20) // largest file compressed on the fly
+
+#define GZCACHE_HIT  0 // a variant was found
+#define GZCACHE_SKIP -1 // the file is to be sent as it is
+#define GZCACHE_MISS 1 // the caller is to compress the file with gzcache_fill
+
+typedef struct GzCache gzcache_t;
+
+/** @brief Checks whether an Accept-Encoding value allows gzip.
+ *
+ *  @param value the header value, e.g. "gzip, deflate;q=0.5"
+ *
+ *  @return whether gzip, or "*", is listed without q=0
+ */
+bool gzip_accepted(const char *value);
+
+/** @brief Creates a cache.
+ *
+ *  @param capacity the most bytes of variants to keep
+ *
+ *  @param level the zlib compression level, 1 to 9
+ *
+ *  @return the cache, or NULL on failure
+ */
+gzcache_t *gzcache_new(size_t capacity, int level);
+
+/** @brief Frees the cache.  No gzcache_fill may be in progress.
+ *
+ *  @param c the cache to delete
+ */
+void gzcache_delete(gzcache_t **c);
+
+/** @brief Finds the gzip variant of a file.  While another caller is
+ *         compressing the same file, waits for its result.
+ *
+ *  @param c the cache
+ *
+ *  @param path the file's path, the cache key
+ *
+ *  @param st the file's fstat
+ *
+ *  @param fd receives a descriptor of the variant on GZCACHE_HIT, which
+ *         the caller closes
+ *
+ *  @param len receives the variant's length on GZCACHE_HIT
+ *
+ *  @return GZCACHE_HIT; GZCACHE_SKIP if the file is too large or does
+ *          not shrink; or GZCACHE_MISS, after which the caller must
+ *          call gzcache_fill for the path, as concurrent callers wait
+ *          for it
+ */
+int gzcache_get(gzcache_t *c, const char *path, const struct stat *st, int *fd, off_t *len);
+
+/** @brief Compresses a file after GZCACHE_MISS and caches the result.
+ *         The caller need not hold a lock on the file: if it no longer
+ *         matches st once read, the result is thrown away.  Files that
+ *         do not shrink are remembered as such and not compressed
+ *         again until they change.
+ *
+ *  @param c the cache
+ *
+ *  @param path the file's path
+ *
+ *  @param src the file, open for reading
+ *
+ *  @param st the fstat that gzcache_get was given
+ *
+ *  @param fd receives a descriptor of the variant, which the caller
+ *         closes
+ *
+ *  @param len receives the variant's length
+ *
+ *  @return 0, or -1 if the file should be sent as it is: changed,
+ *          incompressible, unreadable, or out of memory
+ */
+int gzcache_fill(gzcache_t *c, const char *path, int src, const struct stat *st, int *fd, off_t *len);
+
+/** @brief Drops the variant of a path, e.g. because it is being
+ *         overwritten.  A compression in progress is not cached.
+ *
+ *  @param c the cache
+ *
+ *  @param path the file's path
+ */
+void gzcache_forget(gzcache_t *c, const char *path);
+
+/** @brief Writes a STATS line with the cache counters.
+ *
+ *  @param c the cache
+ *
+ *  @param out the stream to write to
+ */
+void gzcache_dump_stats(gzcache_t *c, FILE *out);
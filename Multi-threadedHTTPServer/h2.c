@@ -0,0 +1,1096 @@
+#define _GNU_SOURCE // eventfd
+
+#include "h2.h"
+
+#include "hpack.h"
+#include "peek.h"
+#include "util.h"
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define PREFACE          "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN      24 // bytes in the client connection preface
+#define FRAME_HEADER     9 // bytes in a frame header
+#define FRAME_MAX        16384 // largest frame payload either side sends
+#define DEFAULT_WINDOW   65535 // initial flow control window of the protocol
+#define STREAM_WINDOW    (1 << 20) // receive window of a PUT once its file is open
+#define CONN_WINDOW      (16 << 20) // connection receive window
+#define WINDOW_MAX       0x7fffffff // largest legal window
+#define CLAIM_MS         2 // jobs not started by the pool by then run on the connection's thread
+#define IN_SIZE          (4 * FRAME_MAX) // input buffer, several frames
+#define HEADER_BLOCK_MAX 65536 // largest header block accepted
+
+// Frame types
+enum {
+    FRAME_DATA = 0,
+    FRAME_HEADERS = 1,
+    FRAME_PRIORITY = 2,
+    FRAME_RST_STREAM = 3,
+    FRAME_SETTINGS = 4,
+    FRAME_PUSH_PROMISE = 5,
+    FRAME_PING = 6,
+    FRAME_GOAWAY = 7,
+    FRAME_WINDOW_UPDATE = 8,
+    FRAME_CONTINUATION = 9
+};
+
+// Frame flags
+enum { FLAG_END_STREAM = 0x1, FLAG_ACK = 0x1, FLAG_END_HEADERS = 0x4, FLAG_PADDED = 0x8, FLAG_PRIORITY = 0x20 };
+
+// Error codes
+enum {
+    ERR_NO_ERROR = 0,
+    ERR_PROTOCOL = 1,
+    ERR_INTERNAL = 2,
+    ERR_FLOW_CONTROL = 3,
+    ERR_STREAM_CLOSED = 5,
+    ERR_FRAME_SIZE = 6,
+    ERR_REFUSED_STREAM = 7,
+    ERR_CANCEL = 8,
+    ERR_COMPRESSION = 9
+};
+
+// Settings
+enum { SETTINGS_ENABLE_PUSH = 2, SETTINGS_MAX_CONCURRENT_STREAMS = 3, SETTINGS_INITIAL_WINDOW_SIZE = 4, SETTINGS_MAX_FRAME_SIZE = 5 };
+
+// Job states
+enum { JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_CANCELLED };
+
+typedef struct H2Conn h2_conn_t;
+typedef struct Stream stream_t;
+
+// A begin or finish call for a stream, run by the pool or the connection
+typedef struct Job {
+    atomic_int state; // JOB_*
+    atomic_int refs; // the connection's and the pool's
+    h2_conn_t *conn; // connection to report to
+    stream_t *stream; // stream whose request it serves
+    bool finishing; // call finish rather than begin
+    uint64_t queued_ms; // when it was submitted
+    struct Job *next; // next job in the pool's list or the connection's done list
+} job_t;
+
+struct Stream {
+    uint32_t id; // 0 when the slot is free
+    h2_request_t req; // the request
+    job_t *job; // job in progress, if any
+    bool begun; // begin has returned
+    bool finished; // finish has returned
+    bool remote_closed; // the peer ended its side
+    bool reset; // abandoned by either side
+    char *pending; // PUT body received before the file was open
+    size_t pending_len; // bytes in pending
+    int64_t received; // PUT body bytes received
+    uint32_t unacked; // body bytes consumed and not yet returned to the peer's window
+    bool headers_sent; // response HEADERS are out
+    const char *message; // body of a response without a file
+    off_t send_offset; // next body byte to send
+    off_t send_end; // end of the body
+    int64_t send_window; // peer's window for this stream
+    uint64_t progress_ms; // when the peer or the server last moved the stream along
+};
+
+struct H2Conn {
+    int fd; // client socket
+    hpack_t hpack; // peer's header compression state
+    uint8_t *in; // bytes read and not yet processed
+    size_t in_len; // bytes in in
+    bool preface_pending; // the client preface has not been read yet
+    uint8_t *out; // frame being sent
+    uint8_t *block; // header block being assembled
+    size_t block_len; // bytes in block
+    uint32_t block_stream; // stream the block belongs to, 0 if none
+    bool block_end_stream; // its HEADERS frame ended the stream
+    stream_t streams[H2_MAX_STREAMS]; // stream slots
+    int active; // slots in use
+    uint32_t last_stream; // highest stream opened by the peer
+    int64_t send_window; // peer's connection window
+    int64_t peer_initial_window; // peer's initial stream window
+    uint32_t unacked; // connection bytes not yet returned to the peer's window
+    bool goaway; // no new streams are accepted
+    bool stop_seen; // the shutdown signal was handled
+    int rr; // round-robin cursor
+    uint64_t idle_since_ms; // when the last stream closed
+    pthread_mutex_t done_lock; // guards done and the event_fd write
+    job_t *done; // jobs finished since last collected
+    int event_fd; // signaled when a job finishes
+    int outstanding; // jobs submitted and not yet collected
+};
+
+// The stream thread pool
+static struct {
+    pthread_mutex_t lock; // guards the list and stopping
+    pthread_cond_t cv; // signaled when a job arrives or on stop
+    job_t *head; // oldest queued job
+    job_t *tail; // newest queued job
+    bool stopping; // h2_stop was called
+    pthread_t *threads; // the stream threads
+    int count; // number of stream threads
+    const h2_ops_t *ops; // request handlers
+    int stop_fd; // readable once h2_shutdown is called
+} jobs = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, false, NULL, 0, NULL, -1 };
+
+// function to read a big-endian 32-bit value
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+// function to write a big-endian 32-bit value
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// function to send a frame whose payload is in c->out after the header room
+static int send_frame(h2_conn_t *c, int type, int flags, uint32_t stream, const void *payload, size_t len) {
+    uint8_t header[FRAME_HEADER] = { len >> 16, len >> 8, len, type, flags };
+    put32(header + 5, stream & WINDOW_MAX);
+    struct iovec iov[2] = { { header, FRAME_HEADER }, { (void *) payload, len } };
+    return writev_all(c->fd, iov, len > 0 ? 2 : 1);
+}
+
+// function to send a 4-byte payload frame: RST_STREAM or WINDOW_UPDATE
+static int send_u32(h2_conn_t *c, int type, uint32_t stream, uint32_t value) {
+    uint8_t payload[4];
+    put32(payload, value);
+    return send_frame(c, type, 0, stream, payload, 4);
+}
+
+// function to end the connection with an error; always returns -1
+static int send_goaway(h2_conn_t *c, uint32_t error) {
+    uint8_t payload[8];
+    put32(payload, c->last_stream);
+    put32(payload + 4, error);
+    send_frame(c, FRAME_GOAWAY, 0, 0, payload, 8);
+    c->goaway = true;
+    return -1;
+}
+
+// function to drop a reference to a job
+static void job_put(job_t *job) {
+    if (atomic_fetch_sub(&job->refs, 1) == 1) {
+        free(job);
+    }
+}
+
+// function to run a job unless someone else has or it was cancelled
+static void job_execute(job_t *job) {
+    int expected = JOB_QUEUED;
+    if (!atomic_compare_exchange_strong(&job->state, &expected, JOB_RUNNING)) {
+        return;
+    }
+    if (job->finishing) {
+        jobs.ops->finish(&job->stream->req);
+    } else {
+        jobs.ops->begin(&job->stream->req);
+    }
+    // The connection may be torn down as soon as it sees the job, so
+    // nothing of it is touched after the lock is dropped
+    h2_conn_t *c = job->conn;
+    pthread_mutex_lock(&c->done_lock);
+    atomic_store(&job->state, JOB_DONE);
+    job->next = c->done;
+    c->done = job;
+    uint64_t one = 1;
+    if (write(c->event_fd, &one, sizeof(one)) == -1) {
+        // the counter cannot overflow with one write per job
+    }
+    pthread_mutex_unlock(&c->done_lock);
+}
+
+// function run by each stream thread
+static void *job_thread(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&jobs.lock);
+    while (true) {
+        while (jobs.head == NULL && !jobs.stopping) {
+            pthread_cond_wait(&jobs.cv, &jobs.lock);
+        }
+        if (jobs.head == NULL) {
+            break;
+        }
+        job_t *job = jobs.head;
+        jobs.head = job->next;
+        if (jobs.head == NULL) {
+            jobs.tail = NULL;
+        }
+        pthread_mutex_unlock(&jobs.lock);
+        job_execute(job);
+        job_put(job);
+        pthread_mutex_lock(&jobs.lock);
+    }
+    pthread_mutex_unlock(&jobs.lock);
+    return NULL;
+}
+
+// function to hand a stream's begin or finish to the pool
+static int job_submit(h2_conn_t *c, stream_t *s, bool finishing) {
+    job_t *job = malloc(sizeof(job_t));
+    if (job == NULL) {
+        return -1;
+    }
+    atomic_init(&job->state, JOB_QUEUED);
+    atomic_init(&job->refs, 2);
+    job->conn = c;
+    job->stream = s;
+    job->finishing = finishing;
+    job->queued_ms = monotonic_ms();
+    job->next = NULL;
+    s->job = job;
+    c->outstanding++;
+    pthread_mutex_lock(&jobs.lock);
+    if (jobs.tail == NULL) {
+        jobs.head = job;
+    } else {
+        jobs.tail->next = job;
+    }
+    jobs.tail = job;
+    pthread_cond_signal(&jobs.cv);
+    pthread_mutex_unlock(&jobs.lock);
+    return 0;
+}
+
+// function to find an open stream
+static stream_t *stream_find(h2_conn_t *c, uint32_t id) {
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (c->streams[i].id == id) {
+            return &c->streams[i];
+        }
+    }
+    return NULL;
+}
+
+// function to free a stream's slot once nothing refers to it
+static void stream_release(h2_conn_t *c, stream_t *s) {
+    if (s->job != NULL || !s->finished) {
+        return;
+    }
+    if (!s->reset && s->headers_sent && s->send_offset < s->send_end) {
+        return; // response still going out
+    }
+    free(s->pending);
+    memset(s, 0, sizeof(stream_t));
+    if (--c->active == 0) {
+        c->idle_since_ms = monotonic_ms();
+    }
+}
+
+// function to send the response HEADERS and set up its body
+static int stream_respond(h2_conn_t *c, stream_t *s) {
+    h2_request_t *req = &s->req;
+    bool file = !req->put && req->code == 200;
+    s->message = file ? NULL : status_message(req->code);
+    s->send_offset = file ? req->offset : 0;
+    s->send_end = file ? req->offset + req->size : (off_t) strlen(s->message);
+    char length[24];
+    snprintf(length, sizeof(length), "%ld", (long) (s->send_end - s->send_offset));
+    size_t n = hpack_encode_status(c->out, req->code);
+    n += hpack_encode_literal(c->out + n, HPACK_CONTENT_LENGTH, length);
+    s->headers_sent = true;
+    int flags = FLAG_END_HEADERS | (s->send_offset == s->send_end ? FLAG_END_STREAM : 0);
+    return send_frame(c, FRAME_HEADERS, flags, s->id, c->out, n);
+}
+
+// function to finish a stream on the connection's thread, which is only done when it cannot block
+static void stream_finish_inline(h2_conn_t *c, stream_t *s) {
+    if (!s->finished) {
+        jobs.ops->finish(&s->req);
+        s->finished = true;
+    }
+    stream_release(c, s);
+}
+
+// function to abandon a stream
+static void stream_reset(h2_conn_t *c, stream_t *s) {
+    s->reset = true;
+    if (s->job != NULL) {
+        int expected = JOB_QUEUED;
+        if (!atomic_compare_exchange_strong(&s->job->state, &expected, JOB_CANCELLED)) {
+            return; // running; handled when it is collected
+        }
+        job_put(s->job);
+        s->job = NULL;
+        c->outstanding--;
+    }
+    if (s->req.put && s->req.code == 0) {
+        s->req.code = 400; // the body will never be complete
+    }
+    stream_finish_inline(c, s);
+}
+
+// function to commit or fail a PUT once its whole body is in
+static int stream_put_complete(h2_conn_t *c, stream_t *s) {
+    if (!s->req.put || !s->begun || !s->remote_closed || s->finished || s->job != NULL || s->reset) {
+        return 0;
+    }
+    if (s->req.code == 0 && s->req.content_length >= 0 && s->received != s->req.content_length) {
+        s->req.code = 400;
+    }
+    if (s->req.code != 0) {
+        stream_finish_inline(c, s); // nothing to commit, so it is cheap
+        return s->headers_sent ? 0 : stream_respond(c, s);
+    }
+    return job_submit(c, s, true);
+}
+
+// function to write PUT body bytes at an offset of the open file, never past the declared length
+static void body_write(h2_request_t *req, const char *data, size_t len, off_t at) {
+    if (req->content_length >= 0 && at + (off_t) len > req->offset + req->content_length) {
+        req->code = 400; // in the store this would run into the next record
+        return;
+    }
+    while (len > 0 && req->code == 0) {
+        ssize_t wb = pwrite(req->fd, data, len, at);
+        if (wb < 0 && errno != EINTR) {
+            req->code = 500;
+        } else if (wb > 0) {
+            data += wb;
+            len -= wb;
+            at += wb;
+        }
+    }
+}
+
+// function to act on a job that has finished
+static int job_collected(h2_conn_t *c, job_t *job) {
+    stream_t *s = job->stream;
+    s->job = NULL;
+    s->progress_ms = monotonic_ms(); // the peer is only timed from here
+    c->outstanding--;
+    bool finishing = job->finishing;
+    job_put(job);
+
+    if (finishing) {
+        s->finished = true;
+        if (s->reset) {
+            stream_release(c, s);
+            return 0;
+        }
+        return stream_respond(c, s);
+    }
+
+    s->begun = true;
+    if (s->reset) {
+        if (s->req.put && s->req.code == 0) {
+            s->req.code = 400;
+        }
+        stream_finish_inline(c, s);
+        return 0;
+    }
+    if (!s->req.put) {
+        int rc = stream_respond(c, s);
+        if (s->send_offset == s->send_end) {
+            stream_finish_inline(c, s); // empty body, all sent with the headers
+        }
+        return rc;
+    }
+    if (s->req.code != 0) {
+        // Failed to open: answer now and drop the rest of the body
+        int rc = stream_respond(c, s);
+        if (!s->remote_closed && rc == 0) {
+            rc = send_u32(c, FRAME_RST_STREAM, s->id, ERR_NO_ERROR);
+            s->reset = true;
+        }
+        stream_finish_inline(c, s);
+        return rc;
+    }
+    // The file is open: write what arrived early and widen the window
+    size_t early = s->pending_len;
+    if (early > 0) {
+        body_write(&s->req, s->pending, early, s->req.offset);
+        free(s->pending);
+        s->pending = NULL;
+        s->pending_len = 0;
+    }
+    if (!s->remote_closed && send_u32(c, FRAME_WINDOW_UPDATE, s->id, STREAM_WINDOW - DEFAULT_WINDOW + early) == -1) {
+        return -1;
+    }
+    return stream_put_complete(c, s);
+}
+
+// function to collect every finished job
+static int jobs_collect(h2_conn_t *c) {
+    uint64_t count;
+    if (read(c->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        return -1;
+    }
+    pthread_mutex_lock(&c->done_lock);
+    job_t *done = c->done;
+    c->done = NULL;
+    pthread_mutex_unlock(&c->done_lock);
+    int rc = 0;
+    while (done != NULL) {
+        job_t *next = done->next;
+        if (job_collected(c, done) == -1) {
+            rc = -1;
+        }
+        done = next;
+    }
+    return rc;
+}
+
+// function to run jobs the pool has not started within CLAIM_MS; returns whether any are still waiting
+static bool jobs_claim(h2_conn_t *c) {
+    bool waiting = false;
+    uint64_t now = monotonic_ms();
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        job_t *job = c->streams[i].job;
+        if (job != NULL && atomic_load(&job->state) == JOB_QUEUED) {
+            if (now - job->queued_ms >= CLAIM_MS) {
+                job_execute(job);
+            } else {
+                waiting = true;
+            }
+        }
+    }
+    return waiting;
+}
+
+// hpack callback filling in a stream's request
+static void header_field(void *arg, const char *name, size_t name_len, const char *value, size_t value_len) {
+    h2_request_t *req = arg;
+    if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+        size_t n = value_len < sizeof(req->method) - 1 ? value_len : sizeof(req->method) - 1;
+        memcpy(req->method, value, n);
+        req->method[n] = '\0';
+        req->put = value_len == 3 && memcmp(value, "PUT", 3) == 0;
+    } else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+        // The value is a slice of the header block, not NUL-terminated, so look at exactly its bytes
+        size_t len = value_len - 1;
+        bool valid = value_len >= 2 && value[0] == '/' && len <= 63;
+        for (size_t i = 1; valid && i < value_len; i++) {
+            valid = isalnum((unsigned char) value[i]) || value[i] == '.' || value[i] == '-';
+        }
+        if (valid) {
+            memcpy(req->uri, value + 1, len);
+            req->uri[len] = '\0';
+        }
+    } else if (name_len == 14 && memcmp(name, "content-length", 14) == 0 && value_len < 20) {
+        char digits[20];
+        memcpy(digits, value, value_len);
+        digits[value_len] = '\0';
+        char *end = NULL;
+        long long length = strtoll(digits, &end, 10);
+        req->content_length = *end == '\0' && value_len > 0 && length >= 0 ? length : -1;
+    } else if (name_len == 10 && memcmp(name, "request-id", 10) == 0 && value_len < sizeof(req->request_id)) {
+        memcpy(req->request_id, value, value_len);
+        req->request_id[value_len] = '\0';
+    }
+}
+
+// function to open a stream from a request and start its begin
+static int stream_open(h2_conn_t *c, stream_t *s, uint32_t id, bool end_stream) {
+    s->id = id;
+    s->remote_closed = end_stream;
+    s->send_window = c->peer_initial_window;
+    s->progress_ms = monotonic_ms();
+    c->active++;
+    h2_request_t *req = &s->req;
+    bool get = strcmp(req->method, "GET") == 0;
+    if (!get && !req->put) {
+        req->code = 501;
+    } else if (req->uri[0] == '\0') {
+        req->code = 400;
+    }
+    if (req->code != 0) {
+        // Rejected without opening anything
+        s->begun = true;
+        int rc = stream_respond(c, s);
+        if (!s->remote_closed && rc == 0) {
+            rc = send_u32(c, FRAME_RST_STREAM, s->id, ERR_NO_ERROR);
+            s->reset = true;
+        }
+        stream_finish_inline(c, s);
+        return rc;
+    }
+    if (job_submit(c, s, false) == -1) {
+        req->code = 500;
+        s->begun = true;
+        stream_respond(c, s);
+        stream_finish_inline(c, s);
+    }
+    return 0;
+}
+
+// function to handle a complete header block
+static int headers_complete(h2_conn_t *c) {
+    uint32_t id = c->block_stream;
+    c->block_stream = 0;
+    stream_t *s = stream_find(c, id);
+    stream_t *slot = s == NULL ? stream_find(c, 0) : NULL;
+    h2_request_t scratch;
+    h2_request_t *req = slot != NULL ? &slot->req : &scratch;
+    memset(req, 0, sizeof(h2_request_t));
+    strcpy(req->request_id, "0");
+    req->content_length = -1;
+    req->fd = -1;
+    // Decode even blocks that will be refused, to keep the tables in step
+    if (hpack_decode(&c->hpack, c->block, c->block_len, header_field, req) == -1) {
+        return send_goaway(c, ERR_COMPRESSION);
+    }
+    if (s != NULL) {
+        // Trailers; only an end of stream matters
+        if (c->block_end_stream && !s->remote_closed) {
+            s->remote_closed = true;
+            return stream_put_complete(c, s);
+        }
+        return 0;
+    }
+    if (id <= c->last_stream || (id & 1) == 0) {
+        return send_goaway(c, ERR_PROTOCOL);
+    }
+    c->last_stream = id;
+    if (c->goaway || slot == NULL) {
+        if (slot != NULL) {
+            memset(slot, 0, sizeof(stream_t));
+        }
+        return send_u32(c, FRAME_RST_STREAM, id, ERR_REFUSED_STREAM);
+    }
+    return stream_open(c, slot, id, c->block_end_stream);
+}
+
+// function to apply a SETTINGS payload from the peer
+static int settings_apply(h2_conn_t *c, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t id = p[i] << 8 | p[i + 1];
+        uint32_t value = get32(p + i + 2);
+        if (id == SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (value > WINDOW_MAX) {
+                return send_goaway(c, ERR_FLOW_CONTROL);
+            }
+            int64_t delta = (int64_t) value - c->peer_initial_window;
+            c->peer_initial_window = value;
+            for (int k = 0; k < H2_MAX_STREAMS; k++) {
+                if (c->streams[k].id != 0) {
+                    c->streams[k].send_window += delta;
+                }
+            }
+        } else if (id == SETTINGS_MAX_FRAME_SIZE && (value < FRAME_MAX || value > 0xffffff)) {
+            return send_goaway(c, ERR_PROTOCOL);
+        } else if (id == SETTINGS_ENABLE_PUSH && value > 1) {
+            return send_goaway(c, ERR_PROTOCOL);
+        }
+        // Our frames never exceed the default size, and we never push
+    }
+    return 0;
+}
+
+// function to handle a DATA frame
+static int on_data(h2_conn_t *c, int flags, uint32_t id, const uint8_t *p, size_t len) {
+    // Flow control counts the whole payload, padding included
+    c->unacked += len;
+    if (c->unacked >= CONN_WINDOW / 2) {
+        if (send_u32(c, FRAME_WINDOW_UPDATE, 0, c->unacked) == -1) {
+            return -1;
+        }
+        c->unacked = 0;
+    }
+    if (flags & FLAG_PADDED) {
+        if (len == 0 || p[0] >= len) {
+            return send_goaway(c, ERR_PROTOCOL);
+        }
+        len -= 1 + p[0];
+        p++;
+    }
+    stream_t *s = id == 0 ? NULL : stream_find(c, id);
+    if (s == NULL) {
+        return id == 0 || id > c->last_stream ? send_goaway(c, ERR_PROTOCOL) : 0;
+    }
+    if (s->reset) {
+        return 0;
+    }
+    if (!s->req.put || s->remote_closed) {
+        stream_reset(c, s);
+        return send_u32(c, FRAME_RST_STREAM, id, ERR_STREAM_CLOSED);
+    }
+    if (s->req.content_length >= 0 && s->received + (int64_t) len > s->req.content_length) {
+        // More body than declared: answer 400 if the file is open, and drop the rest
+        s->req.code = s->req.code == 0 ? 400 : s->req.code;
+        int rc = 0;
+        if (s->begun && !s->finished && !s->headers_sent) {
+            rc = stream_respond(c, s);
+        }
+        stream_reset(c, s);
+        return rc == 0 ? send_u32(c, FRAME_RST_STREAM, id, ERR_PROTOCOL) : rc;
+    }
+    s->received += len;
+    s->progress_ms = monotonic_ms();
+    if (!s->begun) {
+        // The file is not open yet; the initial window bounds what can arrive
+        if (s->pending_len + len > DEFAULT_WINDOW) {
+            stream_reset(c, s);
+            return send_u32(c, FRAME_RST_STREAM, id, ERR_FLOW_CONTROL);
+        }
+        char *grown = realloc(s->pending, s->pending_len + len);
+        if (grown == NULL) {
+            stream_reset(c, s);
+            return send_u32(c, FRAME_RST_STREAM, id, ERR_INTERNAL);
+        }
+        s->pending = grown;
+        memcpy(s->pending + s->pending_len, p, len);
+        s->pending_len += len;
+    } else {
+        body_write(&s->req, (const char *) p, len, s->req.offset + s->received - len);
+        s->unacked += len;
+        if (s->unacked >= STREAM_WINDOW / 2 && !(flags & FLAG_END_STREAM)) {
+            if (send_u32(c, FRAME_WINDOW_UPDATE, id, s->unacked) == -1) {
+                return -1;
+            }
+            s->unacked = 0;
+        }
+    }
+    if (flags & FLAG_END_STREAM) {
+        s->remote_closed = true;
+        return stream_put_complete(c, s);
+    }
+    return 0;
+}
+
+// function to handle one frame; returns -1 when the connection must close
+static int on_frame(h2_conn_t *c, int type, int flags, uint32_t id, const uint8_t *p, size_t len) {
+    if (c->block_stream != 0 && (type != FRAME_CONTINUATION || id != c->block_stream)) {
+        return send_goaway(c, ERR_PROTOCOL); // header blocks must not be interleaved
+    }
+    switch (type) {
+    case FRAME_DATA: return on_data(c, flags, id, p, len);
+    case FRAME_HEADERS:
+        if (id == 0) {
+            return send_goaway(c, ERR_PROTOCOL);
+        }
+        if (flags & FLAG_PADDED) {
+            if (len == 0 || p[0] >= len) {
+                return send_goaway(c, ERR_PROTOCOL);
+            }
+            len -= 1 + p[0];
+            p++;
+        }
+        if (flags & FLAG_PRIORITY) {
+            if (len < 5) {
+                return send_goaway(c, ERR_FRAME_SIZE);
+            }
+            p += 5;
+            len -= 5;
+        }
+        c->block_len = 0;
+        c->block_stream = id;
+        c->block_end_stream = flags & FLAG_END_STREAM;
+        // fall through to collect the fragment
+        __attribute__((fallthrough));
+    case FRAME_CONTINUATION:
+        if (c->block_stream == 0 || c->block_len + len > HEADER_BLOCK_MAX) {
+            return send_goaway(c, c->block_stream == 0 ? ERR_PROTOCOL : ERR_INTERNAL);
+        }
+        memcpy(c->block + c->block_len, p, len);
+        c->block_len += len;
+        return flags & FLAG_END_HEADERS ? headers_complete(c) : 0;
+    case FRAME_PRIORITY: return len == 5 ? 0 : send_goaway(c, ERR_FRAME_SIZE);
+    case FRAME_RST_STREAM: {
+        if (len != 4 || id == 0) {
+            return send_goaway(c, len != 4 ? ERR_FRAME_SIZE : ERR_PROTOCOL);
+        }
+        stream_t *s = stream_find(c, id);
+        if (s != NULL && !s->reset) {
+            stream_reset(c, s);
+        }
+        return 0;
+    }
+    case FRAME_SETTINGS:
+        if (id != 0 || (flags & FLAG_ACK ? len != 0 : len % 6 != 0)) {
+            return send_goaway(c, id != 0 ? ERR_PROTOCOL : ERR_FRAME_SIZE);
+        }
+        if (flags & FLAG_ACK) {
+            return 0;
+        }
+        if (settings_apply(c, p, len) == -1) {
+            return -1;
+        }
+        return send_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+    case FRAME_PING:
+        if (id != 0 || len != 8) {
+            return send_goaway(c, id != 0 ? ERR_PROTOCOL : ERR_FRAME_SIZE);
+        }
+        return flags & FLAG_ACK ? 0 : send_frame(c, FRAME_PING, FLAG_ACK, 0, p, 8);
+    case FRAME_GOAWAY: c->goaway = true; return 0;
+    case FRAME_WINDOW_UPDATE: {
+        if (len != 4) {
+            return send_goaway(c, ERR_FRAME_SIZE);
+        }
+        uint32_t increment = get32(p) & WINDOW_MAX;
+        if (id == 0) {
+            if (increment == 0 || c->send_window + increment > WINDOW_MAX) {
+                return send_goaway(c, increment == 0 ? ERR_PROTOCOL : ERR_FLOW_CONTROL);
+            }
+            c->send_window += increment;
+            return 0;
+        }
+        stream_t *s = stream_find(c, id);
+        if (s != NULL && !s->reset) {
+            if (increment == 0 || s->send_window + increment > WINDOW_MAX) {
+                stream_reset(c, s);
+                return send_u32(c, FRAME_RST_STREAM, id, increment == 0 ? ERR_PROTOCOL : ERR_FLOW_CONTROL);
+            }
+            s->send_window += increment;
+            s->progress_ms = monotonic_ms();
+        }
+        return 0;
+    }
+    case FRAME_PUSH_PROMISE: return send_goaway(c, ERR_PROTOCOL);
+    default: return 0; // unknown frame types are ignored
+    }
+}
+
+// function to process every complete frame read so far
+static int frames_process(h2_conn_t *c) {
+    size_t at = 0;
+    if (c->preface_pending) {
+        if (c->in_len < PREFACE_LEN) {
+            return 0;
+        }
+        if (memcmp(c->in, PREFACE, PREFACE_LEN) != 0) {
+            return send_goaway(c, ERR_PROTOCOL);
+        }
+        c->preface_pending = false;
+        at = PREFACE_LEN;
+    }
+    int rc = 0;
+    while (rc == 0 && c->in_len - at >= FRAME_HEADER) {
+        const uint8_t *h = c->in + at;
+        size_t len = (size_t) h[0] << 16 | h[1] << 8 | h[2];
+        if (len > FRAME_MAX) {
+            return send_goaway(c, ERR_FRAME_SIZE);
+        }
+        if (c->in_len - at < FRAME_HEADER + len) {
+            break;
+        }
+        rc = on_frame(c, h[3], h[4], get32(h + 5) & WINDOW_MAX, h + FRAME_HEADER, len);
+        at += FRAME_HEADER + len;
+    }
+    memmove(c->in, c->in + at, c->in_len - at);
+    c->in_len -= at;
+    return rc;
+}
+
+// function to send one DATA frame for each stream that can; returns whether any went out
+static int data_round(h2_conn_t *c, bool *sent) {
+    *sent = false;
+    for (int k = 0; k < H2_MAX_STREAMS && c->send_window > 0; k++) {
+        stream_t *s = &c->streams[(c->rr + k) % H2_MAX_STREAMS];
+        if (s->id == 0 || s->reset || !s->headers_sent || s->send_offset >= s->send_end || s->send_window <= 0) {
+            continue;
+        }
+        int64_t n = s->send_end - s->send_offset;
+        n = n < FRAME_MAX ? n : FRAME_MAX;
+        n = n < s->send_window ? n : s->send_window;
+        n = n < c->send_window ? n : c->send_window;
+        ssize_t got = n;
+        if (s->message != NULL) {
+            memcpy(c->out, s->message + s->send_offset, n);
+        } else {
+            got = pread(s->req.fd, c->out, n, s->send_offset);
+        }
+        if (got <= 0) {
+            // The file shrank or failed under us; the response cannot be completed
+            stream_reset(c, s);
+            if (send_u32(c, FRAME_RST_STREAM, s->id, ERR_INTERNAL) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        s->send_offset += got;
+        s->progress_ms = monotonic_ms();
+        s->send_window -= got;
+        c->send_window -= got;
+        bool last = s->send_offset == s->send_end;
+        if (send_frame(c, FRAME_DATA, last ? FLAG_END_STREAM : 0, s->id, c->out, got) == -1) {
+            return -1;
+        }
+        *sent = true;
+        if (last) {
+            if (!s->remote_closed) {
+                // Answered early; the peer need not send the rest
+                s->reset = true;
+                send_u32(c, FRAME_RST_STREAM, s->id, ERR_NO_ERROR);
+            }
+            stream_finish_inline(c, s);
+        }
+    }
+    c->rr = (c->rr + 1) % H2_MAX_STREAMS;
+    return 0;
+}
+
+// function to check whether a stream can only move once the peer acts: send body, or open a window
+static bool stream_waits_on_peer(h2_conn_t *c, stream_t *s) {
+    if (s->id == 0 || s->reset || s->job != NULL) {
+        return false; // free, abandoned, or waiting on the server
+    }
+    if (s->req.put && s->begun && !s->remote_closed) {
+        return true;
+    }
+    return s->headers_sent && s->send_offset < s->send_end && (s->send_window <= 0 || c->send_window <= 0);
+}
+
+// function to reset streams that waited on the peer for H2_IDLE_MS; sets the ms until the next may, -1 if none
+static int streams_expire(h2_conn_t *c, int *next_ms) {
+    *next_ms = -1;
+    uint64_t now = monotonic_ms();
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        stream_t *s = &c->streams[i];
+        if (!stream_waits_on_peer(c, s)) {
+            continue;
+        }
+        uint64_t idle = now - s->progress_ms;
+        if (idle >= H2_IDLE_MS) {
+            uint32_t id = s->id;
+            stream_reset(c, s);
+            if (send_u32(c, FRAME_RST_STREAM, id, ERR_CANCEL) == -1) {
+                return -1;
+            }
+        } else if (*next_ms == -1 || H2_IDLE_MS - (int) idle < *next_ms) {
+            *next_ms = H2_IDLE_MS - (int) idle;
+        }
+    }
+    return 0;
+}
+
+// function to decode a base64url string, as in HTTP2-Settings
+static ssize_t base64url_decode(const char *in, uint8_t *out, size_t cap) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (; *in != '\0' && *in != '='; in++) {
+        const char *pos = strchr(alphabet, *in);
+        if (pos == NULL) {
+            return -1;
+        }
+        acc = acc << 6 | (pos - alphabet);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == cap) {
+                return -1;
+            }
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+// function to take over an upgraded request as stream 1
+static int upgrade_accept(h2_conn_t *c, const char *head, size_t head_len) {
+    char settings[256];
+    uint8_t payload[192];
+    ssize_t len = -1;
+    if (head_header(head, "HTTP2-Settings", settings, sizeof(settings))) {
+        len = base64url_decode(settings, payload, sizeof(payload));
+    }
+    stream_t *s = &c->streams[0];
+    h2_request_t *req = &s->req;
+    memset(req, 0, sizeof(h2_request_t));
+    strcpy(req->method, "GET");
+    strcpy(req->request_id, "0");
+    req->content_length = -1;
+    req->fd = -1;
+    bool valid = head_uri(head, req->uri, sizeof(req->uri));
+    head_header(head, "Request-Id", req->request_id, sizeof(req->request_id));
+
+    // Consume the request and switch protocols
+    if (recv(c->fd, c->in, head_len, MSG_WAITALL) != (ssize_t) head_len) {
+        return -1;
+    }
+    const char *switching = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    if (write(c->fd, switching, strlen(switching)) != (ssize_t) strlen(switching)) {
+        return -1;
+    }
+    if (len < 0 || len % 6 != 0 || settings_apply(c, payload, len) == -1) {
+        return -1;
+    }
+    if (!valid) {
+        req->uri[0] = '\0';
+    }
+    c->last_stream = 1;
+    return 0;
+}
+
+// function to start the stream thread pool
+int h2_start(int threads, const h2_ops_t *ops) {
+    jobs.ops = ops;
+    jobs.stop_fd = eventfd(0, EFD_CLOEXEC);
+    jobs.threads = calloc(threads, sizeof(pthread_t));
+    if (jobs.stop_fd == -1 || jobs.threads == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&jobs.threads[i], NULL, job_thread, NULL) != 0) {
+            return -1;
+        }
+        jobs.count++;
+    }
+    return 0;
+}
+
+// function to ask every connection to wind down
+void h2_shutdown(void) {
+    uint64_t one = 1;
+    if (jobs.stop_fd != -1 && write(jobs.stop_fd, &one, sizeof(one)) == -1) {
+        warn("h2 shutdown");
+    }
+}
+
+// function to stop the stream thread pool
+void h2_stop(void) {
+    pthread_mutex_lock(&jobs.lock);
+    jobs.stopping = true;
+    pthread_cond_broadcast(&jobs.cv);
+    pthread_mutex_unlock(&jobs.lock);
+    for (int i = 0; i < jobs.count; i++) {
+        pthread_join(jobs.threads[i], NULL);
+    }
+    free(jobs.threads);
+    jobs.threads = NULL;
+    jobs.count = 0;
+    if (jobs.stop_fd != -1) {
+        close(jobs.stop_fd);
+        jobs.stop_fd = -1;
+    }
+}
+
+// function to check whether a head asks to upgrade to h2c
+bool h2_is_upgrade(const char *head) {
+    char value[256];
+    return head_is_method(head, "GET") && head_header(head, "Upgrade", value, sizeof(value))
+           && strstr(value, "h2c") != NULL && head_header(head, "HTTP2-Settings", value, sizeof(value))
+           && head_content_length(head) <= 0;
+}
+
+// function to serve an HTTP/2 connection
+void h2_serve(int fd, const char *head, size_t head_len) {
+    h2_conn_t *c = calloc(1, sizeof(h2_conn_t));
+    if (c == NULL) {
+        return;
+    }
+    c->fd = fd;
+    c->in = malloc(IN_SIZE);
+    c->out = malloc(FRAME_MAX);
+    c->block = malloc(HEADER_BLOCK_MAX);
+    c->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    c->send_window = DEFAULT_WINDOW;
+    c->peer_initial_window = DEFAULT_WINDOW;
+    c->preface_pending = true;
+    c->idle_since_ms = monotonic_ms();
+    pthread_mutex_init(&c->done_lock, NULL);
+    bool ready = c->in != NULL && c->out != NULL && c->block != NULL && c->event_fd != -1
+                 && hpack_init(&c->hpack) == 0;
+    bool upgraded = ready && !head_is_method(head, "PRI");
+    if (upgraded && upgrade_accept(c, head, head_len) == -1) {
+        ready = false;
+    }
+
+    // Our preface: SETTINGS, then a wider connection receive window
+    uint8_t settings[6] = { 0, SETTINGS_MAX_CONCURRENT_STREAMS };
+    put32(settings + 2, H2_MAX_STREAMS);
+    if (ready
+        && (send_frame(c, FRAME_SETTINGS, 0, 0, settings, sizeof(settings)) == -1
+            || send_u32(c, FRAME_WINDOW_UPDATE, 0, CONN_WINDOW - DEFAULT_WINDOW) == -1)) {
+        ready = false;
+    }
+    if (ready && upgraded) {
+        stream_open(c, &c->streams[0], 1, true);
+    }
+
+    bool open = ready;
+    while (open) {
+        bool sent = false;
+        if (data_round(c, &sent) == -1) {
+            break;
+        }
+        if (c->active == 0 && (c->goaway || monotonic_ms() - c->idle_since_ms >= H2_IDLE_MS)) {
+            if (!c->goaway) {
+                send_goaway(c, ERR_NO_ERROR);
+            }
+            break;
+        }
+        int stall_ms;
+        if (streams_expire(c, &stall_ms) == -1) {
+            break;
+        }
+        bool waiting = jobs_claim(c);
+        int timeout = -1;
+        if (sent) {
+            timeout = 0;
+        } else if (waiting) {
+            timeout = CLAIM_MS;
+        } else if (c->active == 0) {
+            timeout = H2_IDLE_MS - (int) (monotonic_ms() - c->idle_since_ms);
+        }
+        if (stall_ms >= 0 && (timeout < 0 || stall_ms < timeout)) {
+            timeout = stall_ms; // a stream waiting on the peer runs out of time
+        }
+        struct pollfd fds[3] = { { fd, POLLIN, 0 }, { c->event_fd, POLLIN, 0 }, { jobs.stop_fd, POLLIN, 0 } };
+        int rc = poll(fds, c->stop_seen ? 2 : 3, timeout);
+        if (rc == -1 && errno != EINTR) {
+            break;
+        }
+        if (rc <= 0) {
+            continue;
+        }
+        if (!c->stop_seen && (fds[2].revents & POLLIN)) {
+            // Shutting down: refuse new streams, let the open ones finish
+            c->stop_seen = true;
+            send_goaway(c, ERR_NO_ERROR);
+        }
+        if ((fds[1].revents & POLLIN) && jobs_collect(c) == -1) {
+            break;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t rb = read(fd, c->in + c->in_len, IN_SIZE - c->in_len);
+            if (rb <= 0) {
+                if (rb == -1 && errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            c->in_len += rb;
+            if (frames_process(c) == -1) {
+                break;
+            }
+        }
+    }
+
+    // Abandon whatever is still open and wait for jobs the pool is running
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (c->streams[i].id != 0 && !c->streams[i].reset) {
+            stream_reset(c, &c->streams[i]);
+        }
+    }
+    while (c->outstanding > 0) {
+        struct pollfd pfd = { c->event_fd, POLLIN, 0 };
+        poll(&pfd, 1, -1);
+        jobs_collect(c);
+    }
+    pthread_mutex_lock(&c->done_lock); // the last job to report has let go of the connection
+    pthread_mutex_unlock(&c->done_lock);
+    pthread_mutex_destroy(&c->done_lock);
+    hpack_destroy(&c->hpack);
+    if (c->event_fd != -1) {
+        close(c->event_fd);
+    }
+    free(c->in);
+    free(c->out);
+    free(c->block);
+    free(c);
+}
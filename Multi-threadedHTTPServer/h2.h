@@ -0,0 +1,96 @@
+/**
+ * @File h2.h
+ *
+ * Cleartext HTTP/2 (h2c), by prior knowledge or by Upgrade from an
+ * HTTP/1.1 GET.  The worker that accepted the connection runs its frame
+ * loop: it decodes headers with HPACK, multiplexes many streams, and
+ * interleaves their DATA frames round-robin within the peer's flow
+ * control windows, so one large body cannot hold up small ones.  The
+ * blocking part of each request -- opening, locking, syncing -- is
+ * handed to a pool of stream threads through the begin and finish
+ * handlers, and run on the connection's own thread if the pool is
+ * too busy to pick it up promptly.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define H2_MAX_STREAMS 100 // concurrent streams per connection
+#define H2_IDLE_MS     5000 // an idle connection is closed, and a stream stalled on the peer reset, after this long
+
+/** @struct h2_request_t
+ *
+ *  @brief A GET or PUT made on a stream, as seen by the handlers.
+ */
+typedef struct {
+    char method[8]; // request method, for logging
+    bool put; // PUT rather than GET
+    char uri[64]; // object name, without its slash
+    char request_id[64]; // Request-Id header, "0" if absent
+    int64_t content_length; // declared body length, or -1
+    int code; // response status; 0 while a PUT's body is still expected
+    int fd; // GET: file to send from; PUT: file to write the body to
+    off_t offset; // where the body starts in fd
+    off_t size; // GET: body length
+    void *state; // whatever else the handlers keep until finish
+} h2_request_t;
+
+/** @struct h2_ops_t
+ *
+ *  @brief The server's handlers for stream requests.  Both may block and
+ *         run on a stream thread or the connection's thread.
+ */
+typedef struct {
+    // Opens the object.  A GET sets code 200 with fd, offset, and size,
+    // or an error code; a PUT sets code 0 with fd and offset to write
+    // the body at, or an error code.
+    void (*begin)(h2_request_t *req);
+    // Ends the request and logs it.  A PUT whose code is still 0 has
+    // received its whole body and is committed, setting the final code;
+    // anything else is released as it stands.  Called exactly once per
+    // request, whether or not begin ran.
+    void (*finish)(h2_request_t *req);
+} h2_ops_t;
+
+/** @brief Starts the stream thread pool.
+ *
+ *  @param threads the number of stream threads
+ *
+ *  @param ops the request handlers
+ *
+ *  @return 0 on success, or -1 on failure
+ */
+int h2_start(int threads, const h2_ops_t *ops);
+
+/** @brief Asks every HTTP/2 connection to finish its open streams and
+ *         close, as the server is shutting down.
+ */
+void h2_shutdown(void);
+
+/** @brief Stops the stream thread pool once no connection is served.
+ */
+void h2_stop(void);
+
+/** @brief Checks whether a request head asks to upgrade to h2c.
+ *
+ *  @param head a head from peek_head
+ *
+ *  @return whether it is a bodiless GET with Upgrade: h2c and
+ *          HTTP2-Settings
+ */
+bool h2_is_upgrade(const char *head);
+
+/** @brief Serves an HTTP/2 connection until it closes.
+ *
+ *  @param fd the client socket
+ *
+ *  @param head the peeked head: the start of the connection preface, or
+ *         an upgrade request, which is consumed and answered on stream 1
+ *
+ *  @param head_len length of the head
+ */
+void h2_serve(int fd, const char *head, size_t head_len);
@@ -0,0 +1,410 @@
+#include "hpack.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define STATIC_COUNT 61 // entries in the static table
+#define ENTRY_OVERHEAD 32 // RFC accounting overhead per entry
+
+typedef struct HpackEntry {
+    char *name; // owned; the value follows it in the same allocation
+    size_t name_len; // name length
+    char *value; // value, inside the name's allocation
+    size_t value_len; // value length
+} hpack_entry_t;
+
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[STATIC_COUNT] = {
+    { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+    { ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+    { ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+    { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+    { "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+    { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+    { "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+    { "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+    { "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+    { "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+    { "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+    { "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+    { "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+    { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// Huffman code of each symbol, right-aligned; symbol 256 is EOS
+static const struct {
+    uint8_t bits;
+    uint32_t code;
+} huffman[257] = {
+    { 13, 0x1ff8 }, { 23, 0x7fffd8 }, { 28, 0xfffffe2 }, { 28, 0xfffffe3 },
+    { 28, 0xfffffe4 }, { 28, 0xfffffe5 }, { 28, 0xfffffe6 }, { 28, 0xfffffe7 },
+    { 28, 0xfffffe8 }, { 24, 0xffffea }, { 30, 0x3ffffffc }, { 28, 0xfffffe9 },
+    { 28, 0xfffffea }, { 30, 0x3ffffffd }, { 28, 0xfffffeb }, { 28, 0xfffffec },
+    { 28, 0xfffffed }, { 28, 0xfffffee }, { 28, 0xfffffef }, { 28, 0xffffff0 },
+    { 28, 0xffffff1 }, { 28, 0xffffff2 }, { 30, 0x3ffffffe }, { 28, 0xffffff3 },
+    { 28, 0xffffff4 }, { 28, 0xffffff5 }, { 28, 0xffffff6 }, { 28, 0xffffff7 },
+    { 28, 0xffffff8 }, { 28, 0xffffff9 }, { 28, 0xffffffa }, { 28, 0xffffffb },
+    { 6, 0x14 }, { 10, 0x3f8 }, { 10, 0x3f9 }, { 12, 0xffa },
+    { 13, 0x1ff9 }, { 6, 0x15 }, { 8, 0xf8 }, { 11, 0x7fa },
+    { 10, 0x3fa }, { 10, 0x3fb }, { 8, 0xf9 }, { 11, 0x7fb },
+    { 8, 0xfa }, { 6, 0x16 }, { 6, 0x17 }, { 6, 0x18 },
+    { 5, 0x0 }, { 5, 0x1 }, { 5, 0x2 }, { 6, 0x19 },
+    { 6, 0x1a }, { 6, 0x1b }, { 6, 0x1c }, { 6, 0x1d },
+    { 6, 0x1e }, { 6, 0x1f }, { 7, 0x5c }, { 8, 0xfb },
+    { 15, 0x7ffc }, { 6, 0x20 }, { 12, 0xffb }, { 10, 0x3fc },
+    { 13, 0x1ffa }, { 6, 0x21 }, { 7, 0x5d }, { 7, 0x5e },
+    { 7, 0x5f }, { 7, 0x60 }, { 7, 0x61 }, { 7, 0x62 },
+    { 7, 0x63 }, { 7, 0x64 }, { 7, 0x65 }, { 7, 0x66 },
+    { 7, 0x67 }, { 7, 0x68 }, { 7, 0x69 }, { 7, 0x6a },
+    { 7, 0x6b }, { 7, 0x6c }, { 7, 0x6d }, { 7, 0x6e },
+    { 7, 0x6f }, { 7, 0x70 }, { 7, 0x71 }, { 7, 0x72 },
+    { 8, 0xfc }, { 7, 0x73 }, { 8, 0xfd }, { 13, 0x1ffb },
+    { 19, 0x7fff0 }, { 13, 0x1ffc }, { 14, 0x3ffc }, { 6, 0x22 },
+    { 15, 0x7ffd }, { 5, 0x3 }, { 6, 0x23 }, { 5, 0x4 },
+    { 6, 0x24 }, { 5, 0x5 }, { 6, 0x25 }, { 6, 0x26 },
+    { 6, 0x27 }, { 5, 0x6 }, { 7, 0x74 }, { 7, 0x75 },
+    { 6, 0x28 }, { 6, 0x29 }, { 6, 0x2a }, { 5, 0x7 },
+    { 6, 0x2b }, { 7, 0x76 }, { 6, 0x2c }, { 5, 0x8 },
+    { 5, 0x9 }, { 6, 0x2d }, { 7, 0x77 }, { 7, 0x78 },
+    { 7, 0x79 }, { 7, 0x7a }, { 7, 0x7b }, { 15, 0x7ffe },
+    { 11, 0x7fc }, { 14, 0x3ffd }, { 13, 0x1ffd }, { 28, 0xffffffc },
+    { 20, 0xfffe6 }, { 22, 0x3fffd2 }, { 20, 0xfffe7 }, { 20, 0xfffe8 },
+    { 22, 0x3fffd3 }, { 22, 0x3fffd4 }, { 22, 0x3fffd5 }, { 23, 0x7fffd9 },
+    { 22, 0x3fffd6 }, { 23, 0x7fffda }, { 23, 0x7fffdb }, { 23, 0x7fffdc },
+    { 23, 0x7fffdd }, { 23, 0x7fffde }, { 24, 0xffffeb }, { 23, 0x7fffdf },
+    { 24, 0xffffec }, { 24, 0xffffed }, { 22, 0x3fffd7 }, { 23, 0x7fffe0 },
+    { 24, 0xffffee }, { 23, 0x7fffe1 }, { 23, 0x7fffe2 }, { 23, 0x7fffe3 },
+    { 23, 0x7fffe4 }, { 21, 0x1fffdc }, { 22, 0x3fffd8 }, { 23, 0x7fffe5 },
+    { 22, 0x3fffd9 }, { 23, 0x7fffe6 }, { 23, 0x7fffe7 }, { 24, 0xffffef },
+    { 22, 0x3fffda }, { 21, 0x1fffdd }, { 20, 0xfffe9 }, { 22, 0x3fffdb },
+    { 22, 0x3fffdc }, { 23, 0x7fffe8 }, { 23, 0x7fffe9 }, { 21, 0x1fffde },
+    { 23, 0x7fffea }, { 22, 0x3fffdd }, { 22, 0x3fffde }, { 24, 0xfffff0 },
+    { 21, 0x1fffdf }, { 22, 0x3fffdf }, { 23, 0x7fffeb }, { 23, 0x7fffec },
+    { 21, 0x1fffe0 }, { 21, 0x1fffe1 }, { 22, 0x3fffe0 }, { 21, 0x1fffe2 },
+    { 23, 0x7fffed }, { 22, 0x3fffe1 }, { 23, 0x7fffee }, { 23, 0x7fffef },
+    { 20, 0xfffea }, { 22, 0x3fffe2 }, { 22, 0x3fffe3 }, { 22, 0x3fffe4 },
+    { 23, 0x7ffff0 }, { 22, 0x3fffe5 }, { 22, 0x3fffe6 }, { 23, 0x7ffff1 },
+    { 26, 0x3ffffe0 }, { 26, 0x3ffffe1 }, { 20, 0xfffeb }, { 19, 0x7fff1 },
+    { 22, 0x3fffe7 }, { 23, 0x7ffff2 }, { 22, 0x3fffe8 }, { 25, 0x1ffffec },
+    { 26, 0x3ffffe2 }, { 26, 0x3ffffe3 }, { 26, 0x3ffffe4 }, { 27, 0x7ffffde },
+    { 27, 0x7ffffdf }, { 26, 0x3ffffe5 }, { 24, 0xfffff1 }, { 25, 0x1ffffed },
+    { 19, 0x7fff2 }, { 21, 0x1fffe3 }, { 26, 0x3ffffe6 }, { 27, 0x7ffffe0 },
+    { 27, 0x7ffffe1 }, { 26, 0x3ffffe7 }, { 27, 0x7ffffe2 }, { 24, 0xfffff2 },
+    { 21, 0x1fffe4 }, { 21, 0x1fffe5 }, { 26, 0x3ffffe8 }, { 26, 0x3ffffe9 },
+    { 28, 0xffffffd }, { 27, 0x7ffffe3 }, { 27, 0x7ffffe4 }, { 27, 0x7ffffe5 },
+    { 20, 0xfffec }, { 24, 0xfffff3 }, { 20, 0xfffed }, { 21, 0x1fffe6 },
+    { 22, 0x3fffe9 }, { 21, 0x1fffe7 }, { 21, 0x1fffe8 }, { 23, 0x7ffff3 },
+    { 22, 0x3fffea }, { 22, 0x3fffeb }, { 25, 0x1ffffee }, { 25, 0x1ffffef },
+    { 24, 0xfffff4 }, { 24, 0xfffff5 }, { 26, 0x3ffffea }, { 23, 0x7ffff4 },
+    { 26, 0x3ffffeb }, { 27, 0x7ffffe6 }, { 26, 0x3ffffec }, { 26, 0x3ffffed },
+    { 27, 0x7ffffe7 }, { 27, 0x7ffffe8 }, { 27, 0x7ffffe9 }, { 27, 0x7ffffea },
+    { 27, 0x7ffffeb }, { 28, 0xffffffe }, { 27, 0x7ffffec }, { 27, 0x7ffffed },
+    { 27, 0x7ffffee }, { 27, 0x7ffffef }, { 27, 0x7fffff0 }, { 26, 0x3ffffee },
+    { 30, 0x3fffffff },
+};
+
+// Decoding tree built from the table: internal nodes hold child indexes,
+// leaves hold -1 - symbol.  256 internal nodes suffice for 257 leaves.
+static int16_t huffman_tree[256][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+// function to build the Huffman decoding tree
+static void huffman_build(void) {
+    int nodes = 1;
+    memset(huffman_tree, 0, sizeof(huffman_tree)); // 0 means no child yet; the root is never a child
+    for (int sym = 0; sym < 257; sym++) {
+        int node = 0;
+        for (int bit = huffman[sym].bits - 1; bit > 0; bit--) {
+            int b = (huffman[sym].code >> bit) & 1;
+            if (huffman_tree[node][b] == 0) {
+                huffman_tree[node][b] = nodes++;
+            }
+            node = huffman_tree[node][b];
+        }
+        huffman_tree[node][huffman[sym].code & 1] = -1 - sym;
+    }
+}
+
+// function to decode a Huffman string; returns its length or -1
+static ssize_t huffman_decode(const uint8_t *in, size_t len, char *out, size_t cap) {
+    pthread_once(&huffman_once, huffman_build);
+    size_t n = 0;
+    int node = 0;
+    int depth = 0; // bits since the last symbol
+    bool ones = true; // whether those bits were all ones
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int b = (in[i] >> bit) & 1;
+            int next = huffman_tree[node][b];
+            depth++;
+            ones = ones && b == 1;
+            if (next < 0) {
+                int sym = -1 - next;
+                if (sym == 256 || n == cap) {
+                    return -1; // EOS must not appear in the string
+                }
+                out[n++] = (char) sym;
+                node = 0;
+                depth = 0;
+                ones = true;
+            } else if (next == 0) {
+                return -1;
+            } else {
+                node = next;
+            }
+        }
+    }
+    // Padding is the most significant bits of EOS, at most seven of them
+    return depth <= 7 && ones ? (ssize_t) n : -1;
+}
+
+// function to decode an integer with an n-bit prefix
+static int decode_int(const uint8_t **p, const uint8_t *end, int prefix, size_t *value) {
+    if (*p == end) {
+        return -1;
+    }
+    size_t max = (1u << prefix) - 1;
+    size_t v = **p & max;
+    (*p)++;
+    if (v < max) {
+        *value = v;
+        return 0;
+    }
+    for (int shift = 0; shift <= 28; shift += 7) {
+        if (*p == end) {
+            return -1;
+        }
+        uint8_t b = **p;
+        (*p)++;
+        v += (size_t) (b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1; // longer than any sane length
+}
+
+// function to decode a string literal into out; returns its length or -1
+static ssize_t decode_string(const uint8_t **p, const uint8_t *end, char *out, size_t cap) {
+    if (*p == end) {
+        return -1;
+    }
+    bool huff = (**p & 0x80) != 0;
+    size_t len;
+    if (decode_int(p, end, 7, &len) == -1 || len > (size_t) (end - *p)) {
+        return -1;
+    }
+    const uint8_t *s = *p;
+    *p += len;
+    if (huff) {
+        return huffman_decode(s, len, out, cap);
+    }
+    if (len > cap) {
+        return -1;
+    }
+    memcpy(out, s, len);
+    return len;
+}
+
+// function to evict the oldest entries until the table fits in limit
+static void table_evict(hpack_t *t, size_t limit) {
+    while (t->size > limit && t->count > 0) {
+        hpack_entry_t *e = &t->entries[(t->first + t->count - 1) % t->capacity];
+        t->size -= e->name_len + e->value_len + ENTRY_OVERHEAD;
+        free(e->name);
+        t->count--;
+    }
+}
+
+// function to add an entry to the dynamic table
+static int table_add(hpack_t *t, const char *name, size_t name_len, const char *value, size_t value_len) {
+    size_t size = name_len + value_len + ENTRY_OVERHEAD;
+    table_evict(t, size > t->max_size ? 0 : t->max_size - size);
+    if (size > t->max_size) {
+        return 0; // too large to keep; the table is now empty, as the RFC requires
+    }
+    if (t->count == t->capacity) {
+        size_t capacity = t->capacity * 2;
+        hpack_entry_t *entries = malloc(capacity * sizeof(hpack_entry_t));
+        if (entries == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < t->count; i++) {
+            entries[i] = t->entries[(t->first + i) % t->capacity];
+        }
+        free(t->entries);
+        t->entries = entries;
+        t->capacity = capacity;
+        t->first = 0;
+    }
+    char *copy = malloc(name_len + value_len + 1);
+    if (copy == NULL) {
+        return -1;
+    }
+    memcpy(copy, name, name_len);
+    memcpy(copy + name_len, value, value_len);
+    t->first = (t->first + t->capacity - 1) % t->capacity;
+    t->entries[t->first] = (hpack_entry_t) { copy, name_len, copy + name_len, value_len };
+    t->count++;
+    t->size += size;
+    return 0;
+}
+
+// function to look up an index in the static and dynamic tables
+static int table_get(hpack_t *t, size_t index, const char **name, size_t *name_len, const char **value,
+    size_t *value_len) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= STATIC_COUNT) {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= STATIC_COUNT + 1;
+    if (index >= t->count) {
+        return -1;
+    }
+    hpack_entry_t *e = &t->entries[(t->first + index) % t->capacity];
+    *name = e->name;
+    *name_len = e->name_len;
+    *value = e->value;
+    *value_len = e->value_len;
+    return 0;
+}
+
+// function to prepare an empty decoder
+int hpack_init(hpack_t *t) {
+    t->capacity = 16;
+    t->first = 0;
+    t->count = 0;
+    t->size = 0;
+    t->max_size = HPACK_TABLE_SIZE;
+    t->entries = malloc(t->capacity * sizeof(hpack_entry_t));
+    t->scratch = malloc(2 * HPACK_STRING_MAX);
+    if (t->entries == NULL || t->scratch == NULL) {
+        free(t->entries);
+        free(t->scratch);
+        return -1;
+    }
+    return 0;
+}
+
+// function to free a decoder's table
+void hpack_destroy(hpack_t *t) {
+    table_evict(t, 0);
+    free(t->entries);
+    free(t->scratch);
+}
+
+// function to decode a header block
+int hpack_decode(hpack_t *t, const uint8_t *block, size_t len, hpack_emit_t emit, void *arg) {
+    const uint8_t *p = block;
+    const uint8_t *end = block + len;
+    char *name_buf = t->scratch;
+    char *value_buf = t->scratch + HPACK_STRING_MAX;
+    while (p < end) {
+        const char *name, *value;
+        size_t name_len, value_len, index;
+        if (*p & 0x80) {
+            // Indexed field
+            if (decode_int(&p, end, 7, &index) == -1
+                || table_get(t, index, &name, &name_len, &value, &value_len) == -1) {
+                return -1;
+            }
+            emit(arg, name, name_len, value, value_len);
+            continue;
+        }
+        if ((*p & 0xe0) == 0x20) {
+            // Dynamic table size update
+            if (decode_int(&p, end, 5, &index) == -1 || index > HPACK_TABLE_SIZE) {
+                return -1;
+            }
+            t->max_size = index;
+            table_evict(t, index);
+            continue;
+        }
+        // Literal, with incremental indexing or without
+        bool indexing = (*p & 0xc0) == 0x40;
+        if (decode_int(&p, end, indexing ? 6 : 4, &index) == -1) {
+            return -1;
+        }
+        if (index == 0) {
+            ssize_t n = decode_string(&p, end, name_buf, HPACK_STRING_MAX);
+            if (n == -1) {
+                return -1;
+            }
+            name = name_buf;
+            name_len = n;
+        } else if (table_get(t, index, &name, &name_len, &value, &value_len) == -1) {
+            return -1;
+        } else {
+            // Copy the name out, since adding the entry may evict the one it came from
+            memcpy(name_buf, name, name_len);
+            name = name_buf;
+        }
+        ssize_t n = decode_string(&p, end, value_buf, HPACK_STRING_MAX);
+        if (n == -1) {
+            return -1;
+        }
+        value = value_buf;
+        value_len = n;
+        if (indexing && table_add(t, name, name_len, value, value_len) == -1) {
+            return -1;
+        }
+        emit(arg, name, name_len, value, value_len);
+    }
+    return 0;
+}
+
+// function to encode an integer with an n-bit prefix after the given high bits
+static size_t encode_int(uint8_t *out, uint8_t high, int prefix, size_t value) {
+    size_t max = (1u << prefix) - 1;
+    if (value < max) {
+        out[0] = high | value;
+        return 1;
+    }
+    size_t n = 0;
+    out[n++] = high | max;
+    value -= max;
+    while (value >= 0x80) {
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = value;
+    return n;
+}
+
+// function to encode a :status field
+size_t hpack_encode_status(uint8_t *out, int status) {
+    for (int i = 7; i < 14; i++) {
+        if (atoi(static_table[i].value) == status) {
+            return encode_int(out, 0x80, 7, i + 1);
+        }
+    }
+    char value[4];
+    value[0] = '0' + status / 100 % 10;
+    value[1] = '0' + status / 10 % 10;
+    value[2] = '0' + status % 10;
+    value[3] = '\0';
+    return hpack_encode_literal(out, 8, value);
+}
+
+// function to encode a literal field without indexing
+size_t hpack_encode_literal(uint8_t *out, int name_index, const char *value) {
+    size_t len = strlen(value);
+    size_t n = encode_int(out, 0x00, 4, name_index);
+    n += encode_int(out + n, 0x00, 7, len);
+    memcpy(out + n, value, len);
+    return n + len;
+}
@@ -0,0 +1,92 @@
+/**
+ * @File hpack.h
+ *
+ * HPACK header compression for HTTP/2 (RFC 7541).  The decoder keeps the
+ * peer's dynamic table and handles Huffman-coded strings; the encoder
+ * writes responses with the static table and plain literals only, so it
+ * needs no state.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_TABLE_SIZE 4096 // dynamic table size we allow the peer
+#define HPACK_STRING_MAX 8192 // longest name or value we decode
+
+/** @struct hpack_t
+ *
+ *  @brief The decoder's dynamic table.  Entries are kept newest first in
+ *         a ring of owned strings.
+ */
+typedef struct {
+    struct HpackEntry *entries; // ring of entries
+    size_t capacity; // slots in the ring
+    size_t first; // slot of the newest entry
+    size_t count; // entries in the table
+    size_t size; // RFC size: name + value + 32 per entry
+    size_t max_size; // current limit set by size updates
+    char *scratch; // room for one decoded name and value
+} hpack_t;
+
+/** @brief Called for each decoded header field.  The strings are only
+ *         valid during the call and are not NUL-terminated.
+ */
+typedef void (*hpack_emit_t)(void *arg, const char *name, size_t name_len, const char *value, size_t value_len);
+
+/** @brief Prepares an empty decoder.
+ *
+ *  @param t the decoder
+ *
+ *  @return 0 on success, or -1 if out of memory
+ */
+int hpack_init(hpack_t *t);
+
+/** @brief Frees a decoder's table.
+ *
+ *  @param t the decoder
+ */
+void hpack_destroy(hpack_t *t);
+
+/** @brief Decodes a complete header block.
+ *
+ *  @param t the decoder
+ *
+ *  @param block the block, from HEADERS and any CONTINUATION frames
+ *
+ *  @param len length of the block
+ *
+ *  @param emit called for each field in order
+ *
+ *  @param arg passed to emit
+ *
+ *  @return 0 on success, or -1 on a compression error, which is fatal
+ *          to the connection
+ */
+int hpack_decode(hpack_t *t, const uint8_t *block, size_t len, hpack_emit_t emit, void *arg);
+
+/** @brief Encodes a :status field.
+ *
+ *  @param out receives the encoding, at least 8 bytes
+ *
+ *  @param status the status code
+ *
+ *  @return the number of bytes written
+ */
+size_t hpack_encode_status(uint8_t *out, int status);
+
+/** @brief Encodes a field as a literal without indexing, naming it by
+ *         its static table index.
+ *
+ *  @param out receives the encoding, at least 8 + strlen(value) bytes
+ *
+ *  @param name_index static table index of the name
+ *
+ *  @param value the value
+ *
+ *  @return the number of bytes written
+ */
+size_t hpack_encode_literal(uint8_t *out, int name_index, const char *value);
+
+#define HPACK_CONTENT_LENGTH 28 // static table index of content-length
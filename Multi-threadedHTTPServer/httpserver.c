@@ -1,37 +1,152 @@
+#include "affinity.h"
 #include "asgn4_helper_funcs.h"
+#include "classq.h"
+#include "commit.h"
 #include "connection.h"
 #include "debug.h"
+#include "flight.h"
+#include "green.h"
+#include "gzcache.h"
+#include "h2.h"
+#include "idle.h"
+#include "layout.h"
+#include "lockprof.h"
+#include "peek.h"
+#include "pool.h"
+#include "prewarm.h"
 #include "request.h"
 #include "response.h"
-#include "queue.h"
+#include "restart.h"
+#include "store.h"
+#include "trace.h"
+#include "upload.h"
+#include "util.h"
+#include "wheel.h"
 
 #include <err.h>
 #include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/uio.h>
 
-void handle_connection(int);
-void handle_get(conn_t *);
-void handle_put(conn_t *);
-void handle_unsupported(conn_t *);
-void *process_connection();
+#define POOL_CAPACITY 16 // Idle connection contexts each worker keeps
+#define CLASS_INTERACTIVE 0 // Queue class of everything but large uploads
+#define CLASS_BULK        1 // Queue class of uploads of at least bulk_bytes
+#define CLASS_TRANSFER    2 // Queue class of GET bodies parked between slices
+#define BULK_BACKLOG      256 // Bulk connections waiting before the dispatcher blocks
+#define PARKED_MAX        256 // Parked transfers waiting before workers stop parking more
+#define CLASSIFY_PEEK     2048 // Head bytes looked at to classify a connection
+#define WHEEL_TICK_MS 10 // Resolution of the connection timeouts
+#define HEAD_WAIT_MS  30000 // Longest wait for a request head when -T sets no header timeout
+#define MGET_MAX      64 // Objects one batch GET may name
+#define GZIP_HEADERS  "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" // Head lines of a gzip variant
+#define UPLOAD_DRAINERS 4 // Bodies written with O_DIRECT at once under -D; others go through the page cache
+#define PREWARM_THREADS 4 // Threads warming the objects of the -w manifest
+#define VARY_HEADER   "Vary: Accept-Encoding\r\n" // Head line of a file sent as it is while gzip is on
+#define GZIP_STATIC_DIR "_gz" // Precompressed variants, as name.gz; object names cannot contain '_', so clients cannot write here
+
+void handle_connection(conn_ctx_t *);
+void handle_get(conn_ctx_t *);
+void handle_put(conn_ctx_t *);
+void handle_unsupported(conn_ctx_t *);
+void handle_store_get(conn_ctx_t *);
+void handle_store_put(conn_ctx_t *);
+void handle_mget(conn_ctx_t *, ssize_t);
+void handle_write(conn_ctx_t *, ssize_t, bool);
+void h2_begin(h2_request_t *req);
+void h2_finish(h2_request_t *req);
+void send_status(int fd, int code);
+void discard_body(conn_ctx_t *ctx, long length);
+void send_file(conn_ctx_t *ctx, int fd, off_t offset, off_t size, const char *headers,
+    void (*finish)(conn_ctx_t *, const Response_t *));
+bool send_gzip(conn_ctx_t *ctx, const char *uri, const char *path, int *fd, off_t *size);
+int warm_object(const char *name);
+int transfer_unlock(transfer_t *x);
+int transfer_relock(transfer_t *x);
+void transfer_run(conn_ctx_t *ctx);
+void finish_get(conn_ctx_t *ctx, const Response_t *res);
+void finish_store_get(conn_ctx_t *ctx, const Response_t *res);
+void *process_connection(void *arg);
+int worker_take(int home, void **elem, int *cls);
+void worker_done(int q, int cls);
+void *carrier_start(void);
+void carrier_serve(void *, int);
+void carrier_stop(void *);
+long conn_expired(void *arg);
+void conn_watch(conn_ctx_t *ctx);
+void conn_watch_body(conn_ctx_t *ctx);
+void conn_unwatch(conn_ctx_t *ctx);
+void trace_head(trace_req_t *req, const char *head);
+int classify(int connfd);
+void enqueue(int connfd);
+bool dispatch(Listener_Socket *sock, int sig_fd, int handoff_fd);
+void dump_stats(void);
 void handle_get_log(char *uri, int code, conn_t *conn, const Response_t *res);
+void log_get(const char *method, const char *uri, int code, const char *request_id);
 
-queue_t *new_q;
+classq_t *queues[AFFINITY_MAX_PLACES]; // Connection queues, one per place workers are pinned to
+int queue_count = 1; // Queues in use
+int place_count = 0; // Places threads are pinned to, 0 for no pinning
+static __thread classq_t *home_q = NULL; // The calling worker's own queue
+idle_t *idle = NULL; // Where workers sleep when every queue is empty, woken by pushes at any place
+atomic_ulong steered; // Connections queued at the place of the CPU their packets arrived on
+atomic_ulong steals; // Connections a worker took from another place's queue
 pthread_mutex_t mut;
+store_t *store = NULL; // Log-structured object store, if enabled with -s
+committer_t *committer = NULL; // Group commit for durable PUTs, if enabled with -d
+flights_t *flights = NULL; // Coalesces concurrent GETs of the same file
+int layout_levels = 0; // Hashed subdirectory levels objects are kept under, 0 for a flat directory
+uint64_t direct_threshold = 0; // PUT bodies at least this large bypass the page cache, 0 for never
+int green_carriers = 0; // Carrier threads running connections as green threads, 0 for the worker pool
+wheel_t *wheel = NULL; // Timing wheel enforcing the connection timeouts
+long header_ms = 5000; // Time allowed from accept until the request head is in, 0 for no limit
+long idle_ms = 5000; // Time a request may wait on its client without progress, 0 for no limit
+long total_ms = 0; // Time allowed for a whole request, 0 for no limit
+atomic_ulong timeouts[3]; // Connections closed by the header, idle, and total timeouts
+tracer_t *tracer = NULL; // Writes the spans of sampled requests, if enabled with -x
+long bulk_bytes = 0; // Uploads at least this large are queued as bulk work, 0 for a single class
+off_t slice_bytes = 0; // GET bodies yield to waiting work after each this many bytes, 0 for never
+atomic_ulong parks; // Times a GET body was parked between slices
+gzcache_t *gzcache = NULL; // Gzip variants of files, if negotiation is enabled with -z
+atomic_ulong gzip_static; // GETs answered with a .gz file beside the one asked for
+atomic_ulong gzip_cached; // GETs answered with a variant from the cache
+prewarm_t *prewarm = NULL; // Warms the objects of a manifest at startup and counts GETs for the next, if enabled with -w
 
 int main(int argc, char **argv) {
     int option = 0;
     int num_threads = 4; // Set default number of threads to 4
     // Process command-line options using getopt
-    while ((option = getopt(argc, argv, "t:")) != -1) {
+    char *restart_path = NULL; // Unix socket for listener handoff, if hot restart is enabled
+    char *store_dir = NULL; // Directory of the object store, if objects are kept in one
+    long commit_window = -1; // Group commit window in microseconds, or -1 for no syncing
+    bool migrate = false; // Move a flat directory into the hashed layout before serving
+    long negative_ms = 0; // How long a GET remembers a missing file, 0 for not at all
+    char *trace_path = NULL; // Chrome trace file to write spans to, if tracing is enabled
+    long trace_every = 1; // Trace one of every this many connections
+    int interactive_weight = 4; // Interactive connections dequeued per bulk one
+    int bulk_workers = 0; // Workers bulk connections may occupy at once, 0 for all but one
+    char *affinity_spec = NULL; // CPUs or "numa" to pin workers to, if pinning is enabled
+    int dispatcher_cpu = -1; // CPU to pin the dispatcher to, -1 for none
+    long gzip_cache_bytes = 0; // Bytes of gzip variants to keep, 0 for no gzip
+    int gzip_level = 6; // Compression level of the variants
+    char *prewarm_path = NULL; // Manifest of hot objects to warm at startup and rewrite at shutdown, if enabled
+    long prewarm_limit = 1024; // Most objects the manifest warms and keeps
+    while ((option = getopt(argc, argv, "t:R:s:d:D:l:Mn:g:T:x:c:F:a:z:w:")) != -1) {
         // Continue looping until all options have been processed (-1 indicates end of options)
         switch (option) {
         case 't':
@@ -42,19 +157,151 @@ int main(int argc, char **argv) {
                 exit(EXIT_FAILURE);
             }
             break;
+        case 'R':
+            // Option -R: Take over the listener of the server at this path, then offer ours there
+            restart_path = optarg;
+            break;
+        case 's':
+            // Option -s: Keep objects in a log-structured store in this directory
+            store_dir = optarg;
+            break;
+        case 'd':
+            // Option -d: Reply to a PUT only once it is durable, syncing in batches gathered over this many microseconds
+            commit_window = atol(optarg);
+            if (commit_window < 0) {
+                fprintf(stderr, "Invalid commit window.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'D':
+            // Option -D: Write PUT bodies of at least this many bytes with O_DIRECT
+            direct_threshold = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            // Option -l: Shard objects into this many levels of 256 hashed subdirectories
+            layout_levels = atoi(optarg);
+            if (layout_levels < 0 || layout_levels > LAYOUT_MAX_LEVELS) {
+                fprintf(stderr, "Invalid layout levels.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'M':
+            // Option -M: Migrate the objects of a flat directory into the -l layout first
+            migrate = true;
+            break;
+        case 'n':
+            // Option -n: Answer GETs of a file found missing from memory for this many milliseconds
+            negative_ms = atol(optarg);
+            if (negative_ms < 0) {
+                fprintf(stderr, "Invalid negative cache lifetime.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'g':
+            // Option -g: Serve each connection on a green thread, multiplexed over this many carrier threads
+            green_carriers = atoi(optarg);
+            if (green_carriers < 0) {
+                fprintf(stderr, "Invalid carrier count.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            // Option -T: Close connections that take longer than this for their head, stall this long, or take this long overall
+            if (sscanf(optarg, "%ld:%ld:%ld", &header_ms, &idle_ms, &total_ms) != 3 || header_ms < 0 || idle_ms < 0
+                || total_ms < 0) {
+                fprintf(stderr, "Invalid timeouts.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'x':
+            // Option -x: Write the spans of one in every N requests to this file as a Chrome trace
+            trace_path = optarg;
+            char *every = strrchr(optarg, ':');
+            if (every != NULL) {
+                *every = '\0';
+                trace_every = atol(every + 1);
+            }
+            if (trace_every < 1) {
+                fprintf(stderr, "Invalid trace sampling.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            // Option -c: Queue uploads of at least this many bytes as bulk work, behind interactive requests
+            if (sscanf(optarg, "%ld:%d:%d", &bulk_bytes, &interactive_weight, &bulk_workers) < 1 || bulk_bytes < 1
+                || interactive_weight < 1 || bulk_workers < 0) {
+                fprintf(stderr, "Invalid request classes.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'F':
+            // Option -F: Send GET bodies in slices of this many bytes, letting waiting requests in between
+            slice_bytes = atol(optarg);
+            if (slice_bytes < 0) {
+                fprintf(stderr, "Invalid slice size.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'a':
+            // Option -a: Pin workers to these CPUs, one queue each, or to NUMA nodes; after a colon, the dispatcher's CPU
+            affinity_spec = optarg;
+            char *cpu = strrchr(optarg, ':');
+            if (cpu != NULL) {
+                *cpu = '\0';
+                dispatcher_cpu = atoi(cpu + 1);
+            }
+            place_count = affinity_init(affinity_spec);
+            if (place_count < 1 || (cpu != NULL && dispatcher_cpu < 0)) {
+                fprintf(stderr, "Invalid affinity.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            // Option -z: Send gzip to clients that accept it, keeping this many bytes of compressed files at this level
+            if (sscanf(optarg, "%ld:%d", &gzip_cache_bytes, &gzip_level) < 1 || gzip_cache_bytes < 1 || gzip_level < 1
+                || gzip_level > 9) {
+                fprintf(stderr, "Invalid gzip cache.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            // Option -w: Warm the hottest objects of this manifest at startup, and save this run's as the next one
+            prewarm_path = optarg;
+            char *limit = strrchr(optarg, ':');
+            if (limit != NULL) {
+                *limit = '\0';
+                prewarm_limit = atol(limit + 1);
+            }
+            if (prewarm_limit < 1 || *prewarm_path == '\0') {
+                fprintf(stderr, "Invalid prewarm manifest.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
         default:
             // Invalid option or missing arguments
-            fprintf(stderr, "Usage: httpserver [-t threads] <port>\n");
+            fprintf(stderr, "Usage: httpserver [-t threads] [-R restart_socket] [-s store_dir] [-d commit_window_us] [-D direct_bytes] [-l levels [-M]] [-n negative_ms] [-g carriers] [-T header_ms:idle_ms:total_ms] [-x trace_file[:every]] [-c bulk_bytes[:weight[:bulk_workers]]] [-F slice_bytes] [-a cpus|numa[:dispatcher_cpu]] [-z cache_bytes[:level]] [-w manifest[:limit]] <port>\n");
             break;
         }
     }
     int errchk = optind + 1;
     while (errchk < argc) {
         fprintf(stderr,
-            "Usage: httpserver [-t threads] <port>\n"); // Additional arguments following <port> argument
+            "Usage: httpserver [-t threads] [-R restart_socket] [-s store_dir] [-d commit_window_us] [-D direct_bytes] [-l levels [-M]] [-n negative_ms] [-g carriers] [-T header_ms:idle_ms:total_ms] [-x trace_file[:every]] [-c bulk_bytes[:weight[:bulk_workers]]] [-F slice_bytes] [-a cpus|numa[:dispatcher_cpu]] [-z cache_bytes[:level]] [-w manifest[:limit]] <port>\n"); // Additional arguments following <port> argument
         return EXIT_FAILURE;
         errchk++;
     }
+    if (migrate && layout_levels == 0) {
+        fprintf(stderr, "Option -M needs -l levels to migrate into.\n");
+        return EXIT_FAILURE;
+    }
+    if (bulk_bytes > 0 && green_carriers > 0) {
+        fprintf(stderr, "Option -c cannot be used with -g: green threads are not queued by class.\n");
+        return EXIT_FAILURE;
+    }
+    if (bulk_workers > num_threads) {
+        fprintf(stderr, "Option -c allows %d bulk workers, but -t starts only %d.\n", bulk_workers, num_threads);
+        return EXIT_FAILURE;
+    }
     // Using starter code from resources
     if (argc < 2) {
         warnx("wrong arguments: %s port_num",
@@ -75,44 +322,426 @@ int main(int argc, char **argv) {
 
     signal(SIGPIPE, SIG_IGN);
     Listener_Socket sock;
-    listener_init(&sock, port);
+    sock.fd = -1;
+    if (restart_path != NULL) {
+        // Hot restart: inherit the listener of the server already running, if any
+        sock.fd = restart_receive(restart_path);
+    }
+    if (sock.fd == -1 && listener_init(&sock, port) == -1) {
+        warnx("cannot listen on port %zu", port);
+        return EXIT_FAILURE;
+    }
     // End starter code from resources
 
-    // Set up mutex lock, queue, and threads
+    // The dispatcher only accepts after poll reports a connection, and a
+    // successor sharing the listener may take it first, so never block in accept
+    fcntl(sock.fd, F_SETFL, fcntl(sock.fd, F_GETFL) | O_NONBLOCK);
+
+    int handoff_fd = -1;
+    if (restart_path != NULL) {
+        handoff_fd = restart_listen(restart_path);
+        if (handoff_fd == -1) {
+            warn("cannot offer listener at %s", restart_path);
+        }
+    }
+
+    // Shutdown and stats signals are read from a signalfd by the dispatcher;
+    // block them before starting workers so no thread is interrupted by them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    int sig_fd = signalfd(-1, &signals, 0);
+    if (sig_fd == -1) {
+        err(EXIT_FAILURE, "signalfd");
+    }
+
+    if (migrate) {
+        long moved = layout_migrate(layout_levels);
+        if (moved == -1) {
+            err(EXIT_FAILURE, "cannot migrate to %d layout levels", layout_levels);
+        }
+        fprintf(stderr, "migrated %ld objects\n", moved);
+    }
+
+    if (store_dir != NULL) {
+        // Rebuilds the index from the segment headers before serving anything
+        store = store_open(store_dir);
+        if (store == NULL) {
+            err(EXIT_FAILURE, "cannot open store %s", store_dir);
+        }
+    }
+
+    flights = flights_new(negative_ms);
+    if (flights == NULL) {
+        err(EXIT_FAILURE, "cannot allocate flight group");
+    }
+
+    static const h2_ops_t h2_ops = { h2_begin, h2_finish };
+    if (h2_start(num_threads, &h2_ops) == -1) {
+        err(EXIT_FAILURE, "cannot start stream threads");
+    }
+
+    if (trace_path != NULL) {
+        tracer = tracer_new(trace_path, trace_every);
+        if (tracer == NULL) {
+            err(EXIT_FAILURE, "cannot open trace %s", trace_path);
+        }
+    }
+
+    if (gzip_cache_bytes > 0) {
+        gzcache = gzcache_new(gzip_cache_bytes, gzip_level);
+        if (gzcache == NULL) {
+            err(EXIT_FAILURE, "cannot allocate gzip cache");
+        }
+    }
+
+    if (prewarm_path != NULL) {
+        prewarm = prewarm_new(prewarm_path, prewarm_limit);
+        if (prewarm == NULL) {
+            err(EXIT_FAILURE, "cannot read prewarm manifest %s", prewarm_path);
+        }
+    }
+
+    wheel = wheel_new(WHEEL_TICK_MS);
+    if (wheel == NULL) {
+        err(EXIT_FAILURE, "cannot start timing wheel");
+    }
+
+    if (direct_threshold > 0 && upload_start(UPLOAD_DRAINERS) == -1) {
+        err(EXIT_FAILURE, "cannot start upload threads");
+    }
+
+    if (commit_window >= 0) {
+        committer = committer_new(commit_window);
+        if (committer == NULL) {
+            err(EXIT_FAILURE, "cannot start commit thread");
+        }
+    }
+
+    if (bulk_bytes > 0) {
+        // Only hand over connections once their head has arrived, so the dispatcher can classify them
+        int defer_s = 1;
+        setsockopt(sock.fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_s, sizeof(defer_s));
+    }
+
+    // Set up mutex lock, queues, and threads. Worker i runs at place i % place_count
+    // and takes from queue i % queue_count, so each queue is served by the workers of one place
     pthread_mutex_init(&mut, NULL); // Used for put
-    new_q = queue_new(num_threads);
+    int workers = green_carriers > 0 ? 0 : num_threads; // green threads replace the worker pool
+    if (place_count > 1 && workers > 1) {
+        queue_count = place_count < workers ? place_count : workers;
+    }
+    if (bulk_workers > 0 && bulk_workers < queue_count) {
+        fprintf(stderr, "warning: -c allows %d bulk workers, but each of the %d places gets one\n", bulk_workers,
+            queue_count);
+    }
+    for (int q = 0; q < queue_count; q++) {
+        int served = workers / queue_count + (q < workers % queue_count); // workers taking from this queue
+        int capacity = served > 0 ? served : 1;
+        // An explicit bulk worker count is split over the queues like the workers, at least one each
+        int limit = served > 1 ? served - 1 : 1;
+        if (bulk_workers > 0) {
+            limit = bulk_workers / queue_count + (q < bulk_workers % queue_count);
+            limit = limit > 0 ? limit : 1;
+        }
+        classq_spec_t classes[] = {
+            [CLASS_INTERACTIVE] = { interactive_weight, capacity, 0 },
+            [CLASS_BULK] = { 1, BULK_BACKLOG, limit },
+            [CLASS_TRANSFER] = { 1, PARKED_MAX, 0 },
+        };
+        queues[q] = classq_new(3, classes);
+        if (queues[q] == NULL) {
+            err(EXIT_FAILURE, "cannot allocate connection queue");
+        }
+    }
+    idle = idle_new(queue_count);
+    if (idle == NULL) {
+        err(EXIT_FAILURE, "cannot allocate idle workers");
+    }
     pthread_t th[num_threads];
-    for (int i = 0; i < num_threads; i++) {
-        pthread_create(&(th[i]), NULL, process_connection, (void *) new_q);
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&(th[i]), NULL, process_connection, (void *) (intptr_t) i);
+    }
+    static const green_ops_t green_ops = { carrier_start, carrier_serve, carrier_stop };
+    if (green_carriers > 0 && green_start(green_carriers, &green_ops) == -1) {
+        err(EXIT_FAILURE, "cannot start carrier threads");
+    }
+    // Warming runs while the dispatcher accepts, so the first requests are not held up by it
+    if (prewarm != NULL && prewarm_start(prewarm, PREWARM_THREADS, warm_object) == -1) {
+        warn("cannot start prewarm threads");
+    }
+    // Pinned last, so no thread started above inherits the dispatcher's CPU
+    if (dispatcher_cpu >= 0 && (errno = affinity_pin_cpu(dispatcher_cpu)) != 0) {
+        warn("cannot pin dispatcher to CPU %d", dispatcher_cpu);
     }
 
-    // Set up dispatcher thread
+    // Run the dispatcher until a shutdown signal or a successor takes the listener
+    bool handed_off = dispatch(&sock, sig_fd, handoff_fd);
+    close(sock.fd);
+    h2_shutdown(); // HTTP/2 connections finish their open streams and close
+
+    // Drain: the workers finish every queued connection, then find their queue closed
+    for (int q = 0; q < queue_count; q++) {
+        classq_close(queues[q]);
+    }
+    idle_stop(idle);
+    for (int i = 0; i < workers; i++) {
+        pthread_join(th[i], NULL);
+    }
+    if (green_carriers > 0) {
+        green_stop(); // returns once every green thread has finished its connection
+    }
+    h2_stop();
+    if (prewarm != NULL) {
+        if (prewarm_save(prewarm) == -1) {
+            warn("cannot save prewarm manifest %s", prewarm_path);
+        }
+        prewarm_delete(&prewarm); // stops warming before the store and caches go away
+    }
+    for (int q = 0; q < queue_count; q++) {
+        classq_delete(&queues[q]);
+    }
+    idle_delete(&idle);
+    pthread_mutex_destroy(&mut);
+    if (store != NULL) {
+        store_close(&store);
+    }
+    if (committer != NULL) {
+        committer_delete(&committer);
+    }
+    if (direct_threshold > 0) {
+        upload_stop();
+    }
+    flights_delete(&flights);
+    wheel_delete(&wheel);
+    if (tracer != NULL) {
+        tracer_delete(&tracer);
+    }
+    if (gzcache != NULL) {
+        gzcache_delete(&gzcache);
+    }
+    close(sig_fd);
+    if (handoff_fd != -1) {
+        close(handoff_fd);
+        if (!handed_off) {
+            unlink(restart_path); // the socket file now belongs to the successor otherwise
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+* dispatch() accepts connections and pushes them onto the shared queue
+* until SIGINT/SIGTERM arrives or a successor asks for the listener;
+* SIGUSR1 dumps the stats counters. Returns true if the listener was
+* handed to a successor.
+*/
+bool dispatch(Listener_Socket *sock, int sig_fd, int handoff_fd) {
+    struct pollfd fds[3] = {
+        { sock->fd, POLLIN, 0 },
+        { sig_fd, POLLIN, 0 },
+        { handoff_fd, POLLIN, 0 }, // ignored by poll when handoff_fd is -1
+    };
     while (1) {
-        // Accept a new connection
-        uintptr_t connfd = listener_accept(&sock);
-        // Push the connection into the queue
-        queue_push(new_q, (void *) connfd);
+        if (poll(fds, 3, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err(EXIT_FAILURE, "poll");
+        }
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(sig_fd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGUSR1) {
+                    dump_stats();
+                } else {
+                    return false; // Stop accepting and drain
+                }
+            }
+        }
+        if (fds[2].revents & POLLIN) {
+            if (restart_send(handoff_fd, sock->fd) == 0) {
+                return true; // The successor accepts from here on
+            }
+            warn("listener handoff failed");
+        }
+        if (fds[0].revents & POLLIN) {
+            // Accept a new connection
+            int connfd = listener_accept(sock);
+            if (connfd < 0) {
+                continue; // Taken by a successor sharing the listener, or aborted by the client
+            }
+            if (tracer != NULL) {
+                tracer_accepted(tracer, connfd); // the queue wait is traced from here
+            }
+            if (green_carriers > 0) {
+                // Start a green thread for it on the next carrier
+                if (green_spawn(connfd) == -1) {
+                    close(connfd);
+                }
+                continue;
+            }
+            enqueue(connfd);
+        }
     }
 }
 
+/*
+* enqueue() pushes a connection into the queue of its class at the place
+* of the CPU that received its packets, as the NIC's receive queue
+* steered them, so the worker serving it shares that CPU's caches. Other
+* connections are spread round robin, as is one whose queue is full.
+*/
+void enqueue(int connfd) {
+    static unsigned next = 0; // round-robin position, only used by the dispatcher
+    int cls = classify(connfd);
+    int q = 0;
+    if (queue_count > 1) {
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        int place = getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 ? affinity_place_of(cpu) : -1;
+        if (place >= 0) {
+            q = place % queue_count;
+            atomic_fetch_add(&steered, 1);
+        } else {
+            q = next++ % queue_count;
+        }
+        for (int i = 0; i < queue_count; i++) {
+            if (classq_try_push(queues[(q + i) % queue_count], cls, (void *) (uintptr_t) connfd)) {
+                idle_notify(idle, (q + i) % queue_count);
+                return;
+            }
+        }
+    }
+    // Push the connection into the queue of its class
+    if (classq_push(queues[q], cls, (void *) (uintptr_t) connfd)) {
+        idle_notify(idle, q);
+    }
+}
+
+/*
+* classify() picks the queue class of a new connection from a peek at
+* its head: an upload (PUT, PATCH, or APPEND) whose Content-Length is
+* at least bulk_bytes is bulk work, and anything else, including a head
+* that has not fully arrived, is interactive.
+*/
+int classify(int connfd) {
+    if (bulk_bytes == 0) {
+        return CLASS_INTERACTIVE;
+    }
+    char head[CLASSIFY_PEEK];
+    ssize_t n = recv(connfd, head, sizeof(head) - 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n <= 0) {
+        return CLASS_INTERACTIVE;
+    }
+    head[n] = '\0';
+    if (strstr(head, "\r\n\r\n") == NULL || head_is_method(head, "GET")) {
+        return CLASS_INTERACTIVE;
+    }
+    return head_content_length(head) >= bulk_bytes ? CLASS_BULK : CLASS_INTERACTIVE;
+}
+
+// Writes every enabled subsystem's counters to stderr as STATS lines
+void dump_stats(void) {
+    if (committer != NULL) {
+        committer_dump_stats(committer, stderr);
+    }
+    flights_dump_stats(flights, stderr);
+    wheel_dump_stats(wheel, stderr);
+    if (green_carriers == 0) {
+        for (int q = 0; q < queue_count; q++) {
+            classq_dump_stats(queues[q], q, stderr);
+        }
+        fprintf(stderr, "STATS,transfer,parks=%lu\n", atomic_load(&parks));
+        fprintf(stderr, "STATS,affinity,places=%d,queues=%d,steered=%lu,steals=%lu\n", place_count, queue_count,
+            atomic_load(&steered), atomic_load(&steals));
+        idle_dump_stats(idle, stderr);
+    }
+    fprintf(stderr, "STATS,timeout,header=%lu,idle=%lu,total=%lu\n", atomic_load(&timeouts[0]),
+        atomic_load(&timeouts[1]), atomic_load(&timeouts[2]));
+    if (green_carriers > 0) {
+        green_dump_stats(stderr);
+    }
+    if (tracer != NULL) {
+        tracer_dump_stats(tracer, stderr);
+    }
+    if (prewarm != NULL) {
+        prewarm_dump_stats(prewarm, stderr);
+    }
+    if (gzcache != NULL) {
+        fprintf(stderr, "STATS,gzip,precompressed=%lu,cached=%lu\n", atomic_load(&gzip_static),
+            atomic_load(&gzip_cached));
+        gzcache_dump_stats(gzcache, stderr);
+    }
+    lockprof_dump_stats(stderr); // only in builds with LOCKPROF
+}
+
 // Using starter code from resources
-void handle_connection(int connfd) {
-    conn_t *conn = conn_new(connfd);
+void handle_connection(conn_ctx_t *ctx) {
+    // Requests the library cannot parse are recognized from a peek at the head
+    uint64_t start = trace_now(&ctx->trace);
+    long wait_ms = header_ms > 0 ? header_ms : HEAD_WAIT_MS;
+    if (ctx->end_ms != 0 && (long) (ctx->end_ms - monotonic_ms()) < wait_ms) {
+        wait_ms = (long) (ctx->end_ms - monotonic_ms());
+    }
+    ssize_t head_len = peek_head(ctx->connfd, ctx->rbuf, PEEK_MAX, wait_ms);
+    trace_span(&ctx->trace, "head", start);
+    if (head_len == -1 && errno == ETIMEDOUT) {
+        // The wheel may not be timing the head, e.g. with -T 0:...; never wait on it forever
+        atomic_fetch_add(&timeouts[0], 1);
+        send_status(ctx->connfd, 408);
+        return;
+    }
+    if (head_len > 0) {
+        trace_head(&ctx->trace, ctx->rbuf);
+    }
+    if (head_len > 0 && (head_is_method(ctx->rbuf, "PRI") || h2_is_upgrade(ctx->rbuf))) {
+        // HTTP/2 times out idle connections and stalled streams itself. The wheel only catches a peer that
+        // stops reading, which blocks the connection's thread in a write; total_ms is for one request.
+        ctx->end_ms = 0;
+        conn_watch_body(ctx);
+        h2_serve(ctx->connfd, ctx->rbuf, head_len);
+        return;
+    }
+    if (head_len > 0) {
+        conn_watch_body(ctx);
+    }
+    // The library keeps only some headers, so content negotiation reads the peeked head
+    char encodings[256];
+    ctx->accepts_gzip = gzcache != NULL && head_len > 0
+        && head_header(ctx->rbuf, "Accept-Encoding", encodings, sizeof(encodings)) && gzip_accepted(encodings);
+    if (head_len > 0 && head_is_method(ctx->rbuf, "MGET")) {
+        handle_mget(ctx, head_len);
+        return;
+    }
+    if (head_len > 0 && (head_is_method(ctx->rbuf, "PATCH") || head_is_method(ctx->rbuf, "APPEND"))) {
+        handle_write(ctx, head_len, head_is_method(ctx->rbuf, "APPEND"));
+        return;
+    }
+    ctx->conn = conn_new(ctx->connfd);
+    conn_t *conn = ctx->conn;
+    start = trace_now(&ctx->trace);
     const Response_t *res = conn_parse(conn);
+    trace_span(&ctx->trace, "parse", start);
     if (res != NULL) {
         conn_send_response(conn, res);
     } else {
         debug("%s", conn_str(conn));
         const Request_t *req = conn_get_request(conn);
         if (req == &REQUEST_GET) {
-            handle_get(conn);
+            handle_get(ctx);
         } else if (req == &REQUEST_PUT) {
-            handle_put(conn);
+            handle_put(ctx);
         } else {
-            handle_unsupported(conn);
+            handle_unsupported(ctx);
         }
     }
-    conn_delete(&conn);
+    if (!ctx->xfer.parked) {
+        conn_delete(&ctx->conn); // a parked GET still needs it for its log line
+    }
     return;
 }
 
@@ -122,16 +751,427 @@ void handle_get_log(char *uri, int code, conn_t *conn, const Response_t *respons
     if (requestId == NULL) {
         requestId = "0"; // The requestID header was not found in the request
     }
-    fprintf(stderr, "GET,/%s,%d,%s\n", uri, code, requestId); // Log the error details
+    log_get("GET", uri, code, requestId); // Log the error details
+}
+
+/*
+* log_get() writes the log line of a GET and counts a successful one for
+* the prewarm manifest. Every GET ends here, from the directory or the
+* store, over HTTP/1.1 or HTTP/2, alone or in a batch, so all of them
+* are counted in one place.
+*/
+void log_get(const char *method, const char *uri, int code, const char *request_id) {
+    fprintf(stderr, "%s,/%s,%d,%s\n", method, uri, code, request_id);
+    if (prewarm != NULL && code == 200) {
+        prewarm_count(prewarm, uri);
+    }
 }
 
-void handle_get(conn_t *conn) {
+/*
+* send_file() writes a 200 response for size bytes of fd starting at
+* offset using the context's buffers: the head, with the extra header
+* lines in headers, and the first chunk of the file leave in one writev,
+* and transfer_run sends the remainder.
+* finish(ctx, res) completes the request once the body is out, with
+* res NULL, or has failed. If the transfer is parked, ctx->xfer.parked
+* is set on return and finish runs on whichever worker resumes it.
+*/
+void send_file(conn_ctx_t *ctx, int fd, off_t offset, off_t size, const char *headers,
+    void (*finish)(conn_ctx_t *, const Response_t *)) {
+    transfer_t *x = &ctx->xfer;
+    x->fd = fd;
+    x->end = offset + size;
+    x->start = trace_now(&ctx->trace);
+    x->finish = finish;
+    x->reopened = false;
+    int head_len = snprintf(
+        ctx->wbuf, CTX_WRITE_SIZE, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n%s\r\n", (long) size, headers);
+    ssize_t chunk = pread(fd, ctx->rbuf, size < CTX_READ_SIZE ? size : CTX_READ_SIZE, offset);
+    if (chunk < 0) {
+        finish(ctx, &RESPONSE_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    struct iovec iov[2] = { { ctx->wbuf, head_len }, { ctx->rbuf, chunk } };
+    if (writev_all(ctx->connfd, iov, 2) == -1) {
+        finish(ctx, &RESPONSE_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    x->offset = offset + chunk;
+    transfer_run(ctx);
+}
+
+/*
+* transfer_unlock() lets go of a GET's shared flock before it is parked,
+* so a PUT of the file never waits on a transfer that no worker may get
+* back to while workers are blocked on that PUT. The flock is shared
+* with the other GETs of its flight, so the first time the transfer
+* reopens the file, giving it an open file description of its own, and
+* notes what the file looks like. transfer_relock() locks it again on
+* resuming, without waiting, and checks that the file is unchanged.
+*/
+int transfer_unlock(transfer_t *x) {
+    if (x->reopened) {
+        return flock(x->fd, LOCK_UN);
+    }
+    char proc[32];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", x->fd);
+    int fd = open(proc, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(x->fd, &x->st) == -1) {
+        close(fd);
+        return -1;
+    }
+    close(x->fd); // drops this GET's share of the flock
+    x->fd = fd;
+    x->reopened = true;
+    return 0;
+}
+
+int transfer_relock(transfer_t *x) {
+    struct stat st;
+    if (flock(x->fd, LOCK_SH | LOCK_NB) == -1 || fstat(x->fd, &st) == -1) {
+        return -1; // being rewritten
+    }
+    bool same = st.st_ino == x->st.st_ino && st.st_size == x->st.st_size
+        && st.st_mtim.tv_sec == x->st.st_mtim.tv_sec && st.st_mtim.tv_nsec == x->st.st_mtim.tv_nsec
+        && st.st_ctim.tv_sec == x->st.st_ctim.tv_sec && st.st_ctim.tv_nsec == x->st.st_ctim.tv_nsec;
+    return same ? 0 : -1;
+}
+
+/*
+* transfer_run() sends the rest of a GET body with sendfile. With -F it
+* moves at most slice_bytes per turn, and once a turn is used up while
+* other work is waiting in the queue, it parks the transfer instead of
+* sending on, so a worker is never held by one large body while small
+* requests queue behind it. The worker queues the parked context after
+* unwinding, and a worker resumes it here in its turn. A file rewritten
+* while its transfer was parked fails the rest of the body.
+*/
+void transfer_run(conn_ctx_t *ctx) {
+    transfer_t *x = &ctx->xfer;
+    if (x->parked && x->locked && transfer_relock(x) == -1) {
+        x->parked = false;
+        x->finish(ctx, &RESPONSE_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    x->parked = false;
+    off_t turn_end = slice_bytes > 0 && x->end - x->offset > slice_bytes ? x->offset + slice_bytes : x->end;
+    while (x->offset < x->end) {
+        if (x->offset == turn_end) {
+            if (home_q != NULL && classq_waiting(home_q) && (!x->locked || transfer_unlock(x) == 0)) {
+                x->parked = true;
+                atomic_fetch_add(&parks, 1);
+                return;
+            }
+            turn_end = x->end - x->offset > slice_bytes ? x->offset + slice_bytes : x->end;
+        }
+        ssize_t sent = sendfile(ctx->connfd, x->fd, &x->offset, turn_end - x->offset);
+        if (sent <= 0) {
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            x->finish(ctx, &RESPONSE_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+    x->finish(ctx, NULL);
+}
+
+// send_status() writes a status response in the library's format, for requests it never parsed
+void send_status(int fd, int code) {
+    const char *message = status_message(code); // also the body, newline included
+    char response[128];
+    int n = snprintf(response, sizeof(response), "HTTP/1.1 %d %.*s\r\nContent-Length: %zu\r\n\r\n%s", code,
+        (int) strlen(message) - 1, message, strlen(message), message);
+    struct iovec iov = { response, n };
+    writev_all(fd, &iov, 1);
+}
+
+// discard_body() reads and drops a body that will not be used, so closing does not reset the connection
+void discard_body(conn_ctx_t *ctx, long length) {
+    while (length > 0) {
+        ssize_t rb = recv(ctx->connfd, ctx->rbuf, length < CTX_READ_SIZE ? length : CTX_READ_SIZE, 0);
+        if (rb <= 0 && !(rb == -1 && errno == EINTR)) {
+            return;
+        }
+        length -= rb > 0 ? rb : 0;
+    }
+}
+
+/*
+* handle_mget() serves a batch GET, which the library cannot parse:
+*
+*     MGET / HTTP/1.1
+*     Content-Length: <n>
+*
+*     /name1
+*     /name2
+*
+* Every object is looked up first, through the same single-flight open
+* as GET or the store index, so the framed 200 response can carry its
+* total length. Each item is then sent as "<status> <length> /<name>\r\n",
+* the body, and "\r\n"; a failed item has status 403, 404, or 500 and
+* no body.
+*/
+void handle_mget(conn_ctx_t *ctx, ssize_t head_len) {
+    char *head = ctx->rbuf;
+    char requestId[64] = "0";
+    head_header(head, "Request-Id", requestId, sizeof(requestId));
+    long length = head_content_length(head);
+
+    // Take the head off the socket, then read the list of names after it
+    char *body = ctx->rbuf + head_len;
+    bool ok = strncmp(head, "MGET / HTTP/1.1\r\n", 17) == 0 && length >= 0
+              && length < CTX_READ_SIZE - head_len;
+    ssize_t got = 0;
+    ok = ok && recv(ctx->connfd, ctx->rbuf, head_len, MSG_WAITALL) == head_len;
+    while (ok && got < length) {
+        ssize_t rb = recv(ctx->connfd, body + got, length - got, 0);
+        if (rb <= 0 && !(rb == -1 && errno == EINTR)) {
+            ok = false;
+        }
+        got += rb > 0 ? rb : 0;
+    }
+    body[ok ? length : 0] = '\0';
+
+    struct {
+        char *uri; // object name
+        int code; // item status
+        int fd; // descriptor to send from
+        off_t offset; // where the body starts in fd
+        off_t size; // body length
+        store_obj_t obj; // pinned store object, in store mode
+    } items[MGET_MAX];
+    int count = 0;
+    char *save = NULL;
+    for (char *line = strtok_r(body, "\r\n", &save); ok && line != NULL; line = strtok_r(NULL, "\r\n", &save)) {
+        if (count == MGET_MAX) {
+            ok = false; // too many names; nothing is sent
+            break;
+        }
+        if (*line == '/') {
+            line++;
+        }
+        items[count].uri = line;
+        items[count].fd = -1;
+        items[count].offset = 0;
+        items[count].size = 0;
+        size_t len = strlen(line);
+        if (len == 0 || len > 63
+            || strspn(line, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-") != len) {
+            items[count].code = 400;
+        } else if (store != NULL) {
+            items[count].code = store_lookup(store, line, &items[count].obj) == 0 ? 200 : 404;
+            if (items[count].code == 200) {
+                items[count].fd = items[count].obj.fd;
+                items[count].offset = items[count].obj.offset;
+                items[count].size = items[count].obj.length;
+            }
+        } else {
+            char path[LAYOUT_PATH_MAX];
+            layout_path(line, layout_levels, path);
+            items[count].fd = flights_open(flights, path, &items[count].size);
+            if (items[count].fd != -1) {
+                items[count].code = 200;
+            } else if (errno == EACCES || errno == EISDIR) {
+                items[count].code = 403;
+            } else if (errno == ENOENT) {
+                items[count].code = 404;
+            } else {
+                items[count].code = 500;
+            }
+        }
+        count++;
+    }
+
+    if (!ok) {
+        for (int i = 0; i < count; i++) {
+            if (store != NULL && items[i].code == 200) {
+                store_release(store, &items[i].obj);
+            } else if (items[i].fd != -1) {
+                close(items[i].fd);
+            }
+        }
+        send_status(ctx->connfd, 400);
+        fprintf(stderr, "MGET,/,400,%s\n", requestId);
+        return;
+    }
+
+    // Frame sizes are known up front, so the whole response has one Content-Length
+    off_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += snprintf(NULL, 0, "%d %ld /%s\r\n\r\n", items[i].code, (long) items[i].size, items[i].uri)
+                 + items[i].size;
+    }
+    int cork = 1;
+    setsockopt(ctx->connfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    int n = snprintf(ctx->wbuf, CTX_WRITE_SIZE, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n", (long) total);
+    for (int i = 0; i < count && ok; i++) {
+        // Each frame goes out with the CRLF that ends the previous body
+        n += snprintf(ctx->wbuf + n, CTX_WRITE_SIZE - n, "%s%d %ld /%s\r\n", i == 0 ? "" : "\r\n",
+            items[i].code, (long) items[i].size, items[i].uri);
+        struct iovec iov = { ctx->wbuf, n };
+        ok = writev_all(ctx->connfd, &iov, 1) == 0;
+        n = 0;
+        off_t offset = items[i].offset;
+        off_t end = offset + items[i].size;
+        while (ok && offset < end) {
+            ssize_t sent = sendfile(ctx->connfd, items[i].fd, &offset, end - offset);
+            if (sent <= 0 && !(sent == -1 && errno == EINTR)) {
+                ok = false;
+            }
+        }
+    }
+    if (ok && count > 0) {
+        struct iovec iov = { "\r\n", 2 };
+        writev_all(ctx->connfd, &iov, 1);
+    }
+    cork = 0;
+    setsockopt(ctx->connfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+    for (int i = 0; i < count; i++) {
+        if (store != NULL && items[i].code == 200) {
+            store_release(store, &items[i].obj);
+        } else if (items[i].fd != -1) {
+            close(items[i].fd);
+        }
+        log_get("MGET", items[i].uri, items[i].code, requestId);
+    }
+}
+
+/*
+* handle_write() serves the partial writes the library cannot parse:
+*
+*     PATCH /name HTTP/1.1            APPEND /name HTTP/1.1
+*     Content-Length: <n>             Content-Length: <n>
+*     Content-Range: bytes <a>-<b>/<total>
+*
+* PATCH overwrites bytes a..b of an existing file in place, under the
+* same exclusive flock as PUT; it may extend the file but not leave a
+* hole, and the total is not checked.
+* APPEND creates the file if needed and writes with O_APPEND. A body that
+* fits the read buffer goes out in one write, which O_APPEND places
+* atomically, so such appends share the lock with each other and with
+* GETs; only larger ones, written in pieces, take it exclusively.
+*/
+void handle_write(conn_ctx_t *ctx, ssize_t head_len, bool append) {
+    const char *method = append ? "APPEND" : "PATCH";
+    char *head = ctx->rbuf;
+    char requestId[64] = "0";
+    head_header(head, "Request-Id", requestId, sizeof(requestId));
+    char uri[64] = "";
+    long length = head_content_length(head);
+    long long first = 0, last = -1;
+    bool ok = head_uri(head, uri, sizeof(uri)) && length >= 0;
+    if (ok && !append) {
+        char range[64];
+        int used = 0;
+        ok = head_header(head, "Content-Range", range, sizeof(range))
+             && sscanf(range, "bytes %lld-%lld/%n", &first, &last, &used) == 2 && used > 0 && first >= 0
+             && last - first + 1 == length && length > 0;
+    }
+    // Take the head off the socket; the body is read below
+    ok = recv(ctx->connfd, ctx->rbuf, head_len, MSG_WAITALL) == head_len && ok;
+    int code = 400;
+    if (!ok || store != NULL) {
+        code = ok ? 501 : 400; // store records are immutable
+        discard_body(ctx, length);
+        send_status(ctx->connfd, code);
+        fprintf(stderr, "%s,/%s,%d,%s\n", method, uri, code, requestId);
+        return;
+    }
+
+    char path[LAYOUT_PATH_MAX];
+    layout_path(uri, layout_levels, path);
+    bool exclusive = !append || length > CTX_READ_SIZE;
+    bool existed = true;
+    int fd;
+    if (append) {
+        // Creation is serialized with PUT so exactly one writer reports 201
+        green_mutex_lock(&mut);
+        existed = access(path, F_OK) == 0;
+        fd = open(path, O_CREAT | O_WRONLY | O_APPEND, 0600);
+        if (fd < 0 && errno == ENOENT && layout_levels > 0 && layout_mkdirs(path, committer != NULL) == 0) {
+            fd = open(path, O_CREAT | O_WRONLY | O_APPEND, 0600);
+        }
+        green_mutex_unlock(&mut);
+        if (fd >= 0) {
+            flock(fd, exclusive ? LOCK_EX : LOCK_SH); // outside mut, which PUTs of other files need
+        }
+        if (fd >= 0 && !existed) {
+            flights_forget(flights, path);
+        }
+    } else {
+        fd = open(path, O_WRONLY);
+        if (fd >= 0) {
+            flock(fd, LOCK_EX);
+        }
+    }
+    if (fd >= 0 && gzcache != NULL) {
+        gzcache_forget(gzcache, path);
+    }
+    struct stat st;
+    long done = 0;
+    if (fd < 0) {
+        code = errno == ENOENT ? 404 : errno == EACCES || errno == EISDIR ? 403 : 500;
+    } else if (!append && (fstat(fd, &st) == -1 || first > st.st_size)) {
+        code = 400; // would leave a hole
+    } else if (!append && lseek(fd, first, SEEK_SET) == -1) {
+        code = 500;
+    } else {
+        // Stream the body through the read buffer, one write per buffer
+        code = existed ? 200 : 201;
+        while (done < length) {
+            long want = length - done < CTX_READ_SIZE ? length - done : CTX_READ_SIZE;
+            ssize_t rb = recv(ctx->connfd, ctx->rbuf, want, MSG_WAITALL);
+            if (rb <= 0) {
+                code = 400; // the client sent less than it promised
+                break;
+            }
+            // A shared append is one buffer and must land in one write, or it could interleave with another
+            struct iovec iov = { ctx->rbuf, rb };
+            if (exclusive ? writev_all(fd, &iov, 1) == -1 : write(fd, ctx->rbuf, rb) != rb) {
+                code = 500;
+                break;
+            }
+            done += rb;
+        }
+        char dir[LAYOUT_PATH_MAX];
+        layout_parent(path, dir);
+        if (code < 300 && committer != NULL && committer_sync(committer, fd, existed ? NULL : dir) == -1) {
+            code = 500;
+        }
+    }
+    if (done < length) {
+        discard_body(ctx, length - done);
+    }
+    send_status(ctx->connfd, code);
+    fprintf(stderr, "%s,/%s,%d,%s\n", method, uri, code, requestId);
+    if (fd >= 0) {
+        close(fd); // also drops the flock
+    }
+}
+
+void handle_get(conn_ctx_t *ctx) {
+    if (store != NULL) {
+        handle_store_get(ctx);
+        return;
+    }
+    conn_t *conn = ctx->conn;
     char *uri = conn_get_uri(conn);
+    char path[LAYOUT_PATH_MAX];
+    layout_path(uri, layout_levels, path);
     const Response_t *response = NULL;
-    int fd = open(uri, O_RDONLY);
+    // Open, lock in shared mode, and stat, sharing the work with concurrent GETs of the same file
+    off_t size = 0; //file size
+    uint64_t start = trace_now(&ctx->trace);
+    int fd = flights_open(flights, path, &size);
+    trace_span(&ctx->trace, "open", start); // with the shared flock, or the wait for the GET taking it
     int code;
     if (fd < 0) {
-        if (errno == EACCES) {
+        if (errno == EACCES || errno == EISDIR) {
             response = &RESPONSE_FORBIDDEN;
             code = 403; // Set response code for forbidden access
         } else if (errno == ENOENT) {
@@ -144,75 +1184,202 @@ void handle_get(conn_t *conn) {
         handle_get_log(uri, code, conn, response);
         return;
     }
-    // Lock the file in shared mode
-    if (flock(fd, LOCK_SH) == -1) {
-        response = &RESPONSE_INTERNAL_SERVER_ERROR;
-        code = 500; // Set response code for internal server error
-        handle_get_log(uri, code, conn, response);
-        close(fd);
+    if (ctx->accepts_gzip && send_gzip(ctx, uri, path, &fd, &size)) {
         return;
     }
-    // Using fstat to get file information
-    struct stat file_information;
-    if (fstat(fd, &file_information) == -1) {
-        response = &RESPONSE_INTERNAL_SERVER_ERROR;
-        code = 500; // Set response code for internal server error
-        handle_get_log(uri, code, conn, response);
-        close(fd);
-        return;
+    // Send file
+    ctx->xfer.locked = true;
+    send_file(ctx, fd, 0, size, gzcache != NULL ? VARY_HEADER : "", finish_get);
+}
+
+/*
+* send_gzip() answers a GET from a client that accepts gzip with the
+* file's gzip variant: a precompressed name.gz under GZIP_STATIC_DIR that
+* is at least as new as the file, or else the variant from the cache.
+* Either goes out through send_file like the file would, sliced under
+* -F. On a cache miss the file is compressed from a descriptor of its
+* own with the shared flock let go, so a PUT of it never waits on the
+* compression, and if no variant comes of it the file is locked again
+* and sent as it is now. It returns false, having sent nothing, when
+* the file is to go out as it is, with *fd and *size.
+*/
+bool send_gzip(conn_ctx_t *ctx, const char *uri, const char *path, int *fd, off_t *size) {
+    struct stat st;
+    if (fstat(*fd, &st) == -1) {
+        return false;
     }
-    off_t size = file_information.st_size; //file size
-    // Check if directory
-    if (S_ISDIR(file_information.st_mode)) {
-        response = &RESPONSE_FORBIDDEN;
-        code = 403; // Set response code for forbidden access
-        handle_get_log(uri, code, conn, response);
-        flock(fd, LOCK_UN);
+    char gz_path[sizeof(GZIP_STATIC_DIR) + LAYOUT_PATH_MAX + 3];
+    snprintf(gz_path, sizeof(gz_path), "%s/%s.gz", GZIP_STATIC_DIR, uri);
+    int gz = open(gz_path, O_RDONLY);
+    if (gz >= 0) {
+        struct stat gz_st;
+        if (fstat(gz, &gz_st) == 0 && S_ISREG(gz_st.st_mode)
+            && (gz_st.st_mtim.tv_sec > st.st_mtim.tv_sec
+                || (gz_st.st_mtim.tv_sec == st.st_mtim.tv_sec && gz_st.st_mtim.tv_nsec >= st.st_mtim.tv_nsec))) {
+            close(*fd);
+            atomic_fetch_add(&gzip_static, 1);
+            ctx->xfer.locked = false; // no client can rewrite it
+            send_file(ctx, gz, 0, gz_st.st_size, GZIP_HEADERS, finish_get);
+            return true;
+        }
+        close(gz); // older than the file, so made from a previous version of it
+    }
+    int variant = -1;
+    off_t len = 0;
+    uint64_t start = trace_now(&ctx->trace);
+    int rc = gzcache_get(gzcache, path, &st, &variant, &len);
+    if (rc == GZCACHE_MISS) {
+        // The flock is shared with the GETs of the flight, so reopen the file rather than unlock it
+        char proc[32];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", *fd);
+        int own = open(proc, O_RDONLY);
+        if (own >= 0) {
+            close(*fd); // drops this GET's share of the flock
+            *fd = own;
+        }
+        rc = gzcache_fill(gzcache, path, own, &st, &variant, &len) == 0 ? GZCACHE_HIT : GZCACHE_SKIP;
+        if (rc != GZCACHE_HIT && own >= 0) {
+            flock(own, LOCK_SH); // sent as it is after all, as it is now
+            if (fstat(own, &st) == 0) {
+                *size = st.st_size;
+            }
+        }
+    }
+    trace_span(&ctx->trace, "gzip", start);
+    if (rc != GZCACHE_HIT) {
+        return false;
+    }
+    close(*fd); // also drops the flock
+    atomic_fetch_add(&gzip_cached, 1);
+    ctx->xfer.locked = false; // a sealed memfd, never rewritten
+    send_file(ctx, variant, 0, len, GZIP_HEADERS, finish_get);
+    return true;
+}
+
+/*
+* warm_object() warms one object of the prewarm manifest before clients
+* ask for it. In the store it asks the kernel to read the object's
+* record range ahead. From the directory, the open and fstat bring its
+* directory entries and inode into memory, readahead is started on its
+* pages under the same shared flock a GET takes, and with -z its gzip
+* variant is made, with the flock let go, unless a precompressed one
+* would be sent instead.
+* It returns -1 if the object is not there.
+*/
+int warm_object(const char *name) {
+    if (store != NULL) {
+        store_obj_t obj;
+        if (store_lookup(store, name, &obj) != 0) {
+            return -1;
+        }
+        posix_fadvise(obj.fd, obj.offset, obj.length, POSIX_FADV_WILLNEED);
+        store_release(store, &obj);
+        return 0;
+    }
+    char path[LAYOUT_PATH_MAX];
+    layout_path(name, layout_levels, path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    flock(fd, LOCK_SH); // not while a PUT is rewriting it
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
         close(fd);
-        return;
+        return -1;
     }
-    // Send file
-    response = conn_send_file(conn, fd, size);
-    char *requestId = conn_get_header(conn, "Request-Id");
+    posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+    char gz_path[sizeof(GZIP_STATIC_DIR) + LAYOUT_PATH_MAX + 3];
+    snprintf(gz_path, sizeof(gz_path), "%s/%s.gz", GZIP_STATIC_DIR, name);
+    int variant = -1;
+    off_t len = 0;
+    if (gzcache != NULL && access(gz_path, F_OK) == -1
+        && gzcache_get(gzcache, path, &st, &variant, &len) == GZCACHE_MISS) {
+        flock(fd, LOCK_UN); // its own description, so a PUT need not wait on the compression
+        gzcache_fill(gzcache, path, fd, &st, &variant, &len);
+    }
+    if (variant >= 0) {
+        close(variant);
+    }
+    close(fd); // also drops the flock
+    return 0;
+}
+
+// Completes a GET from the directory once its body is sent
+void finish_get(conn_ctx_t *ctx, const Response_t *res) {
+    trace_span(&ctx->trace, "send", ctx->xfer.start);
+    char *requestId = conn_get_header(ctx->conn, "Request-Id");
     if (requestId == NULL) {
         requestId = "0"; // The requestID header was not found in the request
     }
-    fprintf(stderr, "GET,/%s,200,%s\n", uri, requestId); // Print successful GET request to stderr
-    // Unlock and close the file
-    flock(fd, LOCK_UN);
-    close(fd);
-    return;
+    // The 200 head is already out, but a body that failed is logged as 500, as from the store
+    log_get("GET", conn_get_uri(ctx->conn), res == NULL ? 200 : 500, requestId);
+    // Closing unlocks the file once every GET sharing the lock is done
+    close(ctx->xfer.fd);
 }
 
-void handle_put(conn_t *conn) {
+void handle_put(conn_ctx_t *ctx) {
+    if (store != NULL) {
+        handle_store_put(ctx);
+        return;
+    }
+    conn_t *conn = ctx->conn;
     char *uri = conn_get_uri(conn);
+    char path[LAYOUT_PATH_MAX];
+    layout_path(uri, layout_levels, path);
     // Check for if file exists
-    bool file_exists = access(uri, F_OK) == 0;
+    bool file_exists = access(path, F_OK) == 0;
 
     // Acquire the mutex lock to enter the critical region
-    pthread_mutex_lock(&mut);
+    uint64_t start = trace_now(&ctx->trace);
+    green_mutex_lock(&mut);
+    trace_span(&ctx->trace, "mutex", start);
 
     const Response_t *response = NULL;
     // Create/Open File
-    int fd = open(uri, O_CREAT | O_WRONLY, 0600);
+    start = trace_now(&ctx->trace);
+    int fd = open(path, O_CREAT | O_WRONLY, 0600);
+    if (fd < 0 && errno == ENOENT && layout_levels > 0 && layout_mkdirs(path, committer != NULL) == 0) {
+        fd = open(path, O_CREAT | O_WRONLY, 0600); // First object in its subdirectory
+    }
+    trace_span(&ctx->trace, "open", start);
     if (fd < 0) {
         // Check for specific error conditions
         if (errno == EACCES || errno == EISDIR || errno == ENOENT) {
             response = &RESPONSE_FORBIDDEN;
+            green_mutex_unlock(&mut);
             goto send_response; // Jump to the send_response label
         } else {
             response = &RESPONSE_INTERNAL_SERVER_ERROR;
+            green_mutex_unlock(&mut);
             goto send_response; // Jump to the send_response label
         }
     }
-    flock(fd, LOCK_EX);
-
     // Release the mutex lock to exit the critical region
-    pthread_mutex_unlock(&mut);
+    green_mutex_unlock(&mut);
+
+    // Wait for the file's readers and writers outside mut, so PUTs of other files are not held up
+    start = trace_now(&ctx->trace);
+    flock(fd, LOCK_EX);
+    trace_span(&ctx->trace, "flock", start);
+    flights_forget(flights, path); // GETs must not keep answering 404 from memory
+    if (gzcache != NULL) {
+        gzcache_forget(gzcache, path); // nor gzip the old contents
+    }
 
     ftruncate(fd, 0); // Truncate the file to size 0
-    response = conn_recv_file(conn, fd);
-    if (response == NULL && file_exists) {
+    char dir[LAYOUT_PATH_MAX];
+    layout_parent(path, dir);
+    uint64_t length = strtoull(conn_get_header(conn, "Content-Length"), NULL, 10);
+    start = trace_now(&ctx->trace);
+    response = upload_recv(conn, fd, length, direct_threshold);
+    trace_span(&ctx->trace, "body", start);
+    start = trace_now(&ctx->trace);
+    if (response == NULL && atomic_load(&ctx->expired)) {
+        response = &RESPONSE_BAD_REQUEST; // the body ended because the client stalled
+    } else if (response == NULL && committer != NULL && committer_sync(committer, fd, file_exists ? NULL : dir) == -1) {
+        response = &RESPONSE_INTERNAL_SERVER_ERROR; // The upload could not be made durable
+    } else if (response == NULL && file_exists) {
         response
             = &RESPONSE_OK; // If response is NULL and file existed, set response to RESPONSE_OK
         //goto send_response;
@@ -224,8 +1391,13 @@ void handle_put(conn_t *conn) {
         response
             = &RESPONSE_INTERNAL_SERVER_ERROR; // If none of the above conditions are met, set response to RESPONSE_INTERNAL_SERVER_ERROR
     }
+    if (committer != NULL) {
+        trace_span(&ctx->trace, "sync", start);
+    }
 send_response:
+    start = trace_now(&ctx->trace);
     conn_send_response(conn, response);
+    trace_span(&ctx->trace, "send", start);
     char *requestId = conn_get_header(conn, "Request-Id");
     if (requestId == NULL) {
         requestId = "0"; // The requestID header was not found in the request
@@ -237,15 +1409,190 @@ send_response:
         code = 201;
     } else if (response == &RESPONSE_FORBIDDEN) {
         code = 403;
+    } else if (response == &RESPONSE_BAD_REQUEST) {
+        code = 400;
     } else {
         code = 500;
     }
     fprintf(stderr, "PUT,/%s,%d,%s\n", uri, code, requestId);
-    flock(fd, LOCK_UN); // Unlock the file
-    close(fd);
+    if (fd != -1) {
+        flock(fd, LOCK_UN); // Unlock the file
+        close(fd);
+    }
+}
+
+// GET served from the object store; readers never block on writers
+void handle_store_get(conn_ctx_t *ctx) {
+    conn_t *conn = ctx->conn;
+    char *uri = conn_get_uri(conn);
+    store_obj_t obj;
+    uint64_t start = trace_now(&ctx->trace);
+    int found = store_lookup(store, uri, &obj);
+    trace_span(&ctx->trace, "open", start);
+    if (found == -1) {
+        handle_get_log(uri, 404, conn, &RESPONSE_NOT_FOUND);
+        return;
+    }
+    ctx->xfer.obj = obj; // pinned until the body is sent
+    send_file(ctx, obj.fd, obj.offset, obj.length, "", finish_store_get);
+}
+
+// Completes a GET from the object store once its body is sent
+void finish_store_get(conn_ctx_t *ctx, const Response_t *res) {
+    trace_span(&ctx->trace, "send", ctx->xfer.start);
+    store_release(store, &ctx->xfer.obj);
+    char *requestId = conn_get_header(ctx->conn, "Request-Id");
+    if (requestId == NULL) {
+        requestId = "0"; // The requestID header was not found in the request
+    }
+    log_get("GET", conn_get_uri(ctx->conn), res == NULL ? 200 : 500, requestId);
 }
 
-void handle_unsupported(conn_t *conn) {
+// PUT into the object store; the new version becomes visible when committed
+void handle_store_put(conn_ctx_t *ctx) {
+    conn_t *conn = ctx->conn;
+    char *uri = conn_get_uri(conn);
+    uint64_t length = strtoull(conn_get_header(conn, "Content-Length"), NULL, 10);
+    const Response_t *response = &RESPONSE_INTERNAL_SERVER_ERROR;
+    store_txn_t txn;
+    uint64_t start = trace_now(&ctx->trace);
+    int begun = store_begin(store, uri, length, &txn);
+    trace_span(&ctx->trace, "open", start);
+    if (begun == 0) {
+        bool existed = false;
+        start = trace_now(&ctx->trace);
+        bool received = conn_recv_file(conn, txn.fd) == NULL;
+        trace_span(&ctx->trace, "body", start);
+        // In durable mode the body is synced before the commit marker and the marker after it,
+        // so a crash can never leave a committed record with a torn body
+        start = trace_now(&ctx->trace);
+        if (received && !atomic_load(&ctx->expired)
+            && (committer == NULL || committer_sync(committer, txn.fd, NULL) == 0)
+            && store_commit(store, &txn, &existed) == 0
+            && (committer == NULL || committer_sync(committer, txn.fd, NULL) == 0)) {
+            response = existed ? &RESPONSE_OK : &RESPONSE_CREATED;
+        }
+        store_finish(store, &txn);
+        trace_span(&ctx->trace, "commit", start);
+    }
+    if (atomic_load(&ctx->expired)) {
+        response = &RESPONSE_BAD_REQUEST; // the body ended because the client stalled
+    }
+    start = trace_now(&ctx->trace);
+    conn_send_response(conn, response);
+    trace_span(&ctx->trace, "send", start);
+    char *requestId = conn_get_header(conn, "Request-Id");
+    if (requestId == NULL) {
+        requestId = "0"; // The requestID header was not found in the request
+    }
+    fprintf(stderr, "PUT,/%s,%d,%s\n", uri, response_get_code(response), requestId);
+}
+
+// What an HTTP/2 request holds on to between begin and finish
+typedef struct {
+    bool existed; // PUT: the file was there before
+    char dir[LAYOUT_PATH_MAX]; // PUT: directory the file is in
+    store_obj_t obj; // store GET: the pinned object
+    store_txn_t txn; // store PUT: the reserved record
+} h2_state_t;
+
+// Opens the object of an HTTP/2 stream; the same steps as handle_get and handle_put
+void h2_begin(h2_request_t *req) {
+    h2_state_t *state = calloc(1, sizeof(h2_state_t));
+    req->state = state;
+    if (state == NULL) {
+        req->code = 500;
+        return;
+    }
+    if (store != NULL) {
+        if (!req->put) {
+            req->code = store_lookup(store, req->uri, &state->obj) == 0 ? 200 : 404;
+            req->fd = req->code == 200 ? state->obj.fd : -1;
+            req->offset = state->obj.offset;
+            req->size = state->obj.length;
+        } else if (req->content_length < 0) {
+            req->code = 400; // the record is reserved at its final size
+        } else if (store_begin(store, req->uri, req->content_length, &state->txn) == 0) {
+            req->fd = state->txn.fd;
+            req->offset = state->txn.offset;
+        } else {
+            req->code = 500;
+        }
+        return;
+    }
+
+    char path[LAYOUT_PATH_MAX];
+    layout_path(req->uri, layout_levels, path);
+    if (!req->put) {
+        req->fd = flights_open(flights, path, &req->size);
+        if (req->fd >= 0) {
+            req->code = 200;
+        } else if (errno == EACCES || errno == EISDIR) {
+            req->code = 403;
+        } else {
+            req->code = errno == ENOENT ? 404 : 500;
+        }
+        return;
+    }
+
+    state->existed = access(path, F_OK) == 0;
+    green_mutex_lock(&mut);
+    req->fd = open(path, O_CREAT | O_WRONLY, 0600);
+    if (req->fd < 0 && errno == ENOENT && layout_levels > 0 && layout_mkdirs(path, committer != NULL) == 0) {
+        req->fd = open(path, O_CREAT | O_WRONLY, 0600);
+    }
+    if (req->fd < 0) {
+        req->code = errno == EACCES || errno == EISDIR || errno == ENOENT ? 403 : 500;
+        green_mutex_unlock(&mut);
+        return;
+    }
+    green_mutex_unlock(&mut);
+    flock(req->fd, LOCK_EX);
+    flights_forget(flights, path);
+    if (gzcache != NULL) {
+        gzcache_forget(gzcache, path);
+    }
+    if (ftruncate(req->fd, 0) == -1) {
+        req->code = 500;
+    }
+    layout_parent(path, state->dir);
+}
+
+// Commits or releases an HTTP/2 stream's object and logs the request
+void h2_finish(h2_request_t *req) {
+    h2_state_t *state = req->state;
+    if (req->put && req->code == 0) {
+        req->code = 500;
+        if (store != NULL) {
+            bool existed = false;
+            if ((committer == NULL || committer_sync(committer, req->fd, NULL) == 0)
+                && store_commit(store, &state->txn, &existed) == 0
+                && (committer == NULL || committer_sync(committer, req->fd, NULL) == 0)) {
+                req->code = existed ? 200 : 201;
+            }
+        } else if (committer == NULL || committer_sync(committer, req->fd, state->existed ? NULL : state->dir) == 0) {
+            req->code = state->existed ? 200 : 201;
+        }
+    }
+    if (store != NULL && req->fd >= 0) {
+        if (req->put) {
+            store_finish(store, &state->txn); // also drops a record that was never committed
+        } else {
+            store_release(store, &state->obj);
+        }
+    } else if (req->fd >= 0) {
+        close(req->fd); // also drops the flock
+    }
+    free(state);
+    if (req->put) {
+        fprintf(stderr, "%s,/%s,%d,%s\n", req->method, req->uri, req->code, req->request_id);
+    } else {
+        log_get(req->method, req->uri, req->code, req->request_id);
+    }
+}
+
+void handle_unsupported(conn_ctx_t *ctx) {
+    conn_t *conn = ctx->conn;
     conn_send_response(conn, &RESPONSE_NOT_IMPLEMENTED);
     char *requestId = conn_get_header(conn, "Request-Id");
     if (requestId == NULL) {
@@ -258,16 +1605,233 @@ void handle_unsupported(conn_t *conn) {
 * process_connection() is responsible for handling incoming client 
 * connections. It retrieves a connection from the shared queue, 
 * processes it, and closes the connection, allowing the server to 
-* handle multiple connections concurrently. 
+* handle multiple connections concurrently. Each worker recycles
+* connection contexts through its own pool. With -a, worker arg is
+* pinned to its place before the pool allocates anything, so its
+* buffers live on that place's node, and it takes from its place's
+* queue, helping itself to another's only when its own is empty.
 */
-void *process_connection() {
+void *process_connection(void *arg) {
+    int worker = (int) (intptr_t) arg;
+    if (place_count > 0 && (errno = affinity_pin_place(worker % place_count)) != 0) {
+        warn("cannot pin worker %d", worker);
+    }
+    int home = worker % queue_count;
+    home_q = queues[home];
+    pool_t *pool = pool_new(POOL_CAPACITY);
+    if (pool == NULL) {
+        err(EXIT_FAILURE, "pool_new");
+    }
+    void *elem = NULL;
+    int cls = 0;
+    // Get connections, or parked transfers to resume, until the home queue is closed and drained
     while (true) {
-        // Get the connection file descriptor from the queue
-        uintptr_t cfd = -1;
-        queue_pop(new_q, (void **) &cfd);
-        // Process the connection
-        handle_connection(cfd);
+        int from = worker_take(home, &elem, &cls);
+        if (from == -1) {
+            // Announce the sleep, then look once more, so a push in between is not missed
+            uint64_t key = idle_prepare(idle, home);
+            from = worker_take(home, &elem, &cls);
+            if (from != -1) {
+                idle_cancel(idle, home);
+            } else if (idle_wait(idle, home, key)) {
+                continue;
+            } else if (classq_pop(home_q, &elem, &cls)) {
+                from = home; // stopping: drain what the home queue still holds back
+            } else {
+                break;
+            }
+        }
+        conn_ctx_t *ctx = NULL;
+        if (cls == CLASS_TRANSFER) {
+            ctx = elem;
+            green_watch(&ctx->activity);
+            transfer_run(ctx);
+        } else {
+            int cfd = (int) (uintptr_t) elem;
+            // Process the connection
+            ctx = pool_get(pool, cfd);
+            if (ctx == NULL) {
+                close(cfd);
+                worker_done(from, cls);
+                continue;
+            }
+            trace_begin(tracer, &ctx->trace, cfd);
+            conn_watch(ctx);
+            handle_connection(ctx);
+        }
+        worker_done(from, cls);
+        // A parked transfer waits its turn at this worker's place; it is sent on here if the queue has no room for it.
+        // Once queued, another worker may already be resuming it, so ctx is not touched again.
+        bool queued = false;
+        while (ctx->xfer.parked && !(queued = classq_try_push(home_q, CLASS_TRANSFER, ctx))) {
+            transfer_run(ctx);
+        }
+        if (queued) {
+            idle_notify(idle, home);
+            green_watch(NULL); // its timeouts stay armed while it waits
+            continue;
+        }
+        int cfd = ctx->connfd;
+        conn_unwatch(ctx);
+        trace_end(tracer, &ctx->trace);
+        pool_put(pool, ctx);
         // Close the connection
         close(cfd);
     }
+    pool_delete(&pool);
+    return NULL;
+}
+
+/*
+* Takes work for a worker of the home place: from its own queue, or else
+* from another place's.  Returns the queue taken from, or -1 if all are
+* empty.
+*/
+int worker_take(int home, void **elem, int *cls) {
+    for (int i = 0; i < queue_count; i++) {
+        int q = (home + i) % queue_count;
+        if (classq_try_pop(queues[q], elem, cls)) {
+            if (i > 0) {
+                atomic_fetch_add(&steals, 1);
+            }
+            return q;
+        }
+    }
+    return -1;
+}
+
+/*
+* Reports work taken from a queue as done.  A bulk upload held back by
+* the class limit may be takeable now, so a sleeping worker is woken for
+* it.
+*/
+void worker_done(int q, int cls) {
+    classq_done(queues[q], cls);
+    if (cls == CLASS_BULK) {
+        idle_notify(idle, q);
+    }
+}
+
+/*
+* The carrier_* functions are the green thread handlers: each carrier
+* thread keeps its own context pool, shared by the connections it runs,
+* which never move to another carrier.
+*/
+void *carrier_start(void) {
+    static atomic_int carriers = 0; // carriers started, to spread them over the places
+    int carrier = atomic_fetch_add(&carriers, 1);
+    if (place_count > 0 && (errno = affinity_pin_place(carrier % place_count)) != 0) {
+        warn("cannot pin carrier %d", carrier);
+    }
+    pool_t *pool = pool_new(POOL_CAPACITY);
+    if (pool == NULL) {
+        err(EXIT_FAILURE, "pool_new");
+    }
+    return pool;
+}
+
+void carrier_serve(void *pool, int connfd) {
+    conn_ctx_t *ctx = pool_get(pool, connfd);
+    if (ctx != NULL) {
+        trace_begin(tracer, &ctx->trace, connfd);
+        conn_watch(ctx);
+        handle_connection(ctx);
+        conn_unwatch(ctx);
+        trace_end(tracer, &ctx->trace);
+        pool_put(pool, ctx);
+    }
+    close(connfd);
+}
+
+void carrier_stop(void *pool) {
+    pool_delete((pool_t **) &pool);
+}
+
+/*
+* Connection timeouts. A connection gets header_ms to deliver its
+* request head, then may wait on its client for at most idle_ms at a
+* time, all within total_ms. One deadline on the timing wheel covers
+* whichever comes first. When it passes, the wheel thread shuts the
+* socket down, which wakes the worker or green thread blocked on it.
+* An idle deadline only closes a connection that is blocked on its
+* client and has not moved a byte since the deadline was armed; one
+* held up by the server itself, e.g. waiting for a lock, is given more
+* time.
+*/
+long conn_expired(void *arg) {
+    conn_ctx_t *ctx = arg;
+    uint64_t now = monotonic_ms();
+    int reason = 2; // total
+    if (ctx->end_ms == 0 || now < ctx->end_ms) {
+        reason = ctx->in_body ? 1 : 0;
+        uint64_t moved = atomic_load(&ctx->activity.moved);
+        if (ctx->in_body && (!atomic_load(&ctx->activity.blocked) || moved != ctx->idle_moved)) {
+            ctx->idle_moved = moved;
+            long ms = idle_ms > 0 ? idle_ms : (long) (ctx->end_ms - now);
+            if (ctx->end_ms != 0 && ctx->end_ms - now < (uint64_t) ms) {
+                ms = ctx->end_ms - now;
+            }
+            return ms;
+        }
+    }
+    atomic_fetch_add(&timeouts[reason], 1);
+    atomic_store(&ctx->expired, true);
+    shutdown(ctx->connfd, SHUT_RDWR);
+    return 0;
+}
+
+// function to arm the first of two limits that are enabled (nonzero)
+static void conn_arm(conn_ctx_t *ctx, long ms) {
+    if (ctx->end_ms != 0) {
+        long left = (long) (ctx->end_ms - monotonic_ms());
+        ms = ms == 0 || left < ms ? (left > 0 ? left : 1) : ms;
+    }
+    if (ms > 0) {
+        wheel_arm(wheel, &ctx->deadline, ms);
+    }
+}
+
+// Starts the header timeout of a new connection
+void conn_watch(conn_ctx_t *ctx) {
+    ctx->activity.fd = ctx->connfd;
+    atomic_store(&ctx->activity.blocked, false);
+    atomic_store(&ctx->activity.moved, 0);
+    green_watch(&ctx->activity);
+    ctx->deadline.armed = false;
+    ctx->deadline.fire = conn_expired;
+    ctx->deadline.arg = ctx;
+    ctx->in_body = false;
+    atomic_store(&ctx->expired, false);
+    ctx->end_ms = total_ms > 0 ? monotonic_ms() + total_ms : 0;
+    if (idle_ms > 0) {
+        // The idle timeout replaces the socket timeout set by listener_accept
+        struct timeval none = { 0, 0 };
+        setsockopt(ctx->connfd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    }
+    conn_arm(ctx, header_ms);
+}
+
+// Switches a connection whose head is in to the idle timeout
+void conn_watch_body(conn_ctx_t *ctx) {
+    wheel_cancel(wheel, &ctx->deadline);
+    ctx->in_body = true;
+    ctx->idle_moved = atomic_load(&ctx->activity.moved);
+    conn_arm(ctx, idle_ms);
+}
+
+// Stops timing a connection; its socket may be closed once this returns
+void conn_unwatch(conn_ctx_t *ctx) {
+    wheel_cancel(wheel, &ctx->deadline);
+    green_watch(NULL);
+}
+
+// Names a sampled request's trace after its request line and Request-Id
+void trace_head(trace_req_t *req, const char *head) {
+    if (!req->sampled) {
+        return;
+    }
+    char uri[64];
+    int method = strcspn(head, " \r\n");
+    snprintf(req->what, sizeof(req->what), "%.*s /%s", method, head, head_uri(head, uri, sizeof(uri)) ? uri : "");
+    head_header(head, "Request-Id", req->id, sizeof(req->id));
 }
@@ -0,0 +1,146 @@
+#include "idle.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+typedef struct Idle {
+    pthread_mutex_t lock; // guards everything but announced
+    atomic_int announced; // workers between idle_prepare and leaving idle_wait or idle_cancel
+    uint64_t epoch; // bumped by every idle_notify that found a worker announced
+    bool stopped; // idle_stop was called
+    int places; // places in use
+    int *waiting; // per place, workers announced there
+    int *woken; // per place, of those, the ones signaled and not yet gone, so the next push wakes another
+    pthread_cond_t *wake; // per place, signaled to wake one of its workers
+    uint64_t sleeps; // times a worker went to sleep
+    uint64_t wakeups; // workers woken at the place the work was pushed
+    uint64_t remote; // workers woken at another place
+} idle_t;
+
+// function to create the sleeping places
+idle_t *idle_new(int places) {
+    if (places < 1) {
+        return NULL;
+    }
+    idle_t *w = calloc(1, sizeof(idle_t));
+    if (w == NULL) {
+        return NULL;
+    }
+    w->waiting = calloc(places, sizeof(int));
+    w->woken = calloc(places, sizeof(int));
+    w->wake = calloc(places, sizeof(pthread_cond_t));
+    if (w->waiting == NULL || w->woken == NULL || w->wake == NULL) {
+        free(w->waiting);
+        free(w->woken);
+        free(w->wake);
+        free(w);
+        return NULL;
+    }
+    w->places = places;
+    for (int p = 0; p < places; p++) {
+        pthread_cond_init(&w->wake[p], NULL);
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    return w;
+}
+
+// function to free the sleeping places
+void idle_delete(idle_t **w) {
+    if (w == NULL || *w == NULL) {
+        return;
+    }
+    for (int p = 0; p < (*w)->places; p++) {
+        pthread_cond_destroy(&(*w)->wake[p]);
+    }
+    pthread_mutex_destroy(&(*w)->lock);
+    free((*w)->waiting);
+    free((*w)->woken);
+    free((*w)->wake);
+    free(*w);
+    *w = NULL;
+}
+
+// function to announce a worker about to sleep
+uint64_t idle_prepare(idle_t *w, int place) {
+    pthread_mutex_lock(&w->lock);
+    w->waiting[place]++;
+    atomic_fetch_add(&w->announced, 1);
+    uint64_t key = w->epoch;
+    pthread_mutex_unlock(&w->lock);
+    return key;
+}
+
+// function to take a worker off its place; the idle_t is locked
+static void leave(idle_t *w, int place) {
+    w->waiting[place]--;
+    if (w->woken[place] > 0) {
+        w->woken[place]--; // a wakeup is used up by whichever worker of the place leaves first
+    }
+    atomic_fetch_sub(&w->announced, 1);
+}
+
+// function to withdraw an announcement
+void idle_cancel(idle_t *w, int place) {
+    pthread_mutex_lock(&w->lock);
+    leave(w, place);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// function to sleep until work is pushed
+bool idle_wait(idle_t *w, int place, uint64_t key) {
+    pthread_mutex_lock(&w->lock);
+    if (w->epoch == key && !w->stopped) {
+        w->sleeps++;
+        do {
+            pthread_cond_wait(&w->wake[place], &w->lock);
+        } while (w->epoch == key && !w->stopped);
+    }
+    leave(w, place);
+    bool running = !w->stopped;
+    pthread_mutex_unlock(&w->lock);
+    return running;
+}
+
+// function to wake a worker for work pushed at a place
+void idle_notify(idle_t *w, int place) {
+    // Orders the push before the load: a worker announced after it will find the work when it looks again
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&w->announced) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    w->epoch++;
+    for (int i = 0; i < w->places; i++) {
+        int p = (place + i) % w->places;
+        if (w->waiting[p] > w->woken[p]) {
+            w->woken[p]++;
+            pthread_cond_signal(&w->wake[p]);
+            if (i == 0) {
+                w->wakeups++;
+            } else {
+                w->remote++;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+// function to wake every worker for good
+void idle_stop(idle_t *w) {
+    pthread_mutex_lock(&w->lock);
+    w->stopped = true;
+    for (int p = 0; p < w->places; p++) {
+        pthread_cond_broadcast(&w->wake[p]);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+// function to report the counters
+void idle_dump_stats(idle_t *w, FILE *out) {
+    pthread_mutex_lock(&w->lock);
+    fprintf(out, "STATS,idle,sleeps=%lu,wakeups=%lu,remote=%lu\n", (unsigned long) w->sleeps,
+        (unsigned long) w->wakeups, (unsigned long) w->remote);
+    pthread_mutex_unlock(&w->lock);
+}
@@ -0,0 +1,92 @@
+/**
+ * @File idle.h
+ *
+ * Where idle workers sleep when every queue is empty.  Workers of each
+ * place sleep apart, and a push of work to a place wakes one of that
+ * place's workers, or a worker of another place when none of its own is
+ * asleep, so work never waits at a busy place while workers elsewhere
+ * sleep.  An eventcount closes the race with a worker that is just
+ * going to sleep: it announces itself with idle_prepare, looks at the
+ * queues once more, and only sleeps if nothing was pushed since.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct Idle idle_t;
+
+/** @brief Dynamically allocates the sleeping places for workers.
+ *
+ *  @param places the number of places, at least 1
+ *
+ *  @return a pointer to a new idle_t, or NULL if allocation failed
+ */
+idle_t *idle_new(int places);
+
+/** @brief Frees the sleeping places and sets *w to NULL.  No worker may
+ *         still be asleep.
+ *
+ *  @param w the idle_t to be deleted
+ */
+void idle_delete(idle_t **w);
+
+/** @brief Announces that the calling worker found no work and is about
+ *         to sleep.  It must look for work once more before calling
+ *         idle_wait, or idle_cancel if it finds some.
+ *
+ *  @param w the idle_t
+ *
+ *  @param place the worker's place
+ *
+ *  @return the key to pass to idle_wait
+ */
+uint64_t idle_prepare(idle_t *w, int place);
+
+/** @brief Withdraws an idle_prepare after finding work.
+ *
+ *  @param w the idle_t
+ *
+ *  @param place the worker's place
+ */
+void idle_cancel(idle_t *w, int place);
+
+/** @brief Sleeps until work is pushed after the idle_prepare that gave
+ *         key, returning at once if some already was.
+ *
+ *  @param w the idle_t
+ *
+ *  @param place the worker's place
+ *
+ *  @param key from idle_prepare
+ *
+ *  @return true, or false once idle_stop was called
+ */
+bool idle_wait(idle_t *w, int place, uint64_t key);
+
+/** @brief Reports work pushed at a place, waking one sleeping worker of
+ *         that place, or else of another.  Costs a fence and a load when
+ *         no worker is asleep.
+ *
+ *  @param w the idle_t
+ *
+ *  @param place where the work was pushed
+ */
+void idle_notify(idle_t *w, int place);
+
+/** @brief Wakes every worker, and makes idle_wait return false from now
+ *         on.
+ *
+ *  @param w the idle_t
+ */
+void idle_stop(idle_t *w);
+
+/** @brief Writes a STATS line with the sleep and wakeup counters.
+ *
+ *  @param w the idle_t
+ *
+ *  @param out the stream to write to
+ */
+void idle_dump_stats(idle_t *w, FILE *out);
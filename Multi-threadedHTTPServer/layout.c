@@ -0,0 +1,101 @@
+#define _GNU_SOURCE // syncfs
+
+#include "layout.h"
+
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// function to map an object name to its path
+void layout_path(const char *name, int levels, char *path) {
+    uint32_t h = fnv1a(name);
+    int n = 0;
+    for (int i = 0; i < levels; i++) {
+        n += snprintf(path + n, LAYOUT_PATH_MAX - n, "_%02x/", (unsigned) (h >> (8 * i)) & 0xff);
+    }
+    snprintf(path + n, LAYOUT_PATH_MAX - n, "%s", name);
+}
+
+// function to find the directory holding a path
+void layout_parent(const char *path, char *dir) {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+        return;
+    }
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+}
+
+// function to fsync a directory
+static int sync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return -1;
+    }
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+// function to create the subdirectories leading to a path
+int layout_mkdirs(const char *path, bool durable) {
+    char dir[LAYOUT_PATH_MAX], parent[LAYOUT_PATH_MAX];
+    for (const char *slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+        if (mkdir(dir, 0700) == -1) {
+            if (errno != EEXIST) {
+                return -1;
+            }
+            continue;
+        }
+        // A new level is only reachable after a crash once it and the entry naming it are on disk
+        layout_parent(dir, parent);
+        if (durable && (sync_dir(dir) == -1 || sync_dir(parent) == -1)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// function to move a flat directory into the hashed layout
+long layout_migrate(int levels) {
+    DIR *dir = opendir(".");
+    if (dir == NULL) {
+        return -1;
+    }
+    long moved = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // Only regular files named like objects; subdirectories start with '_'
+        size_t len = strlen(entry->d_name);
+        struct stat st;
+        bool regular = entry->d_type == DT_REG
+            || (entry->d_type == DT_UNKNOWN && fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                && S_ISREG(st.st_mode));
+        if (!regular || len == 0 || len > 63 || entry->d_name[0] == '_'
+            || strspn(entry->d_name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-") != len) {
+            continue;
+        }
+        char path[LAYOUT_PATH_MAX];
+        layout_path(entry->d_name, levels, path);
+        if (layout_mkdirs(path, false) == -1 || rename(entry->d_name, path) == -1) {
+            closedir(dir);
+            return -1;
+        }
+        moved++;
+    }
+    // Make the new directory entries durable in one pass
+    int rc = syncfs(dirfd(dir));
+    closedir(dir);
+    return rc == -1 ? -1 : moved;
+}
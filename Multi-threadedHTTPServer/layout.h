@@ -0,0 +1,56 @@
+/**
+ * @File layout.h
+ *
+ * Hashed directory layout.  Instead of one flat directory, each object
+ * is kept under a chain of subdirectories chosen by a hash of its name,
+ * e.g. "_3f/_a1/name" for two levels of 256, so no directory grows
+ * large enough to slow down path lookup.  Subdirectory names begin with
+ * '_', which object names cannot contain, so they never collide.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#define LAYOUT_MAX_LEVELS 4 // one hash byte per level
+#define LAYOUT_PATH_MAX   (64 + 4 * LAYOUT_MAX_LEVELS) // object name plus "_xx/" per level
+
+/** @brief Maps an object name to its path.
+ *
+ *  @param name the object name, at most 63 characters
+ *
+ *  @param levels subdirectory levels; 0 keeps the flat layout
+ *
+ *  @param path receives the path, LAYOUT_PATH_MAX bytes
+ */
+void layout_path(const char *name, int levels, char *path);
+
+/** @brief Finds the directory holding a path.
+ *
+ *  @param path a path from layout_path
+ *
+ *  @param dir receives the directory, "." for the flat layout,
+ *         LAYOUT_PATH_MAX bytes
+ */
+void layout_parent(const char *path, char *dir);
+
+/** @brief Creates the subdirectories leading to a path.
+ *
+ *  @param path a path from layout_path
+ *
+ *  @param durable whether to fsync each directory created, and the
+ *         directory it was created in, before returning
+ *
+ *  @return 0 on success, or -1 with errno set
+ */
+int layout_mkdirs(const char *path, bool durable);
+
+/** @brief Moves the objects of a flat working directory into the hashed
+ *         layout in place.  Each object is moved with one rename, so an
+ *         interrupted migration can simply be run again.
+ *
+ *  @param levels subdirectory levels
+ *
+ *  @return the number of objects moved, or -1 on error
+ */
+long layout_migrate(int levels);
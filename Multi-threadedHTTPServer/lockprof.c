@@ -0,0 +1,322 @@
+#define _GNU_SOURCE // dladdr
+
+#include "lockprof.h"
+
+#include "util.h"
+
+#ifdef LOCKPROF
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SITES    1024 // call sites tracked, a power of 2
+#define FILES    256 // contended files tracked, a power of 2
+#define BUCKETS  20 // log2 microsecond histogram buckets: under 1, under 2, under 4, ...
+#define HELD_MAX 16 // locks a thread holds at once whose hold times are kept
+
+enum { KIND_MUTEX, KIND_FLOCK_SH, KIND_FLOCK_EX };
+static const char *kinds[] = { "mutex", "flock_sh", "flock_ex" };
+
+// Counters of one call site taking one kind of lock
+typedef struct {
+    atomic_uintptr_t key; // return address shifted left 2, or'd with the kind; 0 while free
+    atomic_ulong acquired; // locks taken
+    atomic_ulong contended; // locks that were not free at once
+    atomic_ulong wait_ns; // total time waited
+    atomic_ulong hold_ns; // total time held, of the releases that were seen
+    atomic_ulong wait_hist[BUCKETS];
+    atomic_ulong hold_hist[BUCKETS];
+} site_t;
+
+// Waits for the flock of one file
+typedef struct {
+    atomic_uint_fast32_t hash; // of the path, 0 while free
+    atomic_bool ready; // path is filled in
+    char path[128];
+    atomic_ulong waits; // contended flocks
+    atomic_ulong wait_ns; // total time waited
+    atomic_ulong max_ns; // longest wait
+} file_t;
+
+// A lock the thread holds: a mutex, by address, or a flock, by descriptor
+typedef struct {
+    uintptr_t id;
+    site_t *site;
+    uint64_t since;
+} held_t;
+
+static site_t sites[SITES];
+static file_t files[FILES];
+static atomic_ulong lost; // locks not counted because a table was full
+
+static __thread held_t held[HELD_MAX];
+static __thread int held_count;
+
+int __real_pthread_mutex_lock(pthread_mutex_t *mutex);
+int __real_pthread_mutex_unlock(pthread_mutex_t *mutex);
+int __real_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int __real_pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime);
+
+// function to read the clock waits are measured with
+uint64_t lockprof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// function to find the histogram bucket of a duration
+static int bucket(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int b = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    return b < BUCKETS ? b : BUCKETS - 1;
+}
+
+// function to find or claim the counters of a call site
+static site_t *site_for(const void *site, int kind) {
+    uintptr_t key = (uintptr_t) site << 2 | kind;
+    uint32_t i = (uint32_t) ((key >> 2) * 2654435761u) & (SITES - 1);
+    for (int probe = 0; probe < SITES; probe++, i = (i + 1) & (SITES - 1)) {
+        uintptr_t found = atomic_load_explicit(&sites[i].key, memory_order_acquire);
+        if (found == 0) {
+            uintptr_t expected = 0;
+            if (atomic_compare_exchange_strong(&sites[i].key, &expected, key)) {
+                return &sites[i];
+            }
+            found = expected; // another thread claimed it first
+        }
+        if (found == key) {
+            return &sites[i];
+        }
+    }
+    atomic_fetch_add_explicit(&lost, 1, memory_order_relaxed);
+    return NULL;
+}
+
+// function to start timing a hold
+static void hold(uintptr_t id, site_t *s, uint64_t now) {
+    // A flock dropped by close is never seen released, so its entry lingers
+    // until the descriptor is locked again or the oldest entry is evicted
+    int i = 0;
+    while (i < held_count && held[i].id != id) {
+        i++;
+    }
+    if (i == HELD_MAX) {
+        memmove(&held[0], &held[1], sizeof(held_t) * (HELD_MAX - 1));
+        i = HELD_MAX - 1;
+    }
+    held[i] = (held_t) { id, s, now };
+    held_count = i == held_count ? held_count + 1 : held_count;
+}
+
+// function to count an acquisition and start timing its hold
+static void acquired(uintptr_t id, site_t *s, uint64_t waited, bool contended, uint64_t now) {
+    if (s == NULL) {
+        return;
+    }
+    atomic_fetch_add_explicit(&s->acquired, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->wait_hist[bucket(waited)], 1, memory_order_relaxed);
+    if (contended) {
+        atomic_fetch_add_explicit(&s->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->wait_ns, waited, memory_order_relaxed);
+    }
+    hold(id, s, now);
+}
+
+// function to stop timing a hold; returns its site, or NULL if it was not timed
+static site_t *released(uintptr_t id) {
+    for (int i = held_count - 1; i >= 0; i--) {
+        if (held[i].id == id) {
+            site_t *s = held[i].site;
+            uint64_t ns = lockprof_now() - held[i].since;
+            atomic_fetch_add_explicit(&s->hold_ns, ns, memory_order_relaxed);
+            atomic_fetch_add_explicit(&s->hold_hist[bucket(ns)], 1, memory_order_relaxed);
+            held[i] = held[--held_count];
+            return s;
+        }
+    }
+    return NULL;
+}
+
+// function to add a contended flock wait to its file's totals
+static void file_waited(int fd, uint64_t waited) {
+    char link[32], path[sizeof(files[0].path)];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, path, sizeof(path) - 1);
+    if (len <= 0) {
+        return;
+    }
+    path[len] = '\0';
+    uint32_t hash = fnv1a(path);
+    hash = hash != 0 ? hash : 1;
+    uint32_t i = hash & (FILES - 1);
+    for (int probe = 0; probe < FILES; probe++, i = (i + 1) & (FILES - 1)) {
+        file_t *f = &files[i];
+        uint_fast32_t found = atomic_load(&f->hash);
+        if (found == 0) {
+            uint_fast32_t expected = 0;
+            if (atomic_compare_exchange_strong(&f->hash, &expected, hash)) {
+                memcpy(f->path, path, len + 1);
+                atomic_store(&f->ready, true);
+                found = hash;
+            } else {
+                found = expected;
+            }
+        }
+        if (found != hash) {
+            continue;
+        }
+        atomic_fetch_add_explicit(&f->waits, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&f->wait_ns, waited, memory_order_relaxed);
+        unsigned long max = atomic_load_explicit(&f->max_ns, memory_order_relaxed);
+        while (waited > max && !atomic_compare_exchange_weak(&f->max_ns, &max, waited)) {
+        }
+        return;
+    }
+    atomic_fetch_add_explicit(&lost, 1, memory_order_relaxed);
+}
+
+// function to lock a mutex for a call site
+int lockprof_mutex_lock(pthread_mutex_t *mutex, const void *site) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        acquired((uintptr_t) mutex, site_for(site, KIND_MUTEX), 0, false, lockprof_now());
+        return 0;
+    }
+    uint64_t since = lockprof_now();
+    int rc = __real_pthread_mutex_lock(mutex);
+    if (rc == 0) {
+        uint64_t now = lockprof_now();
+        acquired((uintptr_t) mutex, site_for(site, KIND_MUTEX), now - since, true, now);
+    }
+    return rc;
+}
+
+// function to record a mutex taken some other way
+void lockprof_acquired(pthread_mutex_t *mutex, const void *site, uint64_t since, bool contended) {
+    uint64_t now = lockprof_now();
+    acquired((uintptr_t) mutex, site_for(site, KIND_MUTEX), contended ? now - since : 0, contended, now);
+}
+
+// function to take or release a flock for a call site
+int lockprof_flock(int fd, int operation, const void *site, int (*lock)(int, int)) {
+    if (operation & LOCK_UN) {
+        released((uintptr_t) fd);
+        return lock(fd, operation);
+    }
+    int kind = operation & LOCK_EX ? KIND_FLOCK_EX : KIND_FLOCK_SH;
+    uint64_t since = lockprof_now();
+    int rc = lock(fd, operation | LOCK_NB);
+    bool contended = rc == -1 && errno == EWOULDBLOCK && !(operation & LOCK_NB);
+    if (contended) {
+        rc = lock(fd, operation);
+    }
+    if (rc == 0) {
+        uint64_t now = lockprof_now();
+        acquired((uintptr_t) fd, site_for(site, kind), contended ? now - since : 0, contended, now);
+        if (contended) {
+            file_waited(fd, now - since);
+        }
+    }
+    return rc;
+}
+
+int __wrap_pthread_mutex_lock(pthread_mutex_t *mutex) {
+    return lockprof_mutex_lock(mutex, __builtin_return_address(0));
+}
+
+int __wrap_pthread_mutex_unlock(pthread_mutex_t *mutex) {
+    released((uintptr_t) mutex);
+    return __real_pthread_mutex_unlock(mutex);
+}
+
+// A condition wait lets go of the mutex, so the hold ends there and starts again after
+
+int __wrap_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    site_t *s = released((uintptr_t) mutex);
+    int rc = __real_pthread_cond_wait(cond, mutex);
+    if (s != NULL) {
+        hold((uintptr_t) mutex, s, lockprof_now());
+    }
+    return rc;
+}
+
+int __wrap_pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime) {
+    site_t *s = released((uintptr_t) mutex);
+    int rc = __real_pthread_cond_timedwait(cond, mutex, abstime);
+    if (s != NULL) {
+        hold((uintptr_t) mutex, s, lockprof_now());
+    }
+    return rc;
+}
+
+// function to format a histogram as counts separated by slashes, up to the last nonzero one
+static void format_hist(atomic_ulong *hist, char *out, size_t cap) {
+    int last = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        if (atomic_load_explicit(&hist[i], memory_order_relaxed) != 0) {
+            last = i;
+        }
+    }
+    size_t n = 0;
+    for (int i = 0; i <= last && n < cap; i++) {
+        n += snprintf(out + n, cap - n, "%s%lu", i == 0 ? "" : "/", atomic_load_explicit(&hist[i], memory_order_relaxed));
+    }
+}
+
+// function to report every site and contended file
+void lockprof_dump_stats(FILE *out) {
+    int used = 0;
+    for (int i = 0; i < SITES; i++) {
+        site_t *s = &sites[i];
+        uintptr_t key = atomic_load_explicit(&s->key, memory_order_acquire);
+        if (key == 0 || atomic_load_explicit(&s->acquired, memory_order_relaxed) == 0) {
+            continue;
+        }
+        used++;
+        // Name the site by function and offset; the build links with -rdynamic for this.
+        // Static functions are not exported, so those are named by offset in the binary,
+        // which addr2line -f resolves
+        void *addr = (void *) (key >> 2);
+        char name[160];
+        Dl_info info;
+        if (dladdr(addr, &info) != 0 && info.dli_sname != NULL) {
+            snprintf(name, sizeof(name), "%s+0x%lx", info.dli_sname,
+                (unsigned long) ((char *) addr - (char *) info.dli_saddr));
+        } else if (info.dli_fname != NULL) {
+            const char *file = strrchr(info.dli_fname, '/');
+            snprintf(name, sizeof(name), "%s+0x%lx", file != NULL ? file + 1 : info.dli_fname,
+                (unsigned long) ((char *) addr - (char *) info.dli_fbase));
+        } else {
+            snprintf(name, sizeof(name), "%p", addr);
+        }
+        char wait_hist[BUCKETS * 12], hold_hist[BUCKETS * 12];
+        format_hist(s->wait_hist, wait_hist, sizeof(wait_hist));
+        format_hist(s->hold_hist, hold_hist, sizeof(hold_hist));
+        fprintf(out,
+            "STATS,lock,site=%s,kind=%s,acquired=%lu,contended=%lu,wait_us=%lu,hold_us=%lu,wait_hist=%s,hold_hist=%s\n",
+            name, kinds[key & 3], atomic_load(&s->acquired), atomic_load(&s->contended),
+            atomic_load(&s->wait_ns) / 1000, atomic_load(&s->hold_ns) / 1000, wait_hist, hold_hist);
+    }
+    for (int i = 0; i < FILES; i++) {
+        file_t *f = &files[i];
+        if (!atomic_load(&f->ready)) {
+            continue;
+        }
+        fprintf(out, "STATS,lock_file,path=%s,waits=%lu,wait_us=%lu,max_us=%lu\n", f->path, atomic_load(&f->waits),
+            atomic_load(&f->wait_ns) / 1000, atomic_load(&f->max_ns) / 1000);
+    }
+    fprintf(out, "STATS,lockprof,sites=%d,lost=%lu\n", used, atomic_load(&lost));
+}
+
+#else
+
+// function to report nothing, since nothing was profiled
+void lockprof_dump_stats(FILE *out) {
+    (void) out;
+}
+
+#endif
@@ -0,0 +1,95 @@
+/**
+ * @File lockprof.h
+ *
+ * Lock-contention profiling, built with `make LOCKPROF=1`.  The build
+ * then links with --wrap for pthread_mutex_lock, pthread_mutex_unlock,
+ * and the condition variable waits, including the calls the helper
+ * library makes, and the flock wrapper reports here as well.
+ * Each call site gets counts and log2 histograms of how long it waited
+ * for its lock and how long it held it, and contended flocks are also
+ * totalled per file.  Sites are named from the symbol table when the
+ * STATS lines are written.  In other builds these functions compile
+ * down to the plain lock calls.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef LOCKPROF
+
+/** @brief Reads the clock lock waits are measured with.
+ *
+ *  @return the time in nanoseconds
+ */
+uint64_t lockprof_now(void);
+
+/** @brief Locks a mutex on behalf of a call site, timing any wait.
+ *
+ *  @param mutex the mutex to lock
+ *
+ *  @param site the return address of the function that wants it
+ *
+ *  @return what pthread_mutex_lock returned
+ */
+int lockprof_mutex_lock(pthread_mutex_t *mutex, const void *site);
+
+/** @brief Records the acquisition of a mutex taken some other way, such
+ *         as by a trylock loop.
+ *
+ *  @param mutex the mutex the caller now holds
+ *
+ *  @param site the return address of the function that wanted it
+ *
+ *  @param since when the caller started trying, from lockprof_now
+ *
+ *  @param contended whether the first try failed
+ */
+void lockprof_acquired(pthread_mutex_t *mutex, const void *site, uint64_t since, bool contended);
+
+/** @brief Takes or releases a flock on behalf of a call site, timing
+ *         any wait.
+ *
+ *  @param fd the file
+ *
+ *  @param operation the flock operation
+ *
+ *  @param site the return address of the flock caller
+ *
+ *  @param lock the function that actually calls flock
+ *
+ *  @return what lock returned
+ */
+int lockprof_flock(int fd, int operation, const void *site, int (*lock)(int, int));
+
+#else
+
+static inline uint64_t lockprof_now(void) {
+    return 0;
+}
+
+static inline int lockprof_mutex_lock(pthread_mutex_t *mutex, const void *site) {
+    (void) site;
+    return pthread_mutex_lock(mutex);
+}
+
+static inline void lockprof_acquired(pthread_mutex_t *mutex, const void *site, uint64_t since, bool contended) {
+    (void) mutex, (void) site, (void) since, (void) contended;
+}
+
+static inline int lockprof_flock(int fd, int operation, const void *site, int (*lock)(int, int)) {
+    (void) site;
+    return lock(fd, operation);
+}
+
+#endif
+
+/** @brief Writes a STATS line per lock site and per contended file.
+ *         Writes nothing unless built with LOCKPROF.
+ *
+ *  @param out the stream to write to
+ */
+void lockprof_dump_stats(FILE *out);
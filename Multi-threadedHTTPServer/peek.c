@@ -0,0 +1,115 @@
+#define _GNU_SOURCE // memmem, POLLRDHUP
+
+#include "peek.h"
+
+#include "util.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+// function to copy the request head without consuming it
+ssize_t peek_head(int fd, char *buf, size_t cap, long timeout_ms) {
+    uint64_t deadline = monotonic_ms() + timeout_ms;
+    ssize_t seen = 0;
+    while (true) {
+        // Peeking again would return the same bytes at once; wait until more arrive
+        int lowat = seen + 1;
+        if (seen > 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+        }
+        uint64_t now = monotonic_ms();
+        struct pollfd pfd = { fd, POLLIN | POLLRDHUP, 0 };
+        int rc = now < deadline ? poll(&pfd, 1, deadline - now) : 0;
+        if (seen > 0) {
+            lowat = 1;
+            setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+        }
+        if (rc == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (rc == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        ssize_t n = recv(fd, buf, cap - 1, MSG_PEEK);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return n;
+        }
+        buf[n] = '\0';
+        char *end = memmem(buf, n, "\r\n\r\n", 4);
+        if (end != NULL) {
+            return end + 4 - buf;
+        }
+        if ((size_t) n == cap - 1 || (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+            return 0; // the head does not fit or will never be completed
+        }
+        seen = n;
+    }
+}
+
+// function to check the method of a request head
+bool head_is_method(const char *head, const char *method) {
+    size_t len = strlen(method);
+    return strncmp(head, method, len) == 0 && head[len] == ' ';
+}
+
+// function to find a header in a request head
+bool head_header(const char *head, const char *name, char *value, size_t cap) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(head, "\r\n");
+    while (line != NULL && strncmp(line, "\r\n\r\n", 4) != 0) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *v = line + name_len + 1;
+            v += strspn(v, " \t");
+            size_t len = strcspn(v, "\r");
+            if (len >= cap) {
+                return false;
+            }
+            memcpy(value, v, len);
+            value[len] = '\0';
+            return true;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return false;
+}
+
+// function to parse the target of a request line
+bool head_uri(const char *head, char *uri, size_t cap) {
+    const char *name = strchr(head, ' ');
+    if (name == NULL || name[1] != '/') {
+        return false;
+    }
+    name += 2;
+    size_t len = strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-");
+    if (len == 0 || len > 63 || len >= cap || strncmp(name + len, " HTTP/1.1\r\n", 11) != 0) {
+        return false;
+    }
+    memcpy(uri, name, len);
+    uri[len] = '\0';
+    return true;
+}
+
+// function to read the Content-Length of a request head
+long head_content_length(const char *head) {
+    char value[32];
+    if (!head_header(head, "Content-Length", value, sizeof(value))) {
+        return -1;
+    }
+    char *end = NULL;
+    long length = strtol(value, &end, 10);
+    return end == value || *end != '\0' || length < 0 ? -1 : length;
+}
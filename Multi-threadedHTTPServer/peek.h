@@ -0,0 +1,79 @@
+/**
+ * @File peek.h
+ *
+ * Looking at a request head before the helper library parses it.  The
+ * library only knows GET and PUT and a couple of headers, so requests it
+ * cannot express are recognized here from a MSG_PEEK copy of the head,
+ * which leaves the socket untouched for conn_parse if they turn out to
+ * be ordinary requests.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define PEEK_MAX 8192 // longest head looked at; longer ones are left to the library
+
+/** @brief Copies the request head, through its blank line, without
+ *         consuming it, waiting for the rest of the head if needed.
+ *
+ *  @param fd the client socket
+ *
+ *  @param buf receives the head, NUL-terminated
+ *
+ *  @param cap size of buf, at most PEEK_MAX
+ *
+ *  @param timeout_ms how long to wait for the whole head
+ *
+ *  @return the length of the head, 0 if the peer closed or the head does
+ *          not fit, or -1 on error, with errno ETIMEDOUT if the head was
+ *          not in by the timeout
+ */
+ssize_t peek_head(int fd, char *buf, size_t cap, long timeout_ms);
+
+/** @brief Checks the method of a request head.
+ *
+ *  @param head a head from peek_head
+ *
+ *  @param method the method name
+ *
+ *  @return whether the request line starts with method and a space
+ */
+bool head_is_method(const char *head, const char *method);
+
+/** @brief Finds a header in a request head; names match case-insensitively.
+ *
+ *  @param head a head from peek_head
+ *
+ *  @param name the header name
+ *
+ *  @param value receives the value, NUL-terminated
+ *
+ *  @param cap size of value
+ *
+ *  @return whether the header was found and its value fit
+ */
+bool head_header(const char *head, const char *name, char *value, size_t cap);
+
+/** @brief Parses the target of a request line of the form
+ *         "<method> /<name> HTTP/1.1", where name is a valid object name.
+ *
+ *  @param head a head from peek_head
+ *
+ *  @param uri receives the name without its slash, NUL-terminated
+ *
+ *  @param cap size of uri
+ *
+ *  @return whether the request line is well formed
+ */
+bool head_uri(const char *head, char *uri, size_t cap);
+
+/** @brief Reads the Content-Length of a request head.
+ *
+ *  @param head a head from peek_head
+ *
+ *  @return the length, or -1 if it is missing or malformed
+ */
+long head_content_length(const char *head);
@@ -0,0 +1,97 @@
+#include "pool.h"
+
+#include <stdlib.h>
+
+typedef struct Pool {
+    conn_ctx_t *free; // idle contexts, most recently used first
+    int count; // number of idle contexts
+    int capacity; // most idle contexts to keep
+} pool_t;
+
+// function to allocate a fresh context with aligned buffers
+static conn_ctx_t *ctx_alloc(void) {
+    void *mem = NULL;
+    if (posix_memalign(&mem, CACHE_LINE, sizeof(conn_ctx_t)) != 0) {
+        return NULL;
+    }
+    conn_ctx_t *ctx = mem;
+    ctx->rbuf = NULL;
+    ctx->wbuf = NULL;
+    if (posix_memalign(&mem, CACHE_LINE, CTX_READ_SIZE) != 0) {
+        free(ctx);
+        return NULL;
+    }
+    ctx->rbuf = mem;
+    if (posix_memalign(&mem, CACHE_LINE, CTX_WRITE_SIZE) != 0) {
+        free(ctx->rbuf);
+        free(ctx);
+        return NULL;
+    }
+    ctx->wbuf = mem;
+    return ctx;
+}
+
+// function to free a context and its buffers
+static void ctx_free(conn_ctx_t *ctx) {
+    free(ctx->rbuf);
+    free(ctx->wbuf);
+    free(ctx);
+}
+
+// function to initialize the pool
+pool_t *pool_new(int capacity) {
+    pool_t *pool = malloc(sizeof(pool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->free = NULL;
+    pool->count = 0;
+    pool->capacity = capacity;
+    return pool;
+}
+
+// function to delete the pool
+void pool_delete(pool_t **pool) {
+    conn_ctx_t *ctx = (*pool)->free;
+    while (ctx != NULL) {
+        conn_ctx_t *next = ctx->next;
+        ctx_free(ctx);
+        ctx = next;
+    }
+    free(*pool);
+    *pool = NULL;
+}
+
+// function to take a context for a new connection
+conn_ctx_t *pool_get(pool_t *pool, int connfd) {
+    conn_ctx_t *ctx = pool->free;
+    if (ctx != NULL) {
+        pool->free = ctx->next;
+        pool->count--;
+    } else {
+        ctx = ctx_alloc();
+        if (ctx == NULL) {
+            return NULL;
+        }
+    }
+    ctx->connfd = connfd;
+    ctx->conn = NULL;
+    ctx->xfer.parked = false;
+    ctx->xfer.locked = false;
+    ctx->next = NULL;
+    return ctx;
+}
+
+// function to recycle a context
+void pool_put(pool_t *pool, conn_ctx_t *ctx) {
+    if (ctx->conn != NULL) {
+        conn_delete(&ctx->conn);
+    }
+    if (pool->count >= pool->capacity) {
+        ctx_free(ctx);
+        return;
+    }
+    ctx->next = pool->free;
+    pool->free = ctx;
+    pool->count++;
+}
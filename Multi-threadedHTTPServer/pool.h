@@ -0,0 +1,110 @@
+/**
+ * @File pool.h
+ *
+ * Recycled per-connection contexts.  Each worker thread keeps its own
+ * pool, so taking and returning a context never touches a lock or the
+ * allocator once the pool is warm.
+ */
+
+#pragma once
+
+#include "connection.h"
+#include "green.h"
+#include "response.h"
+#include "store.h"
+#include "trace.h"
+#include "wheel.h"
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define CACHE_LINE     64
+#define CTX_READ_SIZE  65536 // bytes in a context's read buffer
+#define CTX_WRITE_SIZE 4096 // bytes in a context's write buffer
+
+struct ConnCtx;
+
+/** @struct transfer_t
+ *
+ *  @brief A GET body on its way out, which can be parked between
+ *         slices and resumed by another worker.
+ */
+typedef struct {
+    int fd; // file the body is read from
+    off_t offset; // next byte of fd to send
+    off_t end; // one past the last byte to send
+    uint64_t start; // trace clock when sending began
+    store_obj_t obj; // object a store GET keeps pinned until it is sent
+    bool parked; // stopped between slices, to be queued for a worker to resume
+    bool locked; // fd holds a shared flock, which a parked transfer lets go of
+    bool reopened; // fd was reopened when first parked, so the flock on it is the transfer's own
+    struct stat st; // the file when first parked, which it must still be on resuming
+    // Logs the request and releases fd or obj once the body is out or has failed
+    void (*finish)(struct ConnCtx *ctx, const Response_t *res);
+} transfer_t;
+
+/** @struct conn_ctx_t
+ *
+ *  @brief Server-side state for one connection.  The buffers are
+ *         allocated once, cache-line aligned, and survive recycling.
+ */
+typedef struct ConnCtx {
+    int connfd; // the client socket
+    conn_t *conn; // parsed request, owned by the helper library
+    char *rbuf; // CTX_READ_SIZE bytes, e.g. file data read for a response
+    char *wbuf; // CTX_WRITE_SIZE bytes, e.g. a formatted response head
+    deadline_t deadline; // the connection's current timeout
+    green_activity_t activity; // progress of its I/O, checked when the timeout passes
+    uint64_t idle_moved; // activity.moved when the idle timeout was last armed
+    uint64_t end_ms; // when the whole request times out, 0 for never
+    bool in_body; // the head is in: idle timeouts apply instead of the header timeout
+    atomic_bool expired; // a timeout shut the socket down, so a body may be cut short
+    bool accepts_gzip; // the request's Accept-Encoding allows gzip and -z is on
+    trace_req_t trace; // spans of the request, if it is sampled
+    transfer_t xfer; // the response body, while a GET is sending one
+    struct ConnCtx *next; // link in the pool's free list
+} conn_ctx_t;
+
+/** @struct pool_t
+ *
+ *  @brief A free list of contexts owned by a single thread.
+ */
+typedef struct Pool pool_t;
+
+/** @brief Dynamically allocates a pool that keeps at most capacity idle
+ *         contexts.  The pool must only be used by the thread that
+ *         created it.
+ *
+ *  @param capacity the most idle contexts to keep for reuse
+ *
+ *  @return a pointer to a new pool_t, or NULL if allocation failed
+ */
+pool_t *pool_new(int capacity);
+
+/** @brief Frees every idle context and the pool, and sets *pool to NULL.
+ *
+ *  @param pool the pool to be deleted
+ */
+void pool_delete(pool_t **pool);
+
+/** @brief Takes an idle context, or allocates one if the pool is empty,
+ *         and binds it to connfd.  The context's conn is NULL.
+ *
+ *  @param pool the pool to take from
+ *
+ *  @param connfd the client socket the context will serve
+ *
+ *  @return the context, or NULL if allocation failed
+ */
+conn_ctx_t *pool_get(pool_t *pool, int connfd);
+
+/** @brief Returns a context to the pool once its connection is done.
+ *         Deletes ctx->conn if it is still set.  Contexts beyond the
+ *         pool's capacity are freed.  A context may come from another
+ *         thread's pool, e.g. when a parked transfer was resumed here.
+ *
+ *  @param pool the pool to return to
+ *
+ *  @param ctx the context to recycle
+ */
+void pool_put(pool_t *pool, conn_ctx_t *ctx);
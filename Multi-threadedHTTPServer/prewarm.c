@@ -0,0 +1,321 @@
+#include "prewarm.h"
+
+#include "util.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PREWARM_BUCKETS 4096 // hash buckets for counted names
+
+// A counted name; entries are only ever added at the head of a bucket, and freed with the prewarm
+typedef struct Entry {
+    char name[PREWARM_NAME_MAX];
+    atomic_ulong count; // half the manifest's count, rounded up, plus this run's GETs
+    uint64_t heat; // the manifest's count, which orders warming
+    size_t order; // position among the names, first read first
+    struct Entry *next; // next in its bucket, set before the entry is published
+} entry_t;
+
+// A name's count at the time of a save
+typedef struct Snapshot {
+    const char *name;
+    uint64_t count;
+    size_t order;
+} snapshot_t;
+
+typedef struct Prewarm {
+    char *path; // the manifest
+    size_t limit; // most names warmed and saved
+    pthread_mutex_t lock; // serializes adding names; lookups and counts take no lock
+    _Atomic(entry_t *) buckets[PREWARM_BUCKETS]; // counted names, each head published with release
+    size_t tracked; // names counted, guarded by lock
+    atomic_bool full; // the table holds PREWARM_TRACK_MAX names
+    atomic_ulong untracked; // GETs not counted because the table was full
+    entry_t **warm; // names to warm, hottest first
+    size_t warm_count;
+    atomic_size_t next_warm; // index of the next name a thread takes
+    atomic_bool stop; // set at shutdown to end warming early
+    pthread_t *threads;
+    int thread_count;
+    atomic_int running; // threads still warming
+    atomic_ulong warmed; // objects warmed
+    atomic_ulong missing; // names whose object is gone
+    uint64_t start_ms; // when warming began
+    atomic_bool done; // every thread has finished
+    atomic_ulong elapsed_ms; // how long warming took, once done
+    int (*warm_fn)(const char *name);
+} prewarm_t;
+
+// function to find a name's entry without locking
+static entry_t *find(prewarm_t *p, uint32_t bucket, const char *name) {
+    for (entry_t *e = atomic_load_explicit(&p->buckets[bucket], memory_order_acquire); e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// function to find a name's entry, adding it if there is room; the prewarm is locked
+static entry_t *find_or_add(prewarm_t *p, const char *name) {
+    uint32_t bucket = fnv1a(name) % PREWARM_BUCKETS;
+    entry_t *e = find(p, bucket, name);
+    if (e != NULL || p->tracked == PREWARM_TRACK_MAX) {
+        return e;
+    }
+    e = calloc(1, sizeof(entry_t));
+    if (e == NULL) {
+        return NULL;
+    }
+    strcpy(e->name, name);
+    e->order = p->tracked++;
+    e->next = atomic_load_explicit(&p->buckets[bucket], memory_order_relaxed);
+    atomic_store_explicit(&p->buckets[bucket], e, memory_order_release); // readers see a complete entry
+    if (p->tracked == PREWARM_TRACK_MAX) {
+        atomic_store(&p->full, true);
+    }
+    return e;
+}
+
+// function to order entries by the manifest's count, hottest first, then by order
+static int by_heat(const void *a, const void *b) {
+    const entry_t *x = *(entry_t *const *) a, *y = *(entry_t *const *) b;
+    if (x->heat != y->heat) {
+        return x->heat > y->heat ? -1 : 1;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// function to order snapshots by count, hottest first, then by order
+static int by_count(const void *a, const void *b) {
+    const snapshot_t *x = a, *y = b;
+    if (x->count != y->count) {
+        return x->count > y->count ? -1 : 1;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// function to list every entry; the prewarm is locked
+static entry_t **entries(prewarm_t *p) {
+    entry_t **all = malloc((p->tracked > 0 ? p->tracked : 1) * sizeof(entry_t *));
+    if (all == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (int b = 0; b < PREWARM_BUCKETS; b++) {
+        for (entry_t *e = atomic_load_explicit(&p->buckets[b], memory_order_acquire); e != NULL; e = e->next) {
+            all[n++] = e;
+        }
+    }
+    return all;
+}
+
+// function to read the manifest's lines into counted entries
+static int load(prewarm_t *p, FILE *f) {
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *s = line;
+        uint64_t heat = 1; // lines without a count keep the order they are in
+        if (isdigit((unsigned char) *s)) {
+            heat = strtoull(s, &s, 10);
+        }
+        s += strspn(s, " \t");
+        s += *s == '/';
+        s[strcspn(s, " \t\r\n")] = '\0';
+        if (*s == '\0' || *s == '#' || strlen(s) >= PREWARM_NAME_MAX || strchr(s, '/') != NULL) {
+            continue;
+        }
+        entry_t *e = find_or_add(p, s);
+        if (e == NULL) {
+            return p->tracked == PREWARM_TRACK_MAX ? 0 : -1; // the rest of a huge manifest is not hot
+        }
+        e->heat += heat;
+        atomic_store(&e->count, (e->heat + 1) / 2);
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+// function to record that the last warming thread has finished
+static void finish(prewarm_t *p) {
+    atomic_store(&p->elapsed_ms, monotonic_ms() - p->start_ms);
+    atomic_store(&p->done, true);
+}
+
+// function run by each warming thread: take the next name until none are left
+static void *warm_thread(void *arg) {
+    prewarm_t *p = arg;
+    size_t i;
+    while (!atomic_load(&p->stop) && (i = atomic_fetch_add(&p->next_warm, 1)) < p->warm_count) {
+        if (p->warm_fn(p->warm[i]->name) == 0) {
+            atomic_fetch_add(&p->warmed, 1);
+        } else {
+            atomic_fetch_add(&p->missing, 1);
+        }
+    }
+    if (atomic_fetch_sub(&p->running, 1) == 1) {
+        finish(p);
+    }
+    return NULL;
+}
+
+// function to read a manifest
+prewarm_t *prewarm_new(const char *path, size_t limit) {
+    prewarm_t *p = calloc(1, sizeof(prewarm_t));
+    if (p == NULL) {
+        return NULL;
+    }
+    p->path = strdup(path);
+    p->limit = limit;
+    pthread_mutex_init(&p->lock, NULL);
+    FILE *f = fopen(path, "r");
+    if (p->path == NULL || (f == NULL && errno != ENOENT) || (f != NULL && load(p, f) == -1)) {
+        if (f != NULL) {
+            fclose(f);
+        }
+        prewarm_delete(&p);
+        return NULL;
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    p->warm = entries(p);
+    if (p->warm == NULL) {
+        prewarm_delete(&p);
+        return NULL;
+    }
+    qsort(p->warm, p->tracked, sizeof(entry_t *), by_heat);
+    p->warm_count = p->tracked < limit ? p->tracked : limit;
+    return p;
+}
+
+// function to stop warming and free the prewarm
+void prewarm_delete(prewarm_t **p) {
+    prewarm_t *pw = *p;
+    atomic_store(&pw->stop, true);
+    for (int t = 0; t < pw->thread_count; t++) {
+        pthread_join(pw->threads[t], NULL);
+    }
+    free(pw->threads);
+    free(pw->warm);
+    for (int b = 0; b < PREWARM_BUCKETS; b++) {
+        entry_t *e = atomic_load(&pw->buckets[b]);
+        while (e != NULL) {
+            entry_t *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    pthread_mutex_destroy(&pw->lock);
+    free(pw->path);
+    free(pw);
+    *p = NULL;
+}
+
+// function to start warming
+int prewarm_start(prewarm_t *p, int threads, int (*warm)(const char *name)) {
+    p->threads = calloc(threads, sizeof(pthread_t));
+    if (p->threads == NULL) {
+        return -1;
+    }
+    p->warm_fn = warm;
+    p->start_ms = monotonic_ms();
+    atomic_store(&p->running, threads);
+    for (int t = 0; t < threads; t++) {
+        if (pthread_create(&p->threads[t], NULL, warm_thread, p) != 0) {
+            if (atomic_fetch_sub(&p->running, threads - t) == threads - t) {
+                finish(p); // the threads that did start are already done
+            }
+            break;
+        }
+        p->thread_count++;
+    }
+    return p->thread_count > 0 ? 0 : -1;
+}
+
+// function to count a GET
+void prewarm_count(prewarm_t *p, const char *name) {
+    if (strlen(name) >= PREWARM_NAME_MAX) {
+        return;
+    }
+    entry_t *e = find(p, fnv1a(name) % PREWARM_BUCKETS, name);
+    if (e == NULL && !atomic_load_explicit(&p->full, memory_order_relaxed)) {
+        // Only a name's first GET takes the lock, to add it
+        pthread_mutex_lock(&p->lock);
+        e = find_or_add(p, name);
+        pthread_mutex_unlock(&p->lock);
+    }
+    if (e != NULL) {
+        atomic_fetch_add_explicit(&e->count, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&p->untracked, 1, memory_order_relaxed);
+    }
+}
+
+// function to rewrite the manifest as a snapshot of the counts
+int prewarm_save(prewarm_t *p) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", p->path) >= (int) sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    // Sort a snapshot of the counts, which GETs may still be bumping
+    pthread_mutex_lock(&p->lock);
+    size_t tracked = p->tracked;
+    entry_t **all = entries(p);
+    pthread_mutex_unlock(&p->lock);
+    snapshot_t *snap = malloc((tracked > 0 ? tracked : 1) * sizeof(snapshot_t));
+    if (all == NULL || snap == NULL) {
+        free(all);
+        free(snap);
+        return -1;
+    }
+    for (size_t i = 0; i < tracked; i++) {
+        snap[i] = (snapshot_t) { all[i]->name, atomic_load_explicit(&all[i]->count, memory_order_relaxed),
+            all[i]->order };
+    }
+    free(all);
+    qsort(snap, tracked, sizeof(snapshot_t), by_count);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        free(snap);
+        return -1;
+    }
+    for (size_t i = 0; i < tracked && i < p->limit && snap[i].count > 0; i++) {
+        fprintf(f, "%lu /%s\n", (unsigned long) snap[i].count, snap[i].name);
+    }
+    free(snap);
+    if (fflush(f) == EOF || fsync(fileno(f)) == -1) {
+        int saved = errno;
+        fclose(f);
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    if (fclose(f) == EOF || rename(tmp, p->path) == -1) {
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+// function to report the prewarm counters
+void prewarm_dump_stats(prewarm_t *p, FILE *out) {
+    pthread_mutex_lock(&p->lock);
+    size_t tracked = p->tracked;
+    pthread_mutex_unlock(&p->lock);
+    fprintf(out,
+        "STATS,prewarm,names=%zu,warmed=%lu,missing=%lu,done=%d,elapsed_ms=%lu,tracked=%zu,untracked=%lu\n",
+        p->warm_count, atomic_load(&p->warmed), atomic_load(&p->missing), atomic_load(&p->done),
+        atomic_load(&p->done) ? atomic_load(&p->elapsed_ms) : monotonic_ms() - p->start_ms, tracked,
+        atomic_load(&p->untracked));
+}
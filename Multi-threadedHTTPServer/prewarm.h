@@ -0,0 +1,79 @@
+/**
+ * @File prewarm.h
+ *
+ * Startup warming from a manifest of hot objects.  The manifest lists
+ * one object per line, as "name" or "count name", hottest first when
+ * there are no counts.  At startup a few threads go through it in
+ * order of count and warm each object while the server already
+ * accepts.  Meanwhile every successful GET is counted, and at shutdown
+ * the manifest is rewritten as a snapshot: each name's count from this
+ * run plus half its count from the file, so the next start warms what
+ * was recently hot.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define PREWARM_NAME_MAX  64 // object names, as for the layout, plus the NUL
+#define PREWARM_TRACK_MAX 65536 // most names counted at once
+
+typedef struct Prewarm prewarm_t;
+
+/** @brief Reads a manifest.  A missing file is an empty manifest, so
+ *         the first run creates it.
+ *
+ *  @param path the manifest, rewritten by prewarm_save
+ *
+ *  @param limit the most names warmed and saved
+ *
+ *  @return the prewarm, or NULL if the file is unreadable or allocation
+ *          failed
+ */
+prewarm_t *prewarm_new(const char *path, size_t limit);
+
+/** @brief Stops any warming still going and frees the prewarm.
+ *
+ *  @param p the prewarm to delete
+ */
+void prewarm_delete(prewarm_t **p);
+
+/** @brief Starts warming the hottest names in the background.
+ *
+ *  @param p the prewarm
+ *
+ *  @param threads the threads warming at once
+ *
+ *  @param warm warms one object, returning 0, or -1 if it is missing
+ *
+ *  @return 0, or -1 if no thread could be started
+ */
+int prewarm_start(prewarm_t *p, int threads, int (*warm)(const char *name));
+
+/** @brief Counts a successful GET of an object.  Only the first GET of
+ *         a name takes a lock, to add it; later ones bump an atomic
+ *         counter.
+ *
+ *  @param p the prewarm
+ *
+ *  @param name the object name, without its slash
+ */
+void prewarm_count(prewarm_t *p, const char *name);
+
+/** @brief Rewrites the manifest with the counts, hottest first, through
+ *         a temporary file renamed over it.
+ *
+ *  @param p the prewarm
+ *
+ *  @return 0, or -1 with errno set
+ */
+int prewarm_save(prewarm_t *p);
+
+/** @brief Writes a STATS line with the prewarm counters.
+ *
+ *  @param p the prewarm
+ *
+ *  @param out the stream to write to
+ */
+void prewarm_dump_stats(prewarm_t *p, FILE *out);
@@ -0,0 +1,106 @@
+#include "restart.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// function to fill in a Unix socket address for path
+static int restart_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return -1; // path does not fit in sun_path
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// function to receive the listening socket from a running server
+int restart_receive(const char *path) {
+    struct sockaddr_un addr;
+    if (restart_addr(&addr, path) == -1) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd); // no server to take over from
+        return -1;
+    }
+
+    // One byte of payload carries the descriptor as ancillary data
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    int listen_fd = -1;
+    if (recvmsg(fd, &msg, 0) == 1) {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    close(fd);
+    return listen_fd;
+}
+
+// function to offer the listening socket to a successor
+int restart_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (restart_addr(&addr, path) == -1) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    unlink(path); // replace the predecessor's (or a stale) socket file
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// function to hand the listening socket to a successor
+int restart_send(int handoff_fd, int listen_fd) {
+    int fd = accept(handoff_fd, NULL, NULL);
+    if (fd == -1) {
+        return -1;
+    }
+
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+
+    ssize_t rc = sendmsg(fd, &msg, 0);
+    close(fd);
+    return rc == 1 ? 0 : -1;
+}
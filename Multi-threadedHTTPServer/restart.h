@@ -0,0 +1,42 @@
+/**
+ * @File restart.h
+ *
+ * Hot restart: a running server hands its listening socket to a new
+ * server process over a Unix domain socket (SCM_RIGHTS), so a deploy
+ * never closes the port.  The new process then takes over the Unix
+ * socket path for the next restart while the old one drains and exits.
+ */
+
+#pragma once
+
+/** @brief Asks a running server listening on path for its listening
+ *         socket.
+ *
+ *  @param path the Unix socket path of the running server
+ *
+ *  @return the received listening socket, or -1 if no server answered
+ *          on path.  Sets errno according to any errors that occur.
+ */
+int restart_receive(const char *path);
+
+/** @brief Creates the Unix socket on which this server offers its
+ *         listening socket to a successor.  Any stale socket file at
+ *         path is replaced.
+ *
+ *  @param path the Unix socket path to listen on
+ *
+ *  @return the listening Unix socket, or -1 on error.  Sets errno
+ *          according to any errors that occur.
+ */
+int restart_listen(const char *path);
+
+/** @brief Accepts a successor on handoff_fd and sends it listen_fd.
+ *
+ *  @param handoff_fd the socket returned by restart_listen
+ *
+ *  @param listen_fd the listening socket to hand over
+ *
+ *  @return 0 on success, or -1 on error.  Sets errno according to any
+ *          errors that occur.
+ */
+int restart_send(int handoff_fd, int listen_fd);
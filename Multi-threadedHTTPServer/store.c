@@ -0,0 +1,583 @@
+#define _GNU_SOURCE // copy_file_range, fallocate
+
+#include "store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define STORE_MAGIC      0x47455343u // "CSEG"
+#define RECORD_PENDING   1 // header written, body may be incomplete
+#define RECORD_COMMITTED 2 // body complete, seq orders it against other versions
+#define SEGMENT_MAX      (64 << 20) // start a new segment past this many bytes
+#define COMPACT_INTERVAL 30 // seconds between compaction passes
+#define INDEX_INITIAL    1024 // initial number of index buckets
+
+// On-disk header in front of every record; followed by the URI and body.
+typedef struct {
+    uint32_t magic; // STORE_MAGIC
+    uint32_t state; // RECORD_PENDING or RECORD_COMMITTED
+    uint64_t seq; // commit order, valid once committed
+    uint64_t length; // body bytes
+    uint32_t uri_len; // URI bytes, no terminator
+    uint32_t reserved; // zero
+} record_t;
+
+struct Segment {
+    uint32_t id; // segment number, names the file
+    int fd; // read/write descriptor; all I/O uses explicit offsets
+    atomic_int refs; // one for the segment table plus one per pin
+    off_t size; // bytes reserved so far (append_lock)
+    int writers; // reservations not yet committed or aborted (append_lock)
+    uint64_t live; // bytes of records the index points at (index_lock)
+};
+
+typedef struct Entry {
+    struct Entry *next; // next entry in the bucket
+    segment_t *seg; // segment holding the latest committed version
+    off_t record; // offset of its record header
+    uint64_t length; // body bytes
+    uint64_t seq; // commit order
+    char uri[64]; // the key
+} entry_t;
+
+struct Store {
+    char *dir; // directory holding the segments
+    pthread_rwlock_t index_lock; // guards buckets, segs, and each segment's live count
+    entry_t **buckets; // hash index from URI to entry
+    size_t nbuckets; // number of buckets
+    size_t count; // number of entries
+    segment_t **segs; // segment table indexed by id, NULL once compacted
+    uint32_t nsegs; // slots in segs, also the next segment id
+    pthread_mutex_t append_lock; // guards active and reservations
+    segment_t *active; // segment new records are appended to
+    uint64_t seq; // last commit sequence number (index_lock)
+    pthread_t compactor; // background compaction thread
+    pthread_mutex_t compact_mut; // guards stopping
+    pthread_cond_t compact_cond; // wakes the compactor to stop
+    bool stopping; // store_close was called
+};
+
+// function to hash a URI (FNV-1a)
+static size_t store_hash(const char *uri) {
+    size_t h = 14695981039346656037ULL;
+    while (*uri) {
+        h = (h ^ (unsigned char) *uri++) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// function to build the path of a segment file
+static void segment_path(store_t *store, uint32_t id, char *path) {
+    snprintf(path, PATH_MAX, "%s/seg-%06u.log", store->dir, id);
+}
+
+// function to take a reference on a segment
+static void segment_pin(segment_t *seg) {
+    atomic_fetch_add(&seg->refs, 1);
+}
+
+// function to drop a reference, closing the segment with the last one
+static void segment_unpin(segment_t *seg) {
+    if (atomic_fetch_sub(&seg->refs, 1) == 1) {
+        close(seg->fd);
+        free(seg);
+    }
+}
+
+// function to open a segment file and put it in the table
+static segment_t *segment_open(store_t *store, uint32_t id, int flags) {
+    char path[PATH_MAX];
+    segment_path(store, id, path);
+    segment_t *seg = calloc(1, sizeof(segment_t));
+    if (seg == NULL) {
+        return NULL;
+    }
+    seg->fd = open(path, O_RDWR | flags, 0600);
+    if (seg->fd == -1) {
+        free(seg);
+        return NULL;
+    }
+    seg->id = id;
+    atomic_init(&seg->refs, 1);
+    if (flags & O_CREAT) {
+        // Make the new segment's directory entry durable
+        int dir_fd = open(store->dir, O_RDONLY | O_DIRECTORY);
+        if (dir_fd != -1) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+
+    pthread_rwlock_wrlock(&store->index_lock);
+    if (id >= store->nsegs) {
+        segment_t **segs = realloc(store->segs, (id + 1) * sizeof(segment_t *));
+        if (segs == NULL) {
+            pthread_rwlock_unlock(&store->index_lock);
+            close(seg->fd);
+            free(seg);
+            return NULL;
+        }
+        for (uint32_t i = store->nsegs; i <= id; i++) {
+            segs[i] = NULL;
+        }
+        store->segs = segs;
+        store->nsegs = id + 1;
+    }
+    store->segs[id] = seg;
+    pthread_rwlock_unlock(&store->index_lock);
+    return seg;
+}
+
+// function to find an entry; caller holds index_lock
+static entry_t *index_find(store_t *store, const char *uri) {
+    entry_t *e = store->buckets[store_hash(uri) % store->nbuckets];
+    while (e != NULL && strcmp(e->uri, uri) != 0) {
+        e = e->next;
+    }
+    return e;
+}
+
+// function to double the number of buckets; caller holds index_lock for writing
+static void index_grow(store_t *store) {
+    size_t nbuckets = store->nbuckets * 2;
+    entry_t **buckets = calloc(nbuckets, sizeof(entry_t *));
+    if (buckets == NULL) {
+        return; // keep the longer chains
+    }
+    for (size_t i = 0; i < store->nbuckets; i++) {
+        entry_t *e = store->buckets[i];
+        while (e != NULL) {
+            entry_t *next = e->next;
+            size_t b = store_hash(e->uri) % nbuckets;
+            e->next = buckets[b];
+            buckets[b] = e;
+            e = next;
+        }
+    }
+    free(store->buckets);
+    store->buckets = buckets;
+    store->nbuckets = nbuckets;
+}
+
+// function to compute the bytes a record occupies on disk
+static uint64_t record_size(size_t uri_len, uint64_t length) {
+    return sizeof(record_t) + uri_len + length;
+}
+
+// function to point uri at a record; caller holds index_lock for writing.
+// Returns 1 if uri already had an entry, 0 if it is new, -1 on error.
+static int index_put(
+    store_t *store, const char *uri, segment_t *seg, off_t record, uint64_t length, uint64_t seq) {
+    entry_t *e = index_find(store, uri);
+    int existed = e != NULL;
+    if (e == NULL) {
+        e = malloc(sizeof(entry_t));
+        if (e == NULL) {
+            return -1;
+        }
+        strcpy(e->uri, uri);
+        size_t b = store_hash(uri) % store->nbuckets;
+        e->next = store->buckets[b];
+        store->buckets[b] = e;
+        store->count++;
+    } else {
+        e->seg->live -= record_size(strlen(uri), e->length); // the old version is now dead
+    }
+    e->seg = seg;
+    e->record = record;
+    e->length = length;
+    e->seq = seq;
+    seg->live += record_size(strlen(uri), length);
+    if (store->count > store->nbuckets) {
+        index_grow(store);
+    }
+    return existed;
+}
+
+// function to write a record header and its URI
+static int record_write(int fd, off_t offset, const record_t *rec, const char *uri) {
+    struct iovec iov[2] = { { (void *) rec, sizeof(record_t) }, { (void *) uri, rec->uri_len } };
+    ssize_t want = sizeof(record_t) + rec->uri_len;
+    return pwritev(fd, iov, 2, offset) == want ? 0 : -1;
+}
+
+// function to mark a record committed with its sequence number
+static int record_commit(int fd, off_t offset, uint64_t seq) {
+    // state and seq are adjacent in record_t, so one write flips both
+    char commit[sizeof(uint32_t) + sizeof(uint64_t)];
+    uint32_t state = RECORD_COMMITTED;
+    memcpy(commit, &state, sizeof(state));
+    memcpy(commit + sizeof(state), &seq, sizeof(seq));
+    ssize_t wb = pwrite(fd, commit, sizeof(commit), offset + offsetof(record_t, state));
+    return wb == (ssize_t) sizeof(commit) ? 0 : -1;
+}
+
+// function to reserve space in the active segment and write a pending header.
+// Pins the segment and counts a writer on it.
+static segment_t *store_reserve(
+    store_t *store, const char *uri, uint64_t length, uint64_t seq, off_t *record) {
+    size_t uri_len = strlen(uri);
+    uint64_t size = record_size(uri_len, length);
+
+    pthread_mutex_lock(&store->append_lock);
+    segment_t *seg = store->active;
+    if (seg->size > 0 && seg->size + size > SEGMENT_MAX) {
+        // Seal the active segment and start the next one
+        segment_t *next = segment_open(store, store->nsegs, O_CREAT | O_EXCL);
+        if (next != NULL) {
+            store->active = seg = next;
+        }
+    }
+    *record = seg->size;
+    record_t rec = { STORE_MAGIC, RECORD_PENDING, seq, length, uri_len, 0 };
+    if (record_write(seg->fd, *record, &rec, uri) == -1) {
+        pthread_mutex_unlock(&store->append_lock);
+        return NULL;
+    }
+    seg->size += size;
+    seg->writers++;
+    segment_pin(seg);
+    pthread_mutex_unlock(&store->append_lock);
+    return seg;
+}
+
+// function to finish a reservation made by store_reserve
+static void store_unreserve(store_t *store, segment_t *seg) {
+    pthread_mutex_lock(&store->append_lock);
+    seg->writers--;
+    pthread_mutex_unlock(&store->append_lock);
+    segment_unpin(seg);
+}
+
+// function to rebuild the index from one segment's headers
+static int segment_scan(store_t *store, segment_t *seg) {
+    struct stat st;
+    if (fstat(seg->fd, &st) == -1) {
+        return -1;
+    }
+    off_t offset = 0;
+    record_t rec;
+    char uri[64];
+    while (offset + (off_t) sizeof(record_t) <= st.st_size) {
+        if (pread(seg->fd, &rec, sizeof(rec), offset) != sizeof(rec) || rec.magic != STORE_MAGIC
+            || rec.uri_len == 0 || rec.uri_len >= sizeof(uri)
+            || offset + (off_t) record_size(rec.uri_len, rec.length) > st.st_size) {
+            break; // torn write at the tail
+        }
+        if (rec.state == RECORD_COMMITTED
+            && pread(seg->fd, uri, rec.uri_len, offset + sizeof(rec)) == rec.uri_len) {
+            uri[rec.uri_len] = '\0';
+            entry_t *e = index_find(store, uri);
+            if (e == NULL || e->seq < rec.seq) {
+                index_put(store, uri, seg, offset, rec.length, rec.seq);
+            }
+            if (rec.seq > store->seq) {
+                store->seq = rec.seq;
+            }
+        }
+        offset += record_size(rec.uri_len, rec.length);
+    }
+    // Drop a torn tail so new records follow the last whole one
+    if (offset < st.st_size && ftruncate(seg->fd, offset) == -1) {
+        return -1;
+    }
+    seg->size = offset;
+    return 0;
+}
+
+// function to copy n bytes between two files at explicit offsets
+static int copy_range(int in, off_t in_off, int out, off_t out_off, uint64_t n) {
+    while (n > 0) {
+        ssize_t copied = copy_file_range(in, &in_off, out, &out_off, n, 0);
+        if (copied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL)) {
+            // Fall back to copying through a buffer
+            char buf[65536];
+            ssize_t rb = pread(in, buf, n < sizeof(buf) ? n : sizeof(buf), in_off);
+            if (rb <= 0 || pwrite(out, buf, rb, out_off) != rb) {
+                return -1;
+            }
+            copied = rb;
+            in_off += rb;
+            out_off += rb;
+        } else if (copied <= 0) {
+            return -1;
+        }
+        n -= copied;
+    }
+    return 0;
+}
+
+// function to move every live record out of a sealed segment and retire it
+static void segment_compact(store_t *store, segment_t *seg) {
+    off_t offset = 0;
+    record_t rec;
+    char uri[64];
+    while (offset < seg->size) {
+        if (pread(seg->fd, &rec, sizeof(rec), offset) != sizeof(rec) || rec.magic != STORE_MAGIC
+            || rec.uri_len == 0 || rec.uri_len >= sizeof(uri)
+            || pread(seg->fd, uri, rec.uri_len, offset + sizeof(rec)) != rec.uri_len) {
+            return; // leave the segment alone and retry next pass
+        }
+        uri[rec.uri_len] = '\0';
+        uint64_t size = record_size(rec.uri_len, rec.length);
+
+        pthread_rwlock_rdlock(&store->index_lock);
+        entry_t *e = index_find(store, uri);
+        bool live = e != NULL && e->seg == seg && e->record == offset;
+        pthread_rwlock_unlock(&store->index_lock);
+
+        if (live) {
+            // Copy the record to the active segment under its original sequence number
+            off_t record;
+            segment_t *dst = store_reserve(store, uri, rec.length, rec.seq, &record);
+            if (dst == NULL) {
+                return;
+            }
+            off_t body = offset + sizeof(rec) + rec.uri_len;
+            // The copy is synced before the old segment can be unlinked
+            if (copy_range(seg->fd, body, dst->fd, record + sizeof(rec) + rec.uri_len, rec.length)
+                    == -1
+                || record_commit(dst->fd, record, rec.seq) == -1 || fdatasync(dst->fd) == -1) {
+                store_unreserve(store, dst);
+                return;
+            }
+            pthread_rwlock_wrlock(&store->index_lock);
+            e = index_find(store, uri);
+            if (e != NULL && e->seg == seg && e->record == offset) {
+                index_put(store, uri, dst, record, rec.length, rec.seq);
+            }
+            pthread_rwlock_unlock(&store->index_lock);
+            store_unreserve(store, dst);
+        }
+        offset += size;
+    }
+
+    // Nothing points at the segment any more; readers still pinning it keep it open
+    pthread_rwlock_wrlock(&store->index_lock);
+    store->segs[seg->id] = NULL;
+    pthread_rwlock_unlock(&store->index_lock);
+    char path[PATH_MAX];
+    segment_path(store, seg->id, path);
+    unlink(path);
+    segment_unpin(seg); // the table's reference
+}
+
+// function to run compaction passes until the store closes
+static void *store_compactor(void *arg) {
+    store_t *store = arg;
+    pthread_mutex_lock(&store->compact_mut);
+    while (!store->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += COMPACT_INTERVAL;
+        pthread_cond_timedwait(&store->compact_cond, &store->compact_mut, &deadline);
+        if (store->stopping) {
+            break;
+        }
+        pthread_mutex_unlock(&store->compact_mut);
+
+        for (uint32_t id = 0;; id++) {
+            // Pick sealed segments with no PUTs in flight that are less than half live
+            segment_t *seg = NULL;
+            pthread_mutex_lock(&store->append_lock);
+            pthread_rwlock_rdlock(&store->index_lock);
+            bool done = id >= store->nsegs;
+            if (!done && store->segs[id] != NULL && store->segs[id] != store->active
+                && store->segs[id]->writers == 0
+                && store->segs[id]->live * 2 < (uint64_t) store->segs[id]->size) {
+                seg = store->segs[id];
+                segment_pin(seg);
+            }
+            pthread_rwlock_unlock(&store->index_lock);
+            pthread_mutex_unlock(&store->append_lock);
+            if (done) {
+                break;
+            }
+            if (seg != NULL) {
+                segment_compact(store, seg);
+                segment_unpin(seg);
+            }
+        }
+
+        pthread_mutex_lock(&store->compact_mut);
+    }
+    pthread_mutex_unlock(&store->compact_mut);
+    return NULL;
+}
+
+// function to open the store and rebuild its index
+store_t *store_open(const char *dir) {
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        return NULL;
+    }
+    store_t *store = calloc(1, sizeof(store_t));
+    if (store == NULL) {
+        return NULL;
+    }
+    store->dir = strdup(dir);
+    store->nbuckets = INDEX_INITIAL;
+    store->buckets = calloc(store->nbuckets, sizeof(entry_t *));
+    pthread_rwlock_init(&store->index_lock, NULL);
+    pthread_mutex_init(&store->append_lock, NULL);
+    pthread_mutex_init(&store->compact_mut, NULL);
+    pthread_cond_init(&store->compact_cond, NULL);
+
+    // Open every segment, then replay them in id order
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        store_close(&store);
+        return NULL;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        unsigned id;
+        char tail;
+        if (sscanf(ent->d_name, "seg-%u.lo%c", &id, &tail) == 2 && tail == 'g') {
+            segment_open(store, id, 0);
+        }
+    }
+    closedir(d);
+    for (uint32_t id = 0; id < store->nsegs; id++) {
+        if (store->segs[id] != NULL) {
+            segment_scan(store, store->segs[id]);
+            store->active = store->segs[id];
+        }
+    }
+    if (store->active == NULL || store->active->size >= SEGMENT_MAX) {
+        store->active = segment_open(store, store->nsegs, O_CREAT | O_EXCL);
+    }
+    if (store->active == NULL) {
+        store_close(&store);
+        return NULL;
+    }
+
+    pthread_create(&store->compactor, NULL, store_compactor, store);
+    return store;
+}
+
+// function to close the store
+void store_close(store_t **store) {
+    store_t *s = *store;
+    if (s->active != NULL) {
+        pthread_mutex_lock(&s->compact_mut);
+        s->stopping = true;
+        pthread_cond_signal(&s->compact_cond);
+        pthread_mutex_unlock(&s->compact_mut);
+        pthread_join(s->compactor, NULL);
+    }
+    for (size_t i = 0; i < s->nbuckets; i++) {
+        entry_t *e = s->buckets[i];
+        while (e != NULL) {
+            entry_t *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    for (uint32_t id = 0; id < s->nsegs; id++) {
+        if (s->segs[id] != NULL) {
+            segment_unpin(s->segs[id]);
+        }
+    }
+    pthread_rwlock_destroy(&s->index_lock);
+    pthread_mutex_destroy(&s->append_lock);
+    pthread_mutex_destroy(&s->compact_mut);
+    pthread_cond_destroy(&s->compact_cond);
+    free(s->segs);
+    free(s->buckets);
+    free(s->dir);
+    free(s);
+    *store = NULL;
+}
+
+// function to find the latest committed version of an object
+int store_lookup(store_t *store, const char *uri, store_obj_t *obj) {
+    pthread_rwlock_rdlock(&store->index_lock);
+    entry_t *e = index_find(store, uri);
+    if (e == NULL) {
+        pthread_rwlock_unlock(&store->index_lock);
+        return -1;
+    }
+    obj->seg = e->seg;
+    obj->fd = e->seg->fd;
+    obj->offset = e->record + sizeof(record_t) + strlen(uri);
+    obj->length = e->length;
+    segment_pin(e->seg);
+    pthread_rwlock_unlock(&store->index_lock);
+    return 0;
+}
+
+// function to release an object found by store_lookup
+void store_release(store_t *store, store_obj_t *obj) {
+    (void) store;
+    segment_unpin(obj->seg);
+}
+
+// function to start writing a new version of an object
+int store_begin(store_t *store, const char *uri, uint64_t length, store_txn_t *txn) {
+    if (strlen(uri) >= sizeof(txn->uri)) {
+        return -1;
+    }
+    txn->committed = false;
+    txn->length = 0;
+    txn->seg = store_reserve(store, uri, length, 0, &txn->record);
+    if (txn->seg == NULL) {
+        return -1;
+    }
+    strcpy(txn->uri, uri);
+    txn->offset = txn->record + sizeof(record_t) + strlen(uri);
+    txn->length = length;
+
+    // A private descriptor gives this PUT its own file offset to stream the body at
+    char path[PATH_MAX];
+    segment_path(store, txn->seg->id, path);
+    txn->fd = open(path, O_WRONLY);
+    if (txn->fd == -1 || lseek(txn->fd, txn->offset, SEEK_SET) == -1) {
+        store_finish(store, txn);
+        return -1;
+    }
+    // Reserve the body's blocks now so concurrent appends do not interleave their extents
+    if (length > 0) {
+        fallocate(txn->fd, FALLOC_FL_KEEP_SIZE, txn->offset, length);
+    }
+    return 0;
+}
+
+// function to commit a new version of an object
+int store_commit(store_t *store, store_txn_t *txn, bool *existed) {
+    pthread_rwlock_wrlock(&store->index_lock);
+    uint64_t seq = ++store->seq;
+    int rc = record_commit(txn->seg->fd, txn->record, seq);
+    if (rc == 0) {
+        int put = index_put(store, txn->uri, txn->seg, txn->record, txn->length, seq);
+        *existed = put == 1;
+        rc = put == -1 ? -1 : 0;
+    }
+    txn->committed = rc == 0;
+    pthread_rwlock_unlock(&store->index_lock);
+    return rc;
+}
+
+// function to end a write, committed or not
+void store_finish(store_t *store, store_txn_t *txn) {
+    if (txn->fd != -1) {
+        if (!txn->committed && txn->length > 0) {
+            // The record is dead; give back the blocks reserved for its body before compaction does
+            fallocate(txn->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, txn->offset, txn->length);
+        }
+        close(txn->fd);
+    }
+    store_unreserve(store, txn->seg);
+}
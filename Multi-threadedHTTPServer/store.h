@@ -0,0 +1,125 @@
+/**
+ * @File store.h
+ *
+ * A log-structured object store.  Objects are appended to segment files
+ * in one directory instead of getting a file of their own, and an
+ * in-memory hash index maps each URI to the segment, offset, and length
+ * of its latest committed version.  The index is rebuilt from the
+ * segment record headers when the store is opened, and a background
+ * thread compacts segments that are mostly dead.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct Store store_t;
+typedef struct Segment segment_t;
+
+/** @struct store_obj_t
+ *
+ *  @brief A committed object located by store_lookup.  The segment is
+ *         pinned until store_release, so fd stays valid even if the
+ *         segment is compacted away meanwhile.
+ */
+typedef struct {
+    segment_t *seg; // pinned segment holding the object
+    int fd; // read-only descriptor of the segment
+    off_t offset; // offset of the body within the segment
+    uint64_t length; // body length in bytes
+} store_obj_t;
+
+/** @struct store_txn_t
+ *
+ *  @brief A PUT in progress.  Space for the record is reserved up
+ *         front, so concurrent PUTs stream their bodies in parallel.
+ */
+typedef struct {
+    segment_t *seg; // segment the record was reserved in
+    int fd; // private write descriptor positioned at the body
+    off_t record; // offset of the record header
+    off_t offset; // offset of the body
+    uint64_t length; // body length in bytes
+    char uri[64]; // URI being written
+    bool committed; // store_commit succeeded
+} store_txn_t;
+
+/** @brief Opens (creating if needed) the store in dir, rebuilds the
+ *         index from the segment headers, and starts compaction.
+ *
+ *  @param dir the directory holding the segment files
+ *
+ *  @return a pointer to the store, or NULL on error.  Sets errno
+ *          according to any errors that occur.
+ */
+store_t *store_open(const char *dir);
+
+/** @brief Stops compaction, closes every segment, and frees the store.
+ *         Sets *store to NULL.
+ *
+ *  @param store the store to close
+ */
+void store_close(store_t **store);
+
+/** @brief Finds the latest committed version of uri.
+ *
+ *  @param store the store to search
+ *
+ *  @param uri the object to find
+ *
+ *  @param obj filled in with the object's location on success
+ *
+ *  @return 0 if found, or -1 if the store has no such object
+ */
+int store_lookup(store_t *store, const char *uri, store_obj_t *obj);
+
+/** @brief Unpins the segment of an object found by store_lookup.
+ *
+ *  @param store the store the object came from
+ *
+ *  @param obj the object to release
+ */
+void store_release(store_t *store, store_obj_t *obj);
+
+/** @brief Reserves space for a new version of uri and writes its
+ *         pending record header.  The caller writes exactly length
+ *         bytes of body to txn->fd, optionally calls store_commit, and
+ *         always ends with store_finish.
+ *
+ *  @param store the store to write to
+ *
+ *  @param uri the object being written
+ *
+ *  @param length the body length in bytes
+ *
+ *  @param txn filled in with the reservation
+ *
+ *  @return 0 on success, or -1 on error
+ */
+int store_begin(store_t *store, const char *uri, uint64_t length, store_txn_t *txn);
+
+/** @brief Marks the record committed and points the index at it.
+ *         txn->fd stays open, so the caller can make the commit durable
+ *         before calling store_finish.
+ *
+ *  @param store the store being written to
+ *
+ *  @param txn the reservation from store_begin
+ *
+ *  @param existed set to whether uri already had a committed version
+ *
+ *  @return 0 on success, or -1 on error
+ */
+int store_commit(store_t *store, store_txn_t *txn, bool *existed);
+
+/** @brief Closes txn->fd and ends the reservation.  A reservation that
+ *         was never committed is abandoned, and compaction reclaims its
+ *         space.
+ *
+ *  @param store the store being written to
+ *
+ *  @param txn the reservation from store_begin
+ */
+void store_finish(store_t *store, store_txn_t *txn);
@@ -0,0 +1,238 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUF_SIZE   65536 // bytes of events a thread buffers before appending them to the file
+#define EVENT_MAX  1024 // room one formatted event may need
+#define MAX_TRACKS (1 << 20) // highest socket whose accept time is kept
+
+// A thread's formatted events
+typedef struct TraceBuf {
+    pthread_mutex_t lock; // taken by its thread to append, and by a flush from another
+    size_t len; // bytes in data
+    char data[BUF_SIZE];
+    struct TraceBuf *next; // in the tracer's list
+} trace_buf_t;
+
+typedef struct Tracer {
+    FILE *file; // the trace being written
+    pthread_mutex_t lock; // guards file and bufs
+    trace_buf_t *bufs; // every thread's buffer
+    long every; // sample one of every this many connections
+    int pid; // process the events belong to
+    uint64_t origin_us; // time 0 in the trace
+    uint64_t *accepted; // accept time of each socket, by descriptor
+    int tracks; // entries in accepted
+    atomic_ulong seen; // connections begun
+    atomic_ulong sampled; // requests traced
+    atomic_ulong spans; // spans written
+    atomic_ulong dropped; // requests that had more than TRACE_SPANS spans
+} tracer_t;
+
+static __thread trace_buf_t *local = NULL; // the calling thread's buffer
+
+// function to read a monotonic clock in microseconds
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// function to append a buffer to the file; the tracer and the buffer are locked
+static void flush_locked(tracer_t *t, trace_buf_t *b) {
+    fwrite(b->data, 1, b->len, t->file);
+    b->len = 0;
+}
+
+// function to find or make the calling thread's buffer
+static trace_buf_t *thread_buf(tracer_t *t) {
+    if (local == NULL) {
+        trace_buf_t *b = calloc(1, sizeof(trace_buf_t));
+        if (b == NULL) {
+            return NULL;
+        }
+        pthread_mutex_init(&b->lock, NULL);
+        pthread_mutex_lock(&t->lock);
+        b->next = t->bufs;
+        t->bufs = b;
+        pthread_mutex_unlock(&t->lock);
+        local = b;
+    }
+    return local;
+}
+
+// function to copy a string into a JSON string body, escaping as needed
+static void json_copy(char *dst, size_t cap, const char *src) {
+    size_t n = 0;
+    for (; *src != '\0' && n + 7 < cap; src++) {
+        unsigned char c = *src;
+        if (c == '"' || c == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = c;
+        } else if (c < 0x20) {
+            n += snprintf(dst + n, cap - n, "\\u%04x", c);
+        } else {
+            dst[n++] = c;
+        }
+    }
+    dst[n] = '\0';
+}
+
+// function to format one complete event into a buffer with room for it
+static void put_event(tracer_t *t, trace_buf_t *b, const char *name, const char *cat, uint64_t start_us,
+    uint64_t end_us, int tid, const char *id) {
+    // Every event but the opening one is preceded by a comma
+    b->len += snprintf(b->data + b->len, BUF_SIZE - b->len,
+        ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,\"pid\":%d,\"tid\":%d,"
+        "\"args\":{\"request_id\":\"%s\"}}",
+        name, cat, (unsigned long) (start_us - t->origin_us), (unsigned long) (end_us - start_us), t->pid, tid, id);
+}
+
+// function to create a tracer
+tracer_t *tracer_new(const char *path, long every) {
+    tracer_t *t = calloc(1, sizeof(tracer_t));
+    if (t == NULL) {
+        return NULL;
+    }
+    struct rlimit limit;
+    t->tracks = MAX_TRACKS;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_max < MAX_TRACKS) {
+        t->tracks = limit.rlim_max;
+    }
+    // Untouched pages of a large calloc are never committed
+    t->accepted = calloc(t->tracks, sizeof(uint64_t));
+    t->file = fopen(path, "w");
+    if (t->accepted == NULL || t->file == NULL) {
+        if (t->file != NULL) {
+            fclose(t->file);
+        }
+        free(t->accepted);
+        free(t);
+        return NULL;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    t->every = every > 0 ? every : 1;
+    t->pid = getpid();
+    t->origin_us = now_us();
+    fprintf(t->file, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,"
+                     "\"args\":{\"name\":\"httpserver\"}}",
+        t->pid);
+    return t;
+}
+
+// function to flush and free a tracer
+void tracer_delete(tracer_t **t) {
+    tracer_t *tr = *t;
+    trace_buf_t *b = tr->bufs;
+    while (b != NULL) {
+        trace_buf_t *next = b->next;
+        flush_locked(tr, b);
+        pthread_mutex_destroy(&b->lock);
+        free(b);
+        b = next;
+    }
+    local = NULL;
+    fprintf(tr->file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(tr->file);
+    pthread_mutex_destroy(&tr->lock);
+    free(tr->accepted);
+    free(tr);
+    *t = NULL;
+}
+
+// function to note when a socket was accepted
+void tracer_accepted(tracer_t *t, int fd) {
+    if (fd >= 0 && fd < t->tracks) {
+        t->accepted[fd] = now_us();
+    }
+}
+
+// function to start a request's spans
+void trace_begin(tracer_t *t, trace_req_t *req, int fd) {
+    req->sampled = t != NULL && atomic_fetch_add(&t->seen, 1) % t->every == 0;
+    if (!req->sampled) {
+        return;
+    }
+    uint64_t now = now_us();
+    req->tid = fd;
+    req->start_us = fd < t->tracks && t->accepted[fd] != 0 ? t->accepted[fd] : now;
+    req->count = 0;
+    strcpy(req->what, "request");
+    strcpy(req->id, "0");
+    trace_span(req, "queue", req->start_us);
+}
+
+// function to read the clock if the request is sampled
+uint64_t trace_now(const trace_req_t *req) {
+    return req->sampled ? now_us() : 0;
+}
+
+// function to record a span ending now
+void trace_span(trace_req_t *req, const char *name, uint64_t start_us) {
+    if (!req->sampled) {
+        return;
+    }
+    if (req->count >= TRACE_SPANS) {
+        req->count = TRACE_SPANS + 1; // counted as dropped when the request ends
+        return;
+    }
+    req->spans[req->count].name = name;
+    req->spans[req->count].start_us = start_us;
+    req->spans[req->count].end_us = now_us();
+    req->count++;
+}
+
+// function to format a finished request's spans
+void trace_end(tracer_t *t, trace_req_t *req) {
+    if (t == NULL || !req->sampled) {
+        return;
+    }
+    req->sampled = false;
+    trace_buf_t *b = thread_buf(t);
+    if (b == NULL) {
+        return;
+    }
+    int count = req->count < TRACE_SPANS ? req->count : TRACE_SPANS;
+    if (req->count > TRACE_SPANS) {
+        atomic_fetch_add(&t->dropped, 1);
+    }
+    char what[sizeof(req->what) * 6], id[sizeof(req->id) * 6];
+    json_copy(what, sizeof(what), req->what);
+    json_copy(id, sizeof(id), req->id);
+    pthread_mutex_lock(&b->lock);
+    if (b->len + EVENT_MAX * (count + 1) > BUF_SIZE) {
+        // The tracer is locked before a buffer, as in tracer_dump_stats
+        pthread_mutex_unlock(&b->lock);
+        pthread_mutex_lock(&t->lock);
+        pthread_mutex_lock(&b->lock);
+        flush_locked(t, b);
+        pthread_mutex_unlock(&t->lock);
+    }
+    put_event(t, b, what, "request", req->start_us, now_us(), req->tid, id);
+    for (int i = 0; i < count; i++) {
+        put_event(t, b, req->spans[i].name, "span", req->spans[i].start_us, req->spans[i].end_us, req->tid, id);
+    }
+    pthread_mutex_unlock(&b->lock);
+    atomic_fetch_add(&t->sampled, 1);
+    atomic_fetch_add(&t->spans, count);
+}
+
+// function to flush every buffer and report the counters
+void tracer_dump_stats(tracer_t *t, FILE *out) {
+    pthread_mutex_lock(&t->lock);
+    for (trace_buf_t *b = t->bufs; b != NULL; b = b->next) {
+        pthread_mutex_lock(&b->lock);
+        flush_locked(t, b);
+        pthread_mutex_unlock(&b->lock);
+    }
+    fflush(t->file);
+    pthread_mutex_unlock(&t->lock);
+    fprintf(out, "STATS,trace,seen=%lu,sampled=%lu,spans=%lu,dropped=%lu\n", atomic_load(&t->seen),
+        atomic_load(&t->sampled), atomic_load(&t->spans), atomic_load(&t->dropped));
+}
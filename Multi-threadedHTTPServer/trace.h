@@ -0,0 +1,112 @@
+/**
+ * @File trace.h
+ *
+ * Per-request span tracing.  A sampled request records how long it
+ * waited in the queue and spent reading its head, parsing, opening,
+ * locking, moving the body, and sending the response.  When it
+ * finishes, its spans are formatted into a buffer owned by the calling
+ * thread, and full buffers are appended to a Chrome trace JSON file
+ * that chrome://tracing and Perfetto load.  Each connection gets its
+ * own track, and every event carries the request's Request-Id.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_SPANS 12 // spans kept per request; later ones are dropped
+
+typedef struct Tracer tracer_t;
+
+/** @struct trace_req_t
+ *
+ *  @brief The spans of one request, embedded in its connection context.
+ */
+typedef struct {
+    bool sampled; // spans are being recorded
+    int tid; // track the events go on: the connection's socket
+    uint64_t start_us; // when the connection was accepted
+    int count; // spans recorded
+    struct {
+        const char *name; // a string literal
+        uint64_t start_us;
+        uint64_t end_us;
+    } spans[TRACE_SPANS];
+    char what[80]; // method and target, e.g. "GET /name"
+    char id[48]; // the Request-Id header, or "0"
+} trace_req_t;
+
+/** @brief Creates the trace file and writes its opening.
+ *
+ *  @param path the file to write
+ *
+ *  @param every trace one of every this many connections, at least 1
+ *
+ *  @return the tracer, or NULL on failure
+ */
+tracer_t *tracer_new(const char *path, long every);
+
+/** @brief Writes every buffered event, closes the file, and frees the
+ *         tracer.  No thread may be tracing anymore.
+ *
+ *  @param t the tracer to delete
+ */
+void tracer_delete(tracer_t **t);
+
+/** @brief Notes when a connection was accepted, so its queue wait can be
+ *         traced once a worker takes it.
+ *
+ *  @param t the tracer
+ *
+ *  @param fd the accepted socket
+ */
+void tracer_accepted(tracer_t *t, int fd);
+
+/** @brief Starts a request, deciding whether it is sampled.  If so, the
+ *         wait since tracer_accepted is its first span.
+ *
+ *  @param t the tracer, or NULL when tracing is off
+ *
+ *  @param req the request's spans
+ *
+ *  @param fd the connection's socket
+ */
+void trace_begin(tracer_t *t, trace_req_t *req, int fd);
+
+/** @brief Reads the clock for a span about to start.
+ *
+ *  @param req the request
+ *
+ *  @return the time in microseconds, or 0 if req is not sampled
+ */
+uint64_t trace_now(const trace_req_t *req);
+
+/** @brief Records a span that ends now.
+ *
+ *  @param req the request; nothing is recorded unless it is sampled
+ *
+ *  @param name the span name, a string literal
+ *
+ *  @param start_us when it started, from trace_now
+ */
+void trace_span(trace_req_t *req, const char *name, uint64_t start_us);
+
+/** @brief Finishes a request, formatting its spans into the calling
+ *         thread's buffer.
+ *
+ *  @param t the tracer, or NULL when tracing is off
+ *
+ *  @param req the request
+ */
+void trace_end(tracer_t *t, trace_req_t *req);
+
+/** @brief Writes out every thread's buffered events, then a STATS line
+ *         with the tracing counters.
+ *
+ *  @param t the tracer
+ *
+ *  @param out the stream to write to
+ */
+void tracer_dump_stats(tracer_t *t, FILE *out);
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE // fallocate, O_DIRECT, F_SETPIPE_SZ, sync_file_range
+
+#include "upload.h"
+
+#include "green.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#define DIRECT_ALIGN 4096 // buffer alignment O_DIRECT accepts on common filesystems
+
+// A drain thread, reused across uploads
+typedef struct Drainer {
+    pthread_t thread;
+    int pipe_r; // read end of the current upload's staging pipe
+    int fd; // destination file of the current upload
+    bool posted; // an upload is waiting for the thread to take it
+    bool done; // the thread has written, or given up on, the current body
+    bool failed; // set if the destination could not be written
+    bool busy; // claimed by a worker
+    pthread_cond_t cond; // signals posted and done
+} drainer_t;
+
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER; // guards every drainer's job fields
+static drainer_t *drainers = NULL; // the pool, empty until upload_start
+static int drainer_count = 0;
+static bool stopping = false; // set by upload_stop
+
+// function to write a buffer at an offset, resuming after partial writes
+static int pwrite_all(int fd, const char *buf, size_t n, off_t offset) {
+    while (n > 0) {
+        ssize_t wb = pwrite(fd, buf, n, offset);
+        if (wb == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += wb;
+        n -= wb;
+        offset += wb;
+    }
+    return 0;
+}
+
+// function to push written pages out and drop them from the page cache
+static void drop_cached(int fd, off_t offset, off_t n) {
+    sync_file_range(fd, offset, n,
+        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, offset, n, POSIX_FADV_DONTNEED);
+}
+
+// function to move one body from the pipe to the file: pipe -> aligned buffer -> file.
+// The pipe is read to its end even once a write fails, so the worker never blocks on it
+static void drain_body(drainer_t *d, char *buf) {
+    int flags = fcntl(d->fd, F_GETFL);
+    bool direct = fcntl(d->fd, F_SETFL, flags | O_DIRECT) == 0;
+
+    off_t offset = 0;
+    size_t fill = 0;
+    while (true) {
+        ssize_t rb = read(d->pipe_r, buf + fill, DIRECT_CHUNK - fill);
+        if (rb == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rb <= 0) {
+            break; // the body is complete or the worker gave up
+        }
+        fill += rb;
+        if (fill == DIRECT_CHUNK) {
+            if (!d->failed && pwrite_all(d->fd, buf, fill, offset) == -1) {
+                d->failed = true;
+            } else if (!d->failed && !direct) {
+                drop_cached(d->fd, offset, fill); // no O_DIRECT here, so evict as we go
+            }
+            offset += fill;
+            fill = 0;
+        }
+    }
+
+    // The tail is not block-sized, so it goes through the page cache and is then dropped
+    fcntl(d->fd, F_SETFL, flags);
+    if (!d->failed && fill > 0) {
+        if (pwrite_all(d->fd, buf, fill, offset) == -1) {
+            d->failed = true;
+        } else {
+            drop_cached(d->fd, offset, fill);
+        }
+    }
+}
+
+// function run by each drain thread: take the bodies workers post, one at a time
+static void *upload_drain(void *arg) {
+    drainer_t *d = arg;
+    void *mem = NULL;
+    bool have_buf = posix_memalign(&mem, DIRECT_ALIGN, DIRECT_CHUNK) == 0;
+    pthread_mutex_lock(&drain_lock);
+    while (true) {
+        while (!d->posted && !stopping) {
+            pthread_cond_wait(&d->cond, &drain_lock);
+        }
+        if (!d->posted) {
+            break;
+        }
+        d->posted = false;
+        pthread_mutex_unlock(&drain_lock);
+        if (have_buf) {
+            drain_body(d, mem);
+        } else {
+            d->failed = true; // closing the read end makes the worker's writes fail instead of block
+        }
+        close(d->pipe_r);
+        pthread_mutex_lock(&drain_lock);
+        d->done = true;
+        pthread_cond_broadcast(&d->cond);
+    }
+    pthread_mutex_unlock(&drain_lock);
+    free(mem);
+    return NULL;
+}
+
+// function to return the blocks fallocate reserved past what was written; truncating
+// to the current size frees blocks kept past EOF, which punching a hole there does not
+static uint64_t unreserve(int fd, uint64_t length) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return 0;
+    }
+    if ((uint64_t) st.st_size < length) {
+        ftruncate(fd, st.st_size);
+    }
+    return st.st_size;
+}
+
+// function to start the drain threads
+int upload_start(int count) {
+    drainers = calloc(count, sizeof(drainer_t));
+    if (drainers == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        drainer_t *d = &drainers[i];
+        pthread_cond_init(&d->cond, NULL);
+        if (pthread_create(&d->thread, NULL, upload_drain, d) != 0) {
+            pthread_cond_destroy(&d->cond);
+            upload_stop();
+            return -1;
+        }
+        drainer_count++;
+    }
+    return 0;
+}
+
+// function to stop the drain threads
+void upload_stop(void) {
+    pthread_mutex_lock(&drain_lock);
+    stopping = true;
+    for (int i = 0; i < drainer_count; i++) {
+        pthread_cond_broadcast(&drainers[i].cond);
+    }
+    pthread_mutex_unlock(&drain_lock);
+    for (int i = 0; i < drainer_count; i++) {
+        pthread_join(drainers[i].thread, NULL);
+        pthread_cond_destroy(&drainers[i].cond);
+    }
+    free(drainers);
+    drainers = NULL;
+    drainer_count = 0;
+}
+
+// function to claim an idle drainer, without waiting for one
+static drainer_t *claim(void) {
+    drainer_t *d = NULL;
+    pthread_mutex_lock(&drain_lock);
+    for (int i = 0; i < drainer_count && d == NULL; i++) {
+        if (!drainers[i].busy) {
+            d = &drainers[i];
+            d->busy = true;
+        }
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return d;
+}
+
+// function to stream a body through a drainer, over a pipe of its own
+static const Response_t *drain_recv(conn_t *conn, drainer_t *d, int fd) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1) {
+        pthread_mutex_lock(&drain_lock);
+        d->busy = false;
+        pthread_mutex_unlock(&drain_lock);
+        return conn_recv_file(conn, fd);
+    }
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, DIRECT_CHUNK);
+    pthread_mutex_lock(&drain_lock);
+    d->pipe_r = pipe_fds[0];
+    d->fd = fd;
+    d->failed = false;
+    d->done = false;
+    d->posted = true;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&drain_lock);
+
+    const Response_t *res = conn_recv_file(conn, pipe_fds[1]);
+    close(pipe_fds[1]); // end of body for the drain thread
+    pthread_mutex_lock(&drain_lock);
+    while (!d->done) {
+        if (green_running()) {
+            // The drain takes a while, so let the other green threads of the carrier run
+            pthread_mutex_unlock(&drain_lock);
+            green_sleep(1);
+            pthread_mutex_lock(&drain_lock);
+        } else {
+            pthread_cond_wait(&d->cond, &drain_lock);
+        }
+    }
+    bool failed = d->failed;
+    d->busy = false;
+    pthread_mutex_unlock(&drain_lock);
+    if (res == NULL && failed) {
+        res = &RESPONSE_INTERNAL_SERVER_ERROR;
+    }
+    return res;
+}
+
+// function to receive a PUT body into a file
+const Response_t *upload_recv(conn_t *conn, int fd, uint64_t length, uint64_t direct_threshold) {
+    // Reserve the blocks up front; the size still follows what is written
+    if (length > 0) {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, length);
+    }
+    // The body reaches the socket buffer in whatever chunks the helper library uses, so it
+    // is staged through a pipe and re-chunked on a drain thread. With every drain thread busy
+    // the body goes straight to the file instead of waiting, so the pool bounds the threads
+    drainer_t *d = direct_threshold > 0 && length >= direct_threshold ? claim() : NULL;
+    const Response_t *res = d != NULL ? drain_recv(conn, d, fd) : conn_recv_file(conn, fd);
+    // A failed or short upload must not keep the rest of its blocks
+    if (length > 0 && unreserve(fd, length) < length && res == NULL) {
+        res = &RESPONSE_BAD_REQUEST; // the client closed before the end of the body
+    }
+    return res;
+}
@@ -0,0 +1,47 @@
+/**
+ * @File upload.h
+ *
+ * Receiving PUT bodies.  The destination is preallocated from the known
+ * Content-Length so large objects are laid out contiguously, and bodies
+ * past a configurable size bypass the page cache: they are staged
+ * through a pipe into large aligned buffers and written with O_DIRECT,
+ * so bulk uploads do not evict data that GETs are reading.  A small
+ * pool of drain threads does the re-chunking.
+ */
+
+#pragma once
+
+#include "connection.h"
+
+#include <stdint.h>
+
+#define DIRECT_CHUNK (1 << 20) // bytes per O_DIRECT write, a multiple of any block size
+
+/** @brief Starts the drain threads that write bodies with O_DIRECT.
+ *
+ *  @param count the most bodies written with O_DIRECT at once
+ *
+ *  @return 0, or -1 if the threads or their pipes could not be made
+ */
+int upload_start(int count);
+
+/** @brief Stops the drain threads.  No upload may be in progress.
+ */
+void upload_stop(void);
+
+/** @brief Writes the body of a PUT to fd, which must be empty and
+ *         positioned at offset 0.
+ *
+ *  @param conn the parsed PUT
+ *
+ *  @param fd the destination file
+ *
+ *  @param length the body length from Content-Length
+ *
+ *  @param direct_threshold bodies of at least this many bytes bypass the
+ *         page cache while a drain thread is free; 0 disables the bypass
+ *
+ *  @return NULL on success, or the error response to send.  Blocks
+ *          reserved past the end of a short body are released.
+ */
+const Response_t *upload_recv(conn_t *conn, int fd, uint64_t length, uint64_t direct_threshold);
@@ -0,0 +1,58 @@
+#include "util.h"
+
+#include <errno.h>
+#include <time.h>
+
+// function to read the monotonic clock in milliseconds
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// function to hash a string (FNV-1a)
+uint32_t fnv1a(const char *s) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *) s; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// function to write every iovec
+int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t wb = writev(fd, iov, iovcnt);
+        if (wb < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t) wb >= iov->iov_len) {
+            wb -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + wb;
+            iov->iov_len -= wb;
+        }
+    }
+    return 0;
+}
+
+// function to map a status to the message the helper library sends with it
+const char *status_message(int code) {
+    switch (code) {
+    case 200: return "OK\n";
+    case 201: return "Created\n";
+    case 400: return "Bad Request\n";
+    case 403: return "Forbidden\n";
+    case 404: return "Not Found\n";
+    case 408: return "Request Timeout\n";
+    case 501: return "Not Implemented\n";
+    default: return "Internal Server Error\n";
+    }
+}
@@ -0,0 +1,48 @@
+/**
+ * @File util.h
+ *
+ * Small helpers shared by the server's modules: the clock, hashing,
+ * writing, and status messages.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/** @brief Reads the monotonic clock.
+ *
+ *  @return milliseconds since an arbitrary fixed point
+ */
+uint64_t monotonic_ms(void);
+
+/** @brief Hashes a string with 32-bit FNV-1a.
+ *
+ *  @param s the NUL-terminated string
+ *
+ *  @return the hash
+ */
+uint32_t fnv1a(const char *s);
+
+/** @brief Writes every iovec, resuming mid-iovec after a partial write.
+ *         The iovecs are consumed as they are written.
+ *
+ *  @param fd the descriptor to write to
+ *
+ *  @param iov the iovecs
+ *
+ *  @param iovcnt how many there are
+ *
+ *  @return 0, or -1 with errno set
+ */
+int writev_all(int fd, struct iovec *iov, int iovcnt);
+
+/** @brief Maps a status code to the message the helper library sends
+ *         with it, which is also the body of an error response.  HTTP/1.1
+ *         and HTTP/2 both answer from this one table.
+ *
+ *  @param code the status code
+ *
+ *  @return the reason phrase with a trailing newline, e.g. "OK\n"
+ */
+const char *status_message(int code);
@@ -0,0 +1,191 @@
+#include "wheel.h"
+
+#include "util.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LEVELS 4 // wheels, finest first
+#define BITS   6 // bits of the tick indexing each level
+#define SLOTS  (1 << BITS) // slots per level
+#define SPAN   ((uint64_t) 1 << (BITS * LEVELS)) // ticks the wheel can look ahead
+
+typedef struct Wheel {
+    long tick_ms; // resolution
+    uint64_t start_ms; // clock at tick 0
+    uint64_t now; // last tick processed
+    deadline_t slots[LEVELS][SLOTS]; // list heads
+    uint64_t pending; // deadlines armed
+    pthread_t thread; // the wheel thread
+    pthread_mutex_t lock; // guards everything here and every armed deadline
+    pthread_cond_t cv; // signaled when the wheel stops being empty, or on stop
+    bool stopping; // wheel_delete was called
+    uint64_t armed; // wheel_arm calls
+    uint64_t fired; // deadlines fired
+    uint64_t cascaded; // deadlines moved down a level
+} wheel_t;
+
+// function to find the tick the clock is in
+static uint64_t clock_tick(wheel_t *w) {
+    return (monotonic_ms() - w->start_ms) / w->tick_ms;
+}
+
+// function to put a deadline in the slot for its expiry; the wheel is locked
+static void place(wheel_t *w, deadline_t *d) {
+    uint64_t delta = d->expires - w->now;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (uint64_t) 1 << (BITS * (level + 1))) {
+        level++;
+    }
+    deadline_t *head = &w->slots[level][(d->expires >> (BITS * level)) & (SLOTS - 1)];
+    d->next = head->next;
+    d->prev = head;
+    head->next->prev = d;
+    head->next = d;
+}
+
+// function to take a deadline off its slot; the wheel is locked
+static void unlink_deadline(deadline_t *d) {
+    d->prev->next = d->next;
+    d->next->prev = d->prev;
+    d->next = d->prev = NULL;
+}
+
+// function to arm a deadline; the wheel is locked
+static void arm_locked(wheel_t *w, deadline_t *d, long ms) {
+    if (d->armed) {
+        unlink_deadline(d);
+    } else {
+        if (w->pending++ == 0) {
+            w->now = clock_tick(w); // nothing was due while empty, so skip ahead
+            pthread_cond_signal(&w->cv);
+        }
+        d->armed = true;
+    }
+    uint64_t ticks = ms <= 0 ? 1 : ((uint64_t) ms + w->tick_ms - 1) / w->tick_ms;
+    d->expires = w->now + (ticks < SPAN ? ticks : SPAN - 1);
+    place(w, d);
+    w->armed++;
+}
+
+// function to advance the wheel by one tick; the wheel is locked
+static void advance(wheel_t *w) {
+    w->now++;
+    // Each time a level wraps, the next level's current slot comes within reach
+    for (int level = 1; level < LEVELS && (w->now & (((uint64_t) 1 << (BITS * level)) - 1)) == 0; level++) {
+        deadline_t *head = &w->slots[level][(w->now >> (BITS * level)) & (SLOTS - 1)];
+        while (head->next != head) {
+            deadline_t *d = head->next;
+            unlink_deadline(d);
+            place(w, d);
+            w->cascaded++;
+        }
+    }
+    deadline_t *head = &w->slots[0][w->now & (SLOTS - 1)];
+    while (head->next != head) {
+        deadline_t *d = head->next;
+        unlink_deadline(d);
+        d->armed = false;
+        w->pending--;
+        w->fired++;
+        long again = d->fire(d->arg);
+        if (again > 0) {
+            arm_locked(w, d, again);
+        }
+    }
+}
+
+// function run by the wheel thread
+static void *wheel_thread(void *arg) {
+    wheel_t *w = arg;
+    pthread_mutex_lock(&w->lock);
+    while (!w->stopping) {
+        if (w->pending == 0) {
+            pthread_cond_wait(&w->cv, &w->lock);
+            continue;
+        }
+        uint64_t target = clock_tick(w);
+        while (w->now < target && w->pending > 0) {
+            advance(w);
+        }
+        if (w->pending == 0) {
+            continue;
+        }
+        // Sleep until the next tick begins
+        uint64_t wake_ms = w->start_ms + (w->now + 1) * w->tick_ms;
+        struct timespec until = { wake_ms / 1000, (wake_ms % 1000) * 1000000 };
+        pthread_cond_timedwait(&w->cv, &w->lock, &until);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// function to create a wheel
+wheel_t *wheel_new(long tick_ms) {
+    wheel_t *w = calloc(1, sizeof(wheel_t));
+    if (w == NULL) {
+        return NULL;
+    }
+    w->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    w->start_ms = monotonic_ms();
+    for (int level = 0; level < LEVELS; level++) {
+        for (int slot = 0; slot < SLOTS; slot++) {
+            w->slots[level][slot].next = w->slots[level][slot].prev = &w->slots[level][slot];
+        }
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    // The timed wait runs on the monotonic clock, like the ticks
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->cv, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&w->thread, NULL, wheel_thread, w) != 0) {
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cv);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+// function to stop and free a wheel
+void wheel_delete(wheel_t **w) {
+    wheel_t *wh = *w;
+    pthread_mutex_lock(&wh->lock);
+    wh->stopping = true;
+    pthread_cond_signal(&wh->cv);
+    pthread_mutex_unlock(&wh->lock);
+    pthread_join(wh->thread, NULL);
+    pthread_mutex_destroy(&wh->lock);
+    pthread_cond_destroy(&wh->cv);
+    free(wh);
+    *w = NULL;
+}
+
+// function to arm or move a deadline
+void wheel_arm(wheel_t *w, deadline_t *d, long ms) {
+    pthread_mutex_lock(&w->lock);
+    arm_locked(w, d, ms);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// function to disarm a deadline
+void wheel_cancel(wheel_t *w, deadline_t *d) {
+    pthread_mutex_lock(&w->lock);
+    if (d->armed) {
+        unlink_deadline(d);
+        d->armed = false;
+        w->pending--;
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+// function to report the wheel counters
+void wheel_dump_stats(wheel_t *w, FILE *out) {
+    pthread_mutex_lock(&w->lock);
+    fprintf(out, "STATS,wheel,pending=%lu,armed=%lu,fired=%lu,cascaded=%lu\n", (unsigned long) w->pending,
+        (unsigned long) w->armed, (unsigned long) w->fired, (unsigned long) w->cascaded);
+    pthread_mutex_unlock(&w->lock);
+}
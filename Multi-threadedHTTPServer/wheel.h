@@ -0,0 +1,75 @@
+/**
+ * @File wheel.h
+ *
+ * A hierarchical timing wheel: four levels of 64 slots, each level
+ * 64 times coarser than the one below it.  Deadlines live on intrusive
+ * lists, so arming and cancelling are O(1) and never allocate or make a
+ * system call.  A single wheel thread advances one tick at a time,
+ * cascades far deadlines down as they come near, and fires the due
+ * ones.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct Wheel wheel_t;
+
+/** @struct deadline_t
+ *
+ *  @brief A deadline, embedded in whatever it guards.
+ */
+typedef struct Deadline {
+    struct Deadline *next; // next in its slot
+    struct Deadline *prev; // previous in its slot
+    uint64_t expires; // tick it is due at
+    bool armed; // on the wheel
+    // Called on the wheel thread, with the wheel locked, once the
+    // deadline passes.  Returns milliseconds to re-arm it for, or 0.
+    long (*fire)(void *arg);
+    void *arg; // passed to fire
+} deadline_t;
+
+/** @brief Creates a wheel and starts its thread.
+ *
+ *  @param tick_ms the resolution, in milliseconds
+ *
+ *  @return the wheel, or NULL on failure
+ */
+wheel_t *wheel_new(long tick_ms);
+
+/** @brief Stops the wheel thread and frees the wheel.  Deadlines still
+ *         armed never fire.
+ *
+ *  @param w the wheel to delete
+ */
+void wheel_delete(wheel_t **w);
+
+/** @brief Arms a deadline, moving it if it is already armed.
+ *
+ *  @param w the wheel
+ *
+ *  @param d the deadline, with fire and arg set
+ *
+ *  @param ms milliseconds from now; rounded up to whole ticks
+ */
+void wheel_arm(wheel_t *w, deadline_t *d, long ms);
+
+/** @brief Disarms a deadline.  Once this returns, its fire is neither
+ *         running nor going to run.
+ *
+ *  @param w the wheel
+ *
+ *  @param d the deadline, armed or not
+ */
+void wheel_cancel(wheel_t *w, deadline_t *d);
+
+/** @brief Writes a STATS line with the wheel counters.
+ *
+ *  @param w the wheel
+ *
+ *  @param out the stream to write to
+ */
+void wheel_dump_stats(wheel_t *w, FILE *out);